@@ -0,0 +1,73 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+using namespace std;
+
+// Blocking FIFO with a fixed capacity, used to connect the stages of the pipelined decoder.
+// A full queue stops the producer, so a slow stage limits memory instead of letting it grow.
+template <class T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity) : m_capacity(capacity > 0 ? capacity : 1) {}
+
+	BoundedQueue(const BoundedQueue &) = delete;
+	BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+	/**
+	 * @brief 放入一个元素，队列满时阻塞
+	 * @param item 放入的元素
+	 * @return 返回放入状态（0 表示队列已关闭，1 表示成功）
+	 */
+	int Push(T &&item)
+	{
+		unique_lock<mutex> lock(m_mutex);
+		m_not_full.wait(lock, [this]
+						{ return m_closed || m_items.size() < m_capacity; });
+		if (m_closed)
+			return 0;
+		m_items.push_back(std::move(item));
+		m_not_empty.notify_one();
+		return 1;
+	}
+
+	/**
+	 * @brief 取出一个元素，队列空时阻塞
+	 * @param item 取出的元素
+	 * @return 返回取出状态（0 表示队列已关闭且为空，1 表示成功）
+	 */
+	int Pop(T &item)
+	{
+		unique_lock<mutex> lock(m_mutex);
+		m_not_empty.wait(lock, [this]
+						 { return m_closed || !m_items.empty(); });
+		if (m_items.empty())
+			return 0;
+		item = std::move(m_items.front());
+		m_items.pop_front();
+		m_not_full.notify_one();
+		return 1;
+	}
+
+	/**
+	 * @brief 关闭队列：不再接受新元素，已有元素仍可取出
+	 */
+	void Close()
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_closed = true;
+		m_not_empty.notify_all();
+		m_not_full.notify_all();
+	}
+
+private:
+	size_t m_capacity;
+	bool m_closed = false;
+	deque<T> m_items;
+	mutex m_mutex;
+	condition_variable m_not_empty;
+	condition_variable m_not_full;
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// One memory cell of a chip: 36 TDC (high gain) words, 36 ADC (low gain) words and its BCID
+template <int Slot_Size>
+struct ChipSlot
+{
+	uint16_t word[Slot_Size];
+	int BCID() const { return word[Slot_Size - 1]; }
+};
+
+// Preallocated chip buffers for one event. Every chip owns Memo_Max fixed-size slots, and
+// the chips holding data are tracked by a layer bitmask plus one chip bitmask per layer,
+// so filling, clearing and the emptiness check never touch the heap.
+template <int Layer_No, int chip_No, int Memo_Max, int Slot_Size>
+class ChipArena
+{
+	static_assert(Layer_No <= 64 && chip_No <= 16, "occupancy masks are too small");
+
+public:
+	typedef ChipSlot<Slot_Size> Slot;
+
+	ChipArena() : m_slots(Layer_No * chip_No * Memo_Max) {}
+
+	/**
+	 * @brief 为一个芯片分配 memo_No 个存储单元，原有数据被覆盖
+	 * @return 返回第一个存储单元，memo_No 超出容量时返回空指针
+	 */
+	Slot *Acquire(int layer, int chip, int memo_No)
+	{
+		if (memo_No < 1 || memo_No > Memo_Max)
+			return nullptr;
+		m_memo_No[layer][chip] = memo_No;
+		m_chip_mask[layer] |= 1u << chip;
+		m_layer_mask |= uint64_t(1) << layer;
+		return &m_slots[(layer * chip_No + chip) * Memo_Max];
+	}
+
+	const Slot &Get(int layer, int chip, int memo) const { return m_slots[(layer * chip_No + chip) * Memo_Max + memo]; }
+	int MemoNo(int layer, int chip) const { return m_memo_No[layer][chip]; }
+	uint64_t LayerMask() const { return m_layer_mask; }
+	uint16_t ChipMask(int layer) const { return m_chip_mask[layer]; }
+	bool Empty() const { return m_layer_mask == 0; }
+
+	void Clear()
+	{
+		for (uint64_t layers = m_layer_mask; layers; layers &= layers - 1)
+			m_chip_mask[__builtin_ctzll(layers)] = 0;
+		m_layer_mask = 0;
+	}
+
+private:
+	vector<Slot> m_slots;
+	uint8_t m_memo_No[Layer_No][chip_No] = {};
+	uint16_t m_chip_mask[Layer_No] = {};
+	uint64_t m_layer_mask = 0;
+};
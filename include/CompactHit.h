@@ -0,0 +1,16 @@
+#pragma once
+
+// Compact Raw_Hit schema: HG_Charge, LG_Charge, Hit_Time and BCID are vector<unsigned short>,
+// HitTag, GainTag and GainTag_TDC are packed into one vector<unsigned char> "HitFlags".
+// Written by DatManager (DAT-ROOT "compact") and unpacked again by HBase::GetEntry.
+namespace CompactHit
+{
+	const unsigned char kHitTag = 1 << 0;	  // HitTag 1
+	const unsigned char kGainTag = 1 << 1;	  // GainTag 1
+	const unsigned char kNoGainTag = 1 << 2;  // GainTag -1 (no auto gain)
+	const unsigned char kGainTagTDC = 1 << 3; // GainTag_TDC 1
+	const unsigned short kNoValue = 0xffff;	  // -1 in HG_Charge, LG_Charge or Hit_Time
+
+	inline unsigned short Pack(double value) { return value < 0 ? kNoValue : (unsigned short)value; }
+	inline double Unpack(unsigned short value) { return value == kNoValue ? -1 : value; }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BoundedQueue.h"
+
+using namespace std;
+
+// Archived .dat inputs (.dat.gz, .dat.xz, .dat.zst), recognised by their magic bytes and read through an
+// istream like the plain file. A background thread decompresses into blocks, so decompression overlaps
+// with decoding. Inputs made of independent parts are decompressed on several threads: zstd files with
+// several frames (pzstd; zstd -T writes one frame) and xz files with several blocks (xz -T, needs liblzma 5.4).
+class CompressedInput : public streambuf
+{
+public:
+	enum Format
+	{
+		kNone = 0,
+		kGzip,
+		kXz,
+		kZstd,
+	};
+
+	CompressedInput() {};
+	~CompressedInput();
+
+	CompressedInput(const CompressedInput &) = delete;
+	CompressedInput &operator=(const CompressedInput &) = delete;
+
+	/**
+	 * @brief 根据文件开头的 magic bytes 判断压缩格式
+	 * @param file_name 输入文件名
+	 * @return 返回压缩格式，未压缩或无法读取时为 kNone
+	 */
+	static Format Detect(const string &file_name);
+
+	static const char *Name(Format format);
+
+	/**
+	 * @brief 编译时是否支持该压缩格式（zstd 需要 HBUANA_WITH_ZSTD）
+	 */
+	static bool Available(Format format);
+
+	/**
+	 * @brief 打开压缩文件并开始在后台线程中解压
+	 * @param file_name 输入文件名
+	 * @param format 压缩格式
+	 * @param threads 解压线程数（多帧 zstd、多块 xz），0 表示使用全部 CPU
+	 * @return 返回打开状态（0 表示失败，1 表示成功）
+	 */
+	int Open(const string &file_name, Format format, int threads);
+
+	/**
+	 * @brief 停止解压线程并释放缓冲区
+	 */
+	void Close();
+
+	/**
+	 * @brief 解压是否因数据损坏或文件不完整而提前结束
+	 */
+	bool Failed() const { return m_failed; }
+
+protected:
+	int_type underflow() override;
+
+private:
+	static constexpr size_t s_block_size = 1 << 22; // Decompressed bytes per block
+	static constexpr size_t s_read_size = 1 << 20;	// Compressed bytes read at once
+	static constexpr size_t s_queue_size = 4;		// Blocks waiting for the decoder
+	static constexpr size_t s_max_frame_size = 1 << 28; // zstd frames up to this decompressed size are decompressed in parallel
+
+	unique_ptr<BoundedQueue<vector<char>>> m_queue;
+	vector<char> m_block; // Block currently read by the decoder
+	thread m_worker;
+	atomic<bool> m_failed{false};
+
+	// Decompress the whole file into m_queue, stop early when the queue is closed
+	void ReadGzip(const string &file_name);
+	void ReadXz(const string &file_name, int threads);
+	void ReadZstd(const string &file_name, int threads);
+	void Fail(const string &file_name, const string &reason);
+};
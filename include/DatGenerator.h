@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Writes synthetic raw .dat files in the format read by DatManager (see Doc/datastructure.md):
+// event bags with one SPIROC bag per layer, chips with one or more memory cells, Cherenkov
+// bits in the event counter and, optionally, corrupted events.
+class DatGenerator
+{
+public:
+	// Kinds of corruption injected into an event
+	enum ErrorType
+	{
+		kGarbage = 0,		  // Random bytes after the event bag
+		kNoFooter = 1,		  // Event bag without 0xfeddfedd
+		kBadLayer = 2,		  // Layer byte above 39
+		kTriggerMismatch = 3, // One SPIROC bag with a different triggerID
+		kTruncatedChip = 4,	  // Words missing from one chip block
+		kErrorTypes = 5
+	};
+
+	DatGenerator() {};
+
+	void SetLayers(int layers) { m_layers = layers; }
+	void SetChips(int chips) { m_chips = chips; }
+	void SetMemoCells(int memo_cells) { m_memo_cells = memo_cells; }
+	void SetChipOccupancy(double occupancy) { m_chip_occupancy = occupancy; }
+	void SetHitOccupancy(double occupancy) { m_hit_occupancy = occupancy; }
+	void SetCherenkovRate(double rate) { m_cherenkov_rate = rate; }
+	void SetErrorRate(double rate) { m_error_rate = rate; }
+	void SetFirstTrigger(int trigger) { m_first_trigger = trigger; }
+	void SetEventsPerCycle(int events) { m_events_per_cycle = events; }
+	void SetSeed(unsigned int seed) { m_rng.seed(seed); }
+
+	/**
+	 * @brief 生成一个包含 n_events 个事件包的原始数据文件
+	 * @param file_name 输出文件名
+	 * @param n_events 事件包数
+	 * @return 返回生成状态（0 表示无法创建文件，1 表示成功）
+	 */
+	int Generate(const string &file_name, long n_events);
+
+	/**
+	 * @brief 生成每层一个的 FELIX 原始数据文件、它们的文件列表，以及合并后内容相同的 .dat 文件（不含损坏事件）
+	 * @param list_file 文件列表名，各层文件为 <去掉扩展名的 list_file>_layer<N>.felix，.dat 文件为 <去掉扩展名的 list_file>.dat
+	 * @param n_events 事件包数
+	 * @param late_events 奇数层从第 late_events 个事件包开始（例如位于 triggerID 回绕的另一侧）
+	 * @return 返回生成状态（0 表示无法创建文件，1 表示成功）
+	 */
+	int GenerateFelix(const string &list_file, long n_events, long late_events);
+
+	/**
+	 * @brief 生成一个事件包并追加到 out
+	 * @param event 事件序号，决定 cycleID、triggerID 与时间
+	 * @param out 输出数据
+	 */
+	void GenerateEvent(long event, vector<unsigned char> &out);
+
+	// Number of corrupted events written by the last Generate
+	long GetErrorNo() const { return m_error_No; }
+
+private:
+	int m_layers = 40;			  // Layers 0 .. m_layers-1 appear in every event
+	int m_chips = 9;			  // Chips per layer
+	int m_memo_cells = 1;		  // Memory cells per chip with data, 1 .. m_memo_cells at random
+	double m_chip_occupancy = 0.3; // Probability that a chip has data in an event
+	double m_hit_occupancy = 0.1;  // Probability of the hit bit per channel
+	double m_cherenkov_rate = 0.3; // Probability of each of the two Cherenkov bits
+	double m_error_rate = 0;	   // Probability that an event is corrupted
+	int m_first_trigger = 1;
+	int m_events_per_cycle = 10;
+	long m_error_No = 0;
+	unsigned int m_time = 1000;
+	mt19937 m_rng{1};
+
+	bool Chance(double p) { return uniform_real_distribution<double>(0, 1)(m_rng) < p; }
+	int Random(int min, int max) { return uniform_int_distribution<int>(min, max)(m_rng); }
+	static void PutWord(vector<unsigned char> &out, int word);
+	// One event bag as a FELIX packet, with a block tag across every 1 kB boundary; raw counts the bytes of the file
+	static void PutFelixPacket(ofstream &f_out, uint64_t &raw, const vector<unsigned char> &bag);
+	void PutChip(vector<unsigned char> &out, int chip_id, bool truncate);
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// One event bag of a raw .dat file as framed by DatManager::CatchEventBag
+struct IndexRecord
+{
+	uint64_t offset = 0;  // Position of the 0xfbeefbee header
+	uint32_t length = 0;  // Bag length including header and footer
+	int32_t cycleID = -1; // cycleID of the first SPIROC bag, -1 if the bag has none
+	int32_t triggerID = -1; // Raw 16-bit triggerID of the first SPIROC bag, -1 if the bag has none
+	uint32_t counter = 0; // Cherenkov counter, Event_Time = counter & 0x3fffffff
+};
+
+// Sidecar event index "<file>.dat.idx": a fixed header with the size and modification time
+// of the .dat file, followed by one IndexRecord per event bag. An index whose size or mtime
+// does not match the .dat file, or whose records are not bags of it in file order, is ignored and rebuilt.
+class DatIndex
+{
+public:
+	DatIndex() {};
+
+	/**
+	 * @brief 返回 .dat 文件对应的索引文件名
+	 * @param dat_file 原始数据文件名
+	 */
+	static string FileName(const string &dat_file) { return dat_file + ".idx"; }
+
+	/**
+	 * @brief 读取 .dat 文件的索引，检查文件大小与修改时间
+	 * @param dat_file 原始数据文件名
+	 * @return 返回读取状态（0 表示索引不存在、已损坏或与数据文件不符，1 表示成功）
+	 */
+	int Load(const string &dat_file);
+
+	/**
+	 * @brief 写出索引文件（先写临时文件再改名），记录 .dat 文件当前的大小与修改时间
+	 * @param dat_file 原始数据文件名
+	 * @return 返回写出状态（0 表示失败，1 表示成功）
+	 */
+	int Save(const string &dat_file) const;
+
+	void Clear() { m_records.clear(); }
+	void Add(const IndexRecord &record) { m_records.push_back(record); }
+	bool Empty() const { return m_records.empty(); }
+	size_t Size() const { return m_records.size(); }
+	const IndexRecord &operator[](size_t i) const { return m_records[i]; }
+
+	/**
+	 * @brief 返回第一个 offset 不小于 pos 的记录序号，没有时返回 Size()
+	 * @param pos 文件位置
+	 */
+	size_t LowerBound(uint64_t pos) const;
+
+private:
+	static constexpr char s_magic[8] = {'H', 'B', 'U', 'I', 'D', 'X', '0', '1'};
+	static constexpr uint64_t s_least_bag_size = 4; // Event bag header, a bag cut at the next header has no footer
+	struct Header
+	{
+		char magic[8];
+		uint64_t file_size;
+		int64_t mtime_sec;
+		int64_t mtime_nsec;
+		uint64_t record_No;
+	};
+	vector<IndexRecord> m_records;
+
+	/**
+	 * @brief 读取 .dat 文件的大小与修改时间写入 header
+	 * @return 返回状态（0 表示文件不存在，1 表示成功）
+	 */
+	static int Stat(const string &dat_file, Header &header);
+};
@@ -2,19 +2,83 @@
 
 #include <stdio.h>
 
+#include <chrono>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <sstream>
 #include <vector>
 #include <string>
 #include <array>
+#include <unordered_map>
 
 #include <TFile.h>
 #include <TTree.h>
 #include <TMath.h>
 
+#include "MappedFile.h"
+#include "ChipArena.h"
+#include "BoundedQueue.h"
+#include "NTupleWriter.h"
+#include "CompactHit.h"
+#include "DatIndex.h"
+#include "DecodeStats.h"
+#include "CompressedInput.h"
+#include "RingInput.h"
+#include "FelixInput.h"
+#include "Logger.h"
+
 using namespace std;
 
+// One SPIROC bag inside an event bag. The chip data stays in the event buffer and is
+// read as big-endian 16-bit words, without the fa5a/feee markers, cycleID and triggerID.
+struct SPIROCBag
+{
+	int layer_id = 0;
+	int cycleID = 0;
+	int triggerID = 0;
+	const unsigned char *data = nullptr; // First chip data word
+	size_t word_No = 0;					 // Number of chip data words
+	int Word(size_t i) const { return data[2 * i] * 0x100 + data[2 * i + 1]; }
+};
+
+// Read-only view of one event bag inside the mapped file (or m_buffer in stream mode)
+struct EventBagView
+{
+	size_t offset = 0; // Position of the 0xfbeefbee header
+	size_t length = 0; // Bag length including header and footer
+};
+
+// One decoded event passed from an unpacker thread to the writer in pipeline mode
+struct EventRecord
+{
+	int cycleID = 0;
+	long triggerID = 0; // Raw triggerID, the writer adds Loop_No
+	unsigned int Event_Time = 0;
+	vector<int> cellID;
+	vector<int> bcid;
+	vector<int> hitTag;
+	vector<int> gainTag_tdc;
+	vector<int> gainTag;
+	vector<int> cherenkov;
+	vector<double> HG_Charge;
+	vector<double> LG_Charge;
+	vector<double> Hit_Time;
+};
+
+// Consecutive event bags, the unit of work passed between the pipeline stages
+struct BagBatch
+{
+	size_t seq = 0;						// Position of the batch in the file, the writer restores this order
+	bool mapped = false;				// Bags point into the mapped file instead of data
+	vector<unsigned char> data;			// Copy of the bags in stream mode
+	vector<EventBagView> bags;			// Bags relative to data or to the mapped file
+	vector<long> cherenkov_counter;		// Cherenkov counter of each bag
+	vector<EventRecord> events;			// Filled by the unpacker
+	size_t end = 0;						// End of the last bag in the mapped file
+};
+
 class DatManager
 {
 private:
@@ -22,6 +86,7 @@ private:
 	static const int Layer_No = 40;
 	static const int chip_No = 9;
 	static const int channel_No = 36;
+	static const int cell_SP = 16; // Memory cells (SCA) per chip
 
 	// 2. Constants for event - using constexpr for compile-time optimization
 	static constexpr std::array<unsigned char, 4> s_event_head = {0xfb, 0xee, 0xfb, 0xee};
@@ -31,6 +96,11 @@ private:
 	static constexpr size_t s_event_head_overlap = s_event_head_size - 1;
 	static constexpr size_t s_event_foot_overlap = s_event_foot_size - 1;
 	static constexpr size_t s_least_event_size = s_event_head_size + s_event_foot_size;
+	static constexpr std::array<unsigned char, 4> s_spiroc_head = {0xfa, 0x5a, 0xfa, 0x5a};
+	static constexpr std::array<unsigned char, 4> s_spiroc_foot = {0xfe, 0xee, 0xfe, 0xee};
+	static constexpr size_t s_least_spiroc_size = 74; // Minimum size for a valid SPIROC bag
+	static constexpr size_t s_spiroc_id_size = 6;	  // cycleID (4 bytes) + triggerID (2 bytes) after the header
+	static constexpr size_t s_spiroc_marker_words = 4; // fa5a fa5a ... feee feee
 
 	// 3. Buffers to hold data read from file
 	static constexpr size_t s_read_size = 40960;					// Size of temp_buffer to read from file
@@ -39,8 +109,436 @@ private:
 	vector<unsigned char> m_buffer;									// Buffer for read data
 	size_t m_buffer_start = 0;									// Start position of valid data in m_buffer
 
-	vector<int> m_event_v; // Vector for 1 event data
-	vector<int> _buffer_v; // Buffer for 1 SPIROC data
+
+	// 4. Memory-mapped input
+	static constexpr size_t s_release_size = 1 << 26; // Hand consumed pages back to the kernel every 64 MB
+	bool m_use_mmap = false;
+	MappedFile m_map;
+	int m_chunks = 1; // Byte ranges of one file decoded in parallel (needs the mapped input)
+
+	// 5. Pipelined decode: reader thread -> unpacker threads -> writer (the calling thread)
+	static constexpr size_t s_batch_bags = 256; // Event bags per BagBatch
+	int m_unpackers = 0;						// Unpacker threads, 0 decodes on one thread
+
+	// 6. Follow mode: decode a .dat file that is still being written
+	static constexpr int s_follow_poll_ms = 500; // Wait between two checks for new data
+	bool m_follow = false;
+	int m_follow_timeout = 60;	// Stop after this many seconds without new data
+	int m_autosave_interval = 10; // Seconds between two AutoSaves of the output tree
+
+	// 7. RNTuple output instead of the Raw_Hit TTree
+	bool m_rntuple = false;
+	NTupleWriter m_ntuple;
+
+	// 8. Compact TTree schema, filled from the output branch variables just before Fill
+	bool m_compact = false;
+	vector<unsigned short> m_compact_bcid;
+	vector<unsigned short> m_compact_HG;
+	vector<unsigned short> m_compact_LG;
+	vector<unsigned short> m_compact_time;
+	vector<unsigned char> m_compact_flags;
+	void PackCompact();
+
+	// 9. Output file tuning, 0 (or -1 for the compression) keeps the ROOT default
+	int m_compression = -1;	 // ROOT compression settings, 100 * algorithm + level
+	int m_basket_size = 0;	 // Basket size of every branch in bytes
+	Long64_t m_autoflush = 0; // TTree::SetAutoFlush: > 0 entries, < 0 bytes
+	Long64_t m_autosave = 0;	 // TTree::SetAutoSave: > 0 entries, < 0 bytes
+
+	// 10. Sidecar event index: offsets of all event bags, loaded from <file>.idx or built once and saved
+	bool m_use_index = false;
+	DatIndex m_index;
+
+	// 11. Counters and trigger tracking carried from one event bag to the next
+	struct DecodeStatus
+	{
+		int Bag_No = 0;
+		int Event_No = 0;
+		int Cherenkov_Event_No1 = 0;
+		int Cherenkov_Event_No2 = 0;
+		int Cherenkov_Event_No = 0;
+		int Abnormal_Event_No = 0;
+		int Loop_No = 0;
+		long pre_trigID = 0;
+		long pre_cycleID = 0;
+		long first_trigID = -1; // Raw triggerID of the first event, used to continue Loop_No across chunks
+		long last_trigID = -1;
+		long last_cycleID = -1;
+		unsigned int last_Event_Time = 0;
+		long select_bag_No = 0; // Number of the next event bag in the file, for the event range of the selection
+
+		// Calls field(name, member) for every member, the checkpoint writes and restores them by name
+		template <class Field>
+		void ForEachField(Field &&field)
+		{
+			field("Bag_No", Bag_No);
+			field("Event_No", Event_No);
+			field("Cherenkov_Event_No1", Cherenkov_Event_No1);
+			field("Cherenkov_Event_No2", Cherenkov_Event_No2);
+			field("Cherenkov_Event_No", Cherenkov_Event_No);
+			field("Abnormal_Event_No", Abnormal_Event_No);
+			field("Loop_No", Loop_No);
+			field("pre_trigID", pre_trigID);
+			field("pre_cycleID", pre_cycleID);
+			field("first_trigID", first_trigID);
+			field("last_trigID", last_trigID);
+			field("last_cycleID", last_cycleID);
+			field("last_Event_Time", last_Event_Time);
+			field("select_bag_No", select_bag_No);
+		}
+	};
+	DecodeStatus m_status;
+
+	// 12. Statistics of the last Decode, optionally written as <output>.stats.json
+	bool m_write_stats = false;
+	DecodeStats m_stats;
+
+	// 13. Zero suppression: Raw_Hit keeps only channels with the hit bit or a charge above the threshold of their
+	//     cell, every m_zs_prescale-th event is also written unsuppressed to Raw_Hit_Ped for the pedestal analysis
+	bool m_zero_suppress = false;
+	double m_zs_threshold = -1;		   // Threshold of cells without an own one, < 0 keeps only channels with the hit bit
+	vector<float> m_zs_cell_threshold; // Own threshold of each cell (NaN for none), indexed by ZSCellIndex
+	int m_zs_prescale = 100;		   // 0 writes no Raw_Hit_Ped
+	TTree *m_ped_tree = nullptr;
+	TTree *m_time_tree = nullptr; // Raw_Hit_Time: Event_Time of every event, for the event counts of the pedestal cut
+	long m_zs_event_No = 0;
+	int m_suppressed_No = 0; // Suppressed_No branch: channels removed from the current event
+	static int ZSCellIndex(int cellID);
+	void SuppressChannels();
+
+	// 14. Event sink: decoded events go to a callback instead of an output file (e.g. the fused pedestal analysis)
+	function<void(const DatManager &)> m_event_sink;
+
+	// 15. Compressed inputs (.dat.gz, .dat.xz, .dat.zst), always read as a stream
+	int m_decompress_threads = 0; // Threads for multi-frame zstd and multi-block xz files, 0 for all CPUs
+
+	// 16. Checkpoints: the serial decode AutoSaves the output trees every m_checkpoint_interval seconds together with
+	//     the resume point (Decode_Checkpoint in the output file), a restarted Decode continues from there
+	double m_checkpoint_interval = 0; // Seconds, 0 takes no checkpoints and always decodes from the start
+	function<void(size_t)> m_checkpoint_hook; // Called with the resume offset after every checkpoint
+	TFile *m_checkpoint_file = nullptr; // Output file of the running Decode while checkpoints are taken
+	string m_checkpoint_settings;		// Decode settings the output depends on, a checkpoint with others is not used
+	chrono::steady_clock::time_point m_next_checkpoint;
+	deque<void *> m_branch_objects; // Vector branch addresses of trees read back from a file
+
+	// 17. Selective decoding: event bags outside the ranges are skipped after the framing, without unpacking the SPIROC bags
+	struct SelectRange
+	{
+		long long min = 0;
+		long long max = -1; // -1 for no upper limit
+		bool All() const { return min <= 0 && max < 0; }
+		bool Contains(long long value) const { return value >= min && (max < 0 || value <= max); }
+	};
+	SelectRange m_select_event; // Event bag numbers in file order, from 0
+	SelectRange m_select_cycle; // cycleID of the first SPIROC bag
+	SelectRange m_select_time;	// Event_Time
+	SelectRange m_select_byte;	// Offset of the event bag header in the (decompressed) input
+	bool Selecting() const { return !m_select_event.All() || !m_select_cycle.All() || !m_select_time.All() || !m_select_byte.All(); }
+
+	// 18. Stream sources (stdin, named pipes, Unix sockets), read through a ring buffer of fixed size
+	size_t m_ring_size = 16 << 20; // Ring buffer bytes, an event bag must fit in it
+
+	// 19. FELIX inputs: the input file is a list of per-layer FELIX raw files, merged into event bags while decoding
+	bool m_felix = false;
+	size_t m_felix_window = 64; // Event bags read ahead per layer, bags more out of order than this are dropped
+
+	// 20. Event builder: SPIROC bags are assembled into events by (cycleID, triggerID), also across event bags, so
+	//     layers whose bags interleave with the next event bag are not lost; at most m_builder_window events are open
+	struct OpenEvent
+	{
+		int cycleID = 0;
+		int triggerID = 0;
+		long cherenkov_counter = 0;	 // Of the event bag that opened it
+		long opened = 0;			 // Bag_No of that event bag
+		uint64_t layer_mask = 0;	 // Layers that reported
+		vector<unsigned char> data;	 // Chip data of its SPIROC bags one after another, copied from the event bags
+		vector<SPIROCBag> bags;
+	};
+	size_t m_builder_window = 0;					   // 0 decodes every event bag on its own
+	uint64_t m_builder_config_layers = 0;			   // Expected layers from the configuration, 0 to learn them
+	deque<OpenEvent> m_open_events;					   // In the order they were opened, emitted from the front
+	unordered_map<uint64_t, OpenEvent *> m_open_index; // (cycleID << 16) + triggerID, null for an emitted event
+	deque<pair<uint64_t, long>> m_closed_keys;		   // Emitted events with the Bag_No of their emission, kept for a window
+	uint64_t m_builder_layers = 0;					   // Expected layers, an event with all of them is complete
+
+	// 21. Per-file summary lines, printed at once or kept for the caller when files are decoded in parallel;
+	//     a file that cannot be decoded leaves its error as the summary
+	string m_summary;
+	bool m_print_summary = true;
+	void Summary(const string &line, LogLevel level = kInfo);
+
+	// 22. How one Decode reads its input: the kind of input decides which of the requested modes can be used
+	enum class InputKind
+	{
+		kFile,		 // Uncompressed .dat file
+		kCompressed, // .dat.gz, .dat.xz or .dat.zst, read as a stream
+		kStream,	 // stdin, named pipe or Unix socket, read through the ring buffer
+		kFelix		 // List of per-layer FELIX files
+	};
+	struct DecodeModes
+	{
+		bool select = false;	 // Selective decoding, skipped bags are only framed
+		bool build = false;		 // Event builder
+		bool follow = false;	 // Follow the file while it grows
+		bool map = false;		 // Read the memory-mapped file
+		bool index = false;		 // Read the event bags from the index of the mapped file
+		bool chunks = false;	 // Decode the mapped file in m_chunks byte ranges
+		bool pipeline = false;	 // Reader, m_unpackers unpacker threads and writer
+		bool checkpoint = false; // Serial decode into a TTree that takes checkpoints
+		string unavailable;		 // Requested modes this input cannot use, e.g. " (mmap and chunks need a regular file)"
+	};
+
+	/**
+	 * @brief 由输入类型与各项设置决定本次解码使用的模式，并给出所请求但此输入不能使用的模式
+	 * @param input 输入类型
+	 * @return 返回使用的模式，unavailable 为空或为附加在输入摘要后的说明
+	 */
+	DecodeModes SelectModes(InputKind input) const;
+
+	/**
+	 * @brief 解码一个事件包中的所有 SPIROC 包，并将得到的事例写入 TTree
+	 * @param event 事件包数据起始地址（包含 header 和 footer）
+	 * @param event_size 事件包长度
+	 * @param cherenkov_counter 切伦科夫计数器
+	 * @param tree 输出 TTree
+	 * @param b_auto_gain 是否自动增益
+	 * @param b_cherenkov 是否启用切伦科夫探测器
+	 */
+	void DecodeEventBag(const unsigned char *event, size_t event_size, long cherenkov_counter, TTree *tree, const bool b_auto_gain, const bool b_cherenkov);
+
+	/**
+	 * @brief 判断下一个事件包是否被选中，只用到事件包的框架：序号、位置、切伦科夫计数器中的 Event_Time 与第一个 SPIROC 包的 cycleID
+	 * @param event 事件包数据起始地址（包含 header 和 footer）
+	 * @param event_size 事件包长度
+	 * @param cherenkov_counter 切伦科夫计数器
+	 * @param offset 事件包 header 在输入（解压后）数据中的位置
+	 * @return 返回选择结果（-1 表示之后的事件包都不会被选中，0 表示跳过，1 表示解码）
+	 */
+	int SelectBag(const unsigned char *event, size_t event_size, long cherenkov_counter, size_t offset);
+
+	/**
+	 * @brief 选择时从索引中找到第一个被选中的事件包，跳过之前的事件包
+	 * @param index 事件索引
+	 * @return 返回该事件包的位置，没有被选中的事件包时返回映射文件大小
+	 */
+	size_t SelectStart(const DatIndex &index);
+
+	/**
+	 * @brief 跳过一个事件包时继续跟踪触发 ID 的循环，使之后选中事例的 TriggerID 与完整解码时相同
+	 * @param triggerID 事件包第一个 SPIROC 包的原始 triggerID
+	 */
+	void SkipTrigger(long triggerID);
+
+	/**
+	 * @brief 读取事件包中第一个 SPIROC 包的 cycleID 与 triggerID，不做检查也不解包
+	 * @param event 事件包数据起始地址
+	 * @param event_size 事件包长度
+	 * @param cycleID 返回 cycleID
+	 * @param triggerID 返回原始 triggerID
+	 * @return 返回状态（0 表示事件包中没有 SPIROC 包，1 表示成功）
+	 */
+	int PeekIDs(const unsigned char *event, size_t event_size, int &cycleID, int &triggerID) const;
+
+	/**
+	 * @brief 解码一个事件包中的所有 SPIROC 包，得到的事例保存在输出分支变量中，原始触发 ID 在 m_status.pre_trigID
+	 * @param event 事件包数据起始地址（包含 header 和 footer）
+	 * @param event_size 事件包长度
+	 * @param cherenkov_counter 切伦科夫计数器
+	 * @param b_auto_gain 是否自动增益
+	 * @param b_cherenkov 是否启用切伦科夫探测器
+	 * @return 返回是否得到一个事例（0 表示没有，1 表示有）
+	 */
+	int UnpackEventBag(const unsigned char *event, size_t event_size, long cherenkov_counter, const bool b_auto_gain, const bool b_cherenkov);
+
+	/**
+	 * @brief 解码 _chip_arena 中的芯片数据，得到的事例保存在输出分支变量中，并清空 _chip_arena
+	 * @param cherenkov_counter 切伦科夫计数器
+	 * @param b_auto_gain 是否自动增益
+	 * @param b_cherenkov 是否启用切伦科夫探测器
+	 */
+	void DecodeChips(long cherenkov_counter, const bool b_auto_gain, const bool b_cherenkov);
+
+	/**
+	 * @brief 事例重建：将事件包中的 SPIROC 包按 (cycleID, triggerID) 放入哈希表中的未完成事例，
+	 *        按打开顺序写出所有层都已到达或已超过 m_builder_window 个事件包的事例
+	 * @param event 事件包数据起始地址（包含 header 和 footer）
+	 * @param event_size 事件包长度
+	 * @param cherenkov_counter 切伦科夫计数器
+	 * @param tree 输出 TTree
+	 * @param b_auto_gain 是否自动增益
+	 * @param b_cherenkov 是否启用切伦科夫探测器
+	 */
+	void BuildEvents(const unsigned char *event, size_t event_size, long cherenkov_counter, TTree *tree, const bool b_auto_gain, const bool b_cherenkov);
+
+	/**
+	 * @brief 解码并写出最早打开的未完成事例
+	 * @param tree 输出 TTree
+	 * @param b_auto_gain 是否自动增益
+	 * @param b_cherenkov 是否启用切伦科夫探测器
+	 */
+	void EmitOpenEvent(TTree *tree, const bool b_auto_gain, const bool b_cherenkov);
+
+	/**
+	 * @brief 对输出分支变量中的事例做触发 ID 检查与循环计数，更新计数器并写入 TTree
+	 * @param tree 输出 TTree
+	 */
+	void FillEvent(TTree *tree);
+
+	/**
+	 * @brief 将输出分支变量中的事例交给事例回调，或写入 tree（零压缩时先按预分频写入 Raw_Hit_Ped，再去除通道），tree 为空时写入 RNTuple
+	 * @param tree 输出 TTree
+	 */
+	void WriteEvent(TTree *tree);
+
+	/**
+	 * @brief 交换输出分支变量与 rec 中的事例（不拷贝数据）
+	 * @param rec 事例记录
+	 */
+	void SwapEvent(EventRecord &rec);
+
+	/**
+	 * @brief 流水线解码：读取线程、m_unpackers 个解包线程、调用线程负责写 TTree
+	 * @param f_in 输入文件流或解压流（未使用内存映射时）
+	 * @param tree 输出 TTree
+	 * @param b_auto_gain 是否自动增益
+	 * @param b_cherenkov 是否启用切伦科夫探测器
+	 * @param index 映射文件的事件索引，为空时扫描文件
+	 */
+	void DecodePipeline(istream &f_in, TTree *tree, const bool b_auto_gain, const bool b_cherenkov, const DatIndex *index);
+
+	/**
+	 * @brief 跟随模式：解码文件中已有的完整事件包，然后等待文件增长继续解码，m_follow_timeout 秒没有新数据后结束
+	 * @param f_in 输入文件流
+	 * @param tree 输出 TTree，每 m_autosave_interval 秒 AutoSave 一次
+	 * @param b_auto_gain 是否自动增益
+	 * @param b_cherenkov 是否启用切伦科夫探测器
+	 */
+	void DecodeFollow(ifstream &f_in, TTree *tree, const bool b_auto_gain, const bool b_cherenkov);
+
+	/**
+	 * @brief 将文件中当前可读的数据（最多约 s_buffer_size，包括不足 s_read_size 的尾部）追加到 m_buffer，并清除 eof 状态以便之后继续读取
+	 * @param f_in 输入文件流
+	 * @return 返回读取的字节数
+	 */
+	size_t ReadAvailable(ifstream &f_in);
+
+	/**
+	 * @brief 从 m_buffer 中捕获一个完整的事件包，不读取文件；事件包不完整时保持 m_buffer 状态不变
+	 * @param bag 捕获的事件包在 m_buffer 中的视图
+	 * @param cherenkov_counter 切伦科夫计数器
+	 * @return 返回捕获事件包的状态（0 表示需要更多数据，1 表示成功）
+	 */
+	int CatchBufferedBag(EventBagView &bag, long &cherenkov_counter);
+
+	/**
+	 * @brief 解码映射文件中 header 位于 [begin, end) 范围内的所有事件包
+	 * @param f_map 内存映射的输入文件
+	 * @param begin 范围起始位置
+	 * @param end 范围结束位置
+	 * @param tree 输出 TTree
+	 * @param b_auto_gain 是否自动增益
+	 * @param b_cherenkov 是否启用切伦科夫探测器
+	 * @param index 映射文件的事件索引，为空时扫描文件
+	 */
+	void DecodeRange(const MappedFile &f_map, size_t begin, size_t end, TTree *tree, const bool b_auto_gain, const bool b_cherenkov, const DatIndex *index = nullptr);
+
+	/**
+	 * @brief 解码数据流中 begin 之后的所有事件包，读过的数据随即从环形缓冲区中释放
+	 * @param ring 已打开的数据流
+	 * @param begin 起始位置，之前的数据直接丢弃
+	 * @param tree 输出 TTree
+	 * @param b_auto_gain 是否自动增益
+	 * @param b_cherenkov 是否启用切伦科夫探测器
+	 */
+	void DecodeRing(RingInput &ring, size_t begin, TTree *tree, const bool b_auto_gain, const bool b_cherenkov);
+
+	/**
+	 * @brief 解码由各层 FELIX 原始数据合并得到的所有事件包
+	 * @param felix 已打开的各层 FELIX 文件
+	 * @param tree 输出 TTree
+	 * @param b_auto_gain 是否自动增益
+	 * @param b_cherenkov 是否启用切伦科夫探测器
+	 */
+	void DecodeFelix(FelixInput &felix, TTree *tree, const bool b_auto_gain, const bool b_cherenkov);
+
+	/**
+	 * @brief 将映射文件按事件包 header 切分为 m_chunks 段，先由事件包的 triggerID 求出每段起始的 Loop_No，
+	 *        再多线程解码到临时文件（TriggerID 即为最终值），最后按顺序合并到 tree
+	 * @param tree 输出 TTree
+	 * @param str_out 输出 ROOT 文件名，临时文件名在其后追加 .chunk<i>
+	 * @param b_auto_gain 是否自动增益
+	 * @param b_cherenkov 是否启用切伦科夫探测器
+	 * @param index 映射文件的事件索引，不为空时按索引记录切分并定位事件包
+	 * @return 返回只有一部分写入 tree 的分段数；不能写出或读回的分段改由调用线程按顺序解码，不计入
+	 */
+	int DecodeChunks(TTree *tree, const string &str_out, const bool b_auto_gain, const bool b_cherenkov, const DatIndex *index);
+
+	// Raw triggerIDs of the event bags of one chunk
+	struct TriggerSpan
+	{
+		long first = -1; // -1 for a chunk without triggerIDs
+		long last = -1;
+		int loops = 0; // Rollovers inside the chunk
+	};
+
+	/**
+	 * @brief 取出 [begin, end) 内各事件包第一个 SPIROC 包的 triggerID（有索引时读索引记录，否则只扫描标志字）
+	 * @param f_map 内存映射的输入文件
+	 * @param begin 起始位置（事件包 header）
+	 * @param end 结束位置，header 在其后的事件包不计入
+	 * @param index 事件索引，可以为空
+	 * @return 返回第一个、最后一个 triggerID 与其间的回绕次数
+	 */
+	TriggerSpan ScanTriggers(const MappedFile &f_map, size_t begin, size_t end, const DatIndex *index) const;
+
+	/**
+	 * @brief 将一个分段临时文件中的 Raw_Hit 按顺序追加到 tree
+	 * @param file_name 分段临时文件名
+	 * @param tree 输出 TTree，为空时写入 RNTuple
+	 * @param b_fast 为真时直接复制压缩后的 basket（分段与 tree 的分支和压缩设置相同），否则逐个事例经 WriteEvent 重新写入（零压缩、RNTuple）
+	 * @return 返回追加状态（1 表示全部追加，0 表示分段无法读取、没有追加，-1 表示只追加了一部分）
+	 */
+	int AppendChunk(const string &file_name, TTree *tree, bool b_fast);
+
+	/**
+	 * @brief 取出映射文件中的下一个事件包：有索引时直接读取索引记录，否则调用 CatchEventBag 扫描
+	 * @param f_map 内存映射的输入文件
+	 * @param index 事件索引，可以为空
+	 * @param pos 扫描位置，返回时更新为事件包结束位置
+	 * @param i_record 下一个索引记录序号
+	 * @param bag 事件包在映射文件中的视图
+	 * @param cherenkov_counter 切伦科夫计数器
+	 * @return 返回状态（0 表示没有更多事件包，1 表示成功）
+	 */
+	int NextEventBag(const MappedFile &f_map, const DatIndex *index, size_t &pos, size_t &i_record, EventBagView &bag, long &cherenkov_counter);
+
+	/**
+	 * @brief 到达间隔时记录断点：AutoSave 输出 TTree，并将继续解码的位置与解码状态写入 Decode_Checkpoint
+	 * @param tree 输出 TTree
+	 * @param offset 下一个事件包在输入（解压后）数据中的搜索起始位置
+	 */
+	void Checkpoint(TTree *tree, size_t offset);
+
+	/**
+	 * @brief 打开带有断点的输出文件继续写入，恢复解码状态、统计与 Raw_Hit_Ped，断点与输出文件或解码设置不符时不使用
+	 * @param str_out 输出 ROOT 文件名
+	 * @param fout 返回以 UPDATE 方式打开的输出文件
+	 * @param offset 返回继续解码的输入位置
+	 * @return 返回输出 TTree，没有可用的断点时为空（从头解码）
+	 */
+	TTree *ResumeCheckpoint(const string &str_out, TFile *&fout, size_t &offset);
+
+	/**
+	 * @brief 将从文件读出的 TTree 的分支指向输出分支变量，与 SetTreeBranch 对应
+	 * @param tree 从文件读出的 TTree
+	 */
+	void AttachTreeBranch(TTree *tree);
+
+	/**
+	 * @brief 将 input_file 的索引文件读入 m_index，不存在或与数据文件不符时由 m_map 重新生成并保存
+	 * @param input_file 原始数据文件名
+	 */
+	void LoadIndex(const string &input_file);
 
 public:
 	static const int channel_FEE = 73; //(36charges+36times + BCIDs )*16column+ ChipID
@@ -49,7 +547,8 @@ public:
 	int _cycleID;
 	int _triggerID;
 	unsigned int _Event_Time;
-	vector<int> _chip_v[Layer_No][chip_No];
+	typedef ChipArena<Layer_No, chip_No, cell_SP, channel_FEE> ChipBuffer;
+	ChipBuffer _chip_arena; // Chip data of the current event, one 73-word slot per memory cell
 	vector<int> _cellID;
 	vector<int> _bcid;
 	vector<int> _hitTag;
@@ -74,26 +573,262 @@ public:
 	 */
 	int Decode(const string &binary_name, const string &raw_name, const bool b_auto_gain = 0, const bool b_cherenkov = 0);
 
+	/**
+	 * @brief 是否使用内存映射方式读取输入文件（事件包以只读视图返回，不做拷贝）
+	 * @param use_mmap 是否使用 mmap
+	 */
+	void SetMmap(bool use_mmap) { m_use_mmap = use_mmap; }
+
+	/**
+	 * @brief 将单个文件切分为若干段并行解码（大于 1 时总是使用内存映射读取）
+	 * @param chunks 分段数，即解码线程数
+	 */
+	void SetChunks(int chunks) { m_chunks = chunks > 1 ? chunks : 1; }
+
+	/**
+	 * @brief 流水线解码：读取、解包、写 TTree 在不同线程上同时进行（对分段解码不起作用）
+	 * @param unpackers 解包线程数，0 表示关闭流水线
+	 */
+	void SetPipeline(int unpackers) { m_unpackers = unpackers > 0 ? unpackers : 0; }
+
+	/**
+	 * @brief 跟随模式：在 DAQ 写入的同时解码文件，只解码新增的完整事件包（总是使用文件流读取）
+	 * @param follow 是否启用跟随模式
+	 */
+	void SetFollow(bool follow) { m_follow = follow; }
+
+	/**
+	 * @brief 跟随模式下没有新数据多少秒后结束解码
+	 * @param seconds 等待秒数
+	 */
+	void SetFollowTimeout(int seconds) { m_follow_timeout = seconds; }
+
+	/**
+	 * @brief 跟随模式下 AutoSave 输出 TTree 的间隔，使其他程序可以读取已解码的事例
+	 * @param seconds 间隔秒数
+	 */
+	void SetAutoSaveInterval(int seconds) { m_autosave_interval = seconds; }
+
+	/**
+	 * @brief 以 RNTuple 代替 TTree 写出 Raw_Hit（每个通道的数据放在共享的 Hits 集合中），编译时不支持 RNTuple 则保持 TTree
+	 * @param rntuple 是否使用 RNTuple
+	 */
+	void SetRNTuple(bool rntuple) { m_rntuple = rntuple && NTupleWriter::Available(); }
+
+	/**
+	 * @brief 紧凑 TTree 格式：电荷、时间和 BCID 用 unsigned short，HitTag/GainTag/GainTag_TDC 打包为 HitFlags（见 CompactHit.h）
+	 * @param compact 是否使用紧凑格式
+	 */
+	void SetCompact(bool compact) { m_compact = compact; }
+
+	/**
+	 * @brief 设置输出文件的压缩算法与压缩级别
+	 * @param algorithm 压缩算法（zlib、lzma、lz4、zstd），空字符串表示使用 ROOT 默认设置
+	 * @param level 压缩级别（0-9）
+	 * @return 返回设置状态（0 表示无法识别的算法，保持默认设置，1 表示成功）
+	 */
+	int SetCompression(const string &algorithm, int level);
+
+	/**
+	 * @brief 设置每个分支的 basket 大小
+	 * @param bytes basket 大小（字节），0 表示使用 ROOT 默认值
+	 */
+	void SetBasketSize(int bytes) { m_basket_size = bytes; }
+
+	/**
+	 * @brief 设置 TTree 的 AutoFlush（正数为事例数，负数为字节数，0 表示使用 ROOT 默认值）
+	 * @param autoflush AutoFlush 设置
+	 */
+	void SetAutoFlush(Long64_t autoflush) { m_autoflush = autoflush; }
+
+	/**
+	 * @brief 设置 TTree 的 AutoSave（正数为事例数，负数为字节数，0 表示使用 ROOT 默认值）
+	 * @param autosave AutoSave 设置
+	 */
+	void SetAutoSave(Long64_t autosave) { m_autosave = autosave; }
+
+	/**
+	 * @brief 使用事件索引文件 <file>.idx（总是使用内存映射读取，跟随模式下不起作用）：存在且与数据文件大小、修改时间一致时直接按索引定位事件包，否则先生成并保存
+	 * @param use_index 是否使用索引
+	 */
+	void SetIndex(bool use_index) { m_use_index = use_index; }
+
+	/**
+	 * @brief 扫描映射文件中的所有事件包，记录位置、长度、第一个 SPIROC 包的 cycleID 与 triggerID 以及切伦科夫计数器
+	 * @param f_map 内存映射的输入文件
+	 * @param index 输出的事件索引
+	 */
+	void BuildIndex(const MappedFile &f_map, DatIndex &index);
+
+	/**
+	 * @brief 是否在每个输出 ROOT 文件旁写出解码统计 <output>.stats.json（字节数、事件包数、各层 SPIROC 包数、各类错误计数、各阶段耗时）
+	 * @param write_stats 是否写出统计
+	 */
+	void SetStats(bool write_stats) { m_write_stats = write_stats; }
+
+	/**
+	 * @brief 返回上一次 Decode 的统计
+	 */
+	const DecodeStats &GetStats() const { return m_stats; }
+
+	/**
+	 * @brief 零压缩：Raw_Hit 只保留 HitTag 为 1 或电荷超过阈值的通道，每个事例的去除通道数写入 Suppressed_No 分支（只对 TTree 输出起作用）
+	 * @param zero_suppress 是否零压缩
+	 */
+	void SetZeroSuppress(bool zero_suppress) { m_zero_suppress = zero_suppress; }
+
+	/**
+	 * @brief 零压缩阈值：没有单独阈值的通道电荷（自动增益时为有效的 HG 或 LG 电荷）超过该值时保留
+	 * @param threshold ADC 阈值，负数表示只保留 HitTag 为 1 的通道
+	 */
+	void SetZSThreshold(double threshold) { m_zs_threshold = threshold; }
+
+	/**
+	 * @brief 读取每个通道的零压缩阈值，文件每行为 "CellID 阈值"，未列出的通道使用 SetZSThreshold 的阈值
+	 * @param file_name 阈值文件名，空字符串表示不使用
+	 * @return 返回读取状态（0 表示失败，不使用单独阈值，1 表示成功）
+	 */
+	int SetZSThresholdFile(const string &file_name);
+
+	/**
+	 * @brief 零压缩时每 prescale 个事例中的第一个不做压缩，另外写入 Raw_Hit_Ped（TTree 权重为 prescale），供 PedestalManager 使用
+	 * @param prescale 预分频因子，0 表示不写 Raw_Hit_Ped
+	 */
+	void SetZSPrescale(int prescale) { m_zs_prescale = prescale > 0 ? prescale : 0; }
+
+	/**
+	 * @brief 将解码得到的事例交给回调函数而不写出 ROOT 文件（按文件顺序在调用 Decode 的线程上调用，不做零压缩），例如不经过 Raw_Hit 文件直接做台阶分析
+	 * @param sink 回调函数，参数为当前事例保存在输出分支变量中的 DatManager，空函数表示写出 ROOT 文件
+	 */
+	void SetEventSink(function<void(const DatManager &)> sink) { m_event_sink = std::move(sink); }
+
+	/**
+	 * @brief 压缩输入文件（gzip、xz、zstd，按 magic bytes 识别）的解压线程数，解压在后台线程中与解码同时进行
+	 * @param threads 线程数（只对多帧 zstd、多块 xz 文件起作用），0 表示使用全部 CPU
+	 */
+	void SetDecompressThreads(int threads) { m_decompress_threads = threads > 0 ? threads : 0; }
+
+	/**
+	 * @brief 断点间隔：串行解码（文件流、解压流或内存映射，TTree 输出）每隔 seconds 秒 AutoSave 输出 TTree 并记录断点，
+	 *        重新运行的 Decode 从输出文件中的断点继续，得到与一次解码相同的 TTree
+	 * @param seconds 间隔秒数（可以是小数），0 表示不记录断点，总是从头解码
+	 */
+	void SetCheckpointInterval(double seconds) { m_checkpoint_interval = seconds > 0 ? seconds : 0; }
+
+	/**
+	 * @brief 每记录一个断点后调用的函数，例如 datcheck 在第几个断点后结束解码进程，检查重新运行能否从断点继续
+	 * @param hook 回调函数，参数为断点记录的继续解码位置，空函数表示不调用
+	 */
+	void SetCheckpointHook(function<void(size_t)> hook) { m_checkpoint_hook = std::move(hook); }
+
+	/**
+	 * @brief 数据流输入（"-" 表示标准输入，命名管道、Unix socket）的环形缓冲区大小，一个事件包必须能放入缓冲区
+	 * @param mb 缓冲区大小（MB）
+	 */
+	void SetRingSize(int mb) { m_ring_size = static_cast<size_t>(mb > 0 ? mb : 16) << 20; }
+
+	/**
+	 * @brief 输入文件为每层一个 FELIX 原始数据文件的列表（每行一个文件名），解码时去掉 FELIX 标记并按 (cycleID, triggerID) 合并各层的事件包
+	 * @param felix 是否读取 FELIX 文件列表
+	 */
+	void SetFelix(bool felix) { m_felix = felix; }
+
+	/**
+	 * @brief FELIX 合并时每层最多预读的事件包数，乱序超过该数目的事件包被丢弃
+	 * @param window 事件包数
+	 */
+	void SetFelixWindow(int window) { m_felix_window = window > 0 ? window : 1; }
+
+	/**
+	 * @brief 事例重建：按 (cycleID, triggerID) 合并 SPIROC 包，包括分散在相邻事件包中的 SPIROC 包；
+	 *        所有层都到达或打开后经过 window 个事件包时写出事例。事例重建时不使用分段、流水线解码与断点
+	 * @param window 同时未完成的事例数及超时的事件包数，0 表示每个事件包单独解码
+	 */
+	void SetEventBuilder(int window) { m_builder_window = window > 0 ? window : 0; }
+
+	/**
+	 * @brief 事例重建时一个完整事例应包含的层；为空时从每个文件的前 window 个事件包中得到
+	 * @param layers 层 ID 列表
+	 */
+	void SetEventBuilderLayers(const vector<int> &layers);
+
+	/**
+	 * @brief 只解码文件中序号在 [first, last] 内的事件包（从 0 开始，每个事件包最多得到一个事例）；选择时不使用分段与流水线解码
+	 * @param first 第一个事件包序号
+	 * @param last 最后一个事件包序号，-1 表示到文件结束
+	 */
+	void SetEventRange(long long first, long long last) { m_select_event = {first, last}; }
+
+	/**
+	 * @brief 只解码第一个 SPIROC 包的 cycleID 在 [min, max] 内的事件包
+	 * @param min 最小 cycleID
+	 * @param max 最大 cycleID，-1 表示不限
+	 */
+	void SetCycleRange(long long min, long long max) { m_select_cycle = {min, max}; }
+
+	/**
+	 * @brief 只解码 Event_Time 在 [min, max] 内的事件包
+	 * @param min 最小 Event_Time
+	 * @param max 最大 Event_Time，-1 表示不限
+	 */
+	void SetTimeRange(long long min, long long max) { m_select_time = {min, max}; }
+
+	/**
+	 * @brief 只解码 header 位于输入数据 [begin, end] 字节内的事件包，直接从 begin 开始读取
+	 * @param begin 起始字节
+	 * @param end 结束字节，-1 表示到文件结束
+	 */
+	void SetByteRange(long long begin, long long end) { m_select_byte = {begin, end}; }
+
+	/**
+	 * @brief 是否在解码时直接打印每个文件的摘要信息；并行解码时由调用者按文件列表顺序打印
+	 * @param print_summary 是否直接打印
+	 */
+	void SetPrintSummary(bool print_summary) { m_print_summary = print_summary; }
+
+	/**
+	 * @brief 返回上一次 Decode 的摘要信息（每行以换行结尾）
+	 */
+	const string &GetSummary() const { return m_summary; }
+
 	/**
 	 * @brief 从输入文件中捕获一个完整的事件包
-	 * @param f_in 输入文件流
-	 * @param buffer_v 存储捕获的事件数据
+	 * @param f_in 输入文件流或解压流
+	 * @param bag 捕获的事件包在 m_buffer 中的视图，在下一次调用前有效
 	 * @param cherenkov_counter 切伦科夫计数器
 	 * @return 返回捕获事件包的状态（0 表示失败，1 表示成功）
 	 */
-	int CatchEventBag(ifstream &f_in, vector<int> &buffer_v, long &cherenkov_counter);
+	int CatchEventBag(istream &f_in, EventBagView &bag, long &cherenkov_counter);
 
 	/**
-	 * @brief 从 event_v 中捕获一个 layer 包
-	 * @param event_v 存储 event 数据的 vector
-	 * @param buffer_v 存储捕获的 SPIROC 数据
-	 * @param layer_id 层 ID
-	 * @param cycleID 周期 ID
-	 * @param triggerID 触发 ID
+	 * @brief 从内存映射文件中捕获一个完整的事件包
+	 * @param f_map 内存映射的输入文件
+	 * @param pos 搜索起始位置，成功后更新为事件包结束位置
+	 * @param bag 捕获的事件包在映射文件中的视图
+	 * @param cherenkov_counter 切伦科夫计数器
+	 * @return 返回捕获事件包的状态（0 表示没有更多事件包，1 表示成功）
+	 */
+	int CatchEventBag(const MappedFile &f_map, size_t &pos, EventBagView &bag, long &cherenkov_counter);
+
+	/**
+	 * @brief 从数据流的环形缓冲区中捕获一个完整的事件包，pos 之前的数据被释放
+	 * @param ring 已打开的数据流
+	 * @param pos 搜索起始位置，成功后更新为事件包结束位置
+	 * @param bag 捕获的事件包在数据流中的位置（offset 为数据流中的绝对位置），用 ring.Data() 读取
+	 * @param cherenkov_counter 切伦科夫计数器
+	 * @return 返回捕获事件包的状态（0 表示数据流结束，1 表示成功）
+	 */
+	int CatchEventBag(RingInput &ring, size_t &pos, EventBagView &bag, long &cherenkov_counter);
+
+	/**
+	 * @brief 从事件包的 pos 位置开始捕获一个 layer 包，只记录数据位置，不拷贝也不修改事件数据
+	 * @param event 事件包数据起始地址
+	 * @param event_size 事件包长度
+	 * @param pos 游标位置，返回时更新为已处理数据的结束位置
+	 * @param bag 捕获的 SPIROC 包（层 ID、周期 ID、触发 ID 及芯片数据范围），失败时保持不变
 	 * @return 返回捕获 SPIROC 事件包的状态（0 表示失败，1 表示成功）
 	 */
-	int CatchSPIROCBag(vector<int> &event_v, vector<int> &buffer_v, int &layer_id, int &cycleID, int &triggerID);
-	int CatchSPIROCBag(ifstream &f_in, vector<int> &buffer_v, int &layer_id, int &cycleID, int &triggerID);
+	int CatchSPIROCBag(const unsigned char *event, size_t event_size, size_t &pos, SPIROCBag &bag);
 
 	/**
 	 * @brief 在 TTree 中设置分支，用于存储解码后的数据
@@ -102,25 +837,46 @@ public:
 	void SetTreeBranch(TTree *tree);
 
 	void BranchClear();
-	int DecodeAEvent(vector<int> &chip_v, int layer_ID, int Memo_ID, const bool b_auto_gain);
+
+	/**
+	 * @brief 解码一个芯片的一个存储单元（36 个通道），结果追加到输出分支
+	 * @param slot 存储单元数据（72 个数据字 + BCID）
+	 * @param layer_id 层 ID
+	 * @param chip 芯片 ID（0-8）
+	 * @param Memo_ID 存储单元 ID
+	 * @param b_auto_gain 是否自动增益
+	 */
+	int DecodeAEvent(const ChipBuffer::Slot &slot, int layer_id, int chip, int Memo_ID, const bool b_auto_gain);
 
 	/**
 	 * @brief 检查所有 chip 的缓冲区是否都为空
 	 * @return 返回芯片缓冲区状态（0 表示都为空，1 表示存在缓冲区不为空的 chip）
 	 */
-	int Chipbuffer_empty()
-	{
-		int b_chipbuffer = 0;
-		for (int i_layer = 0; i_layer < Layer_No; ++i_layer)
-		{
-			for (int i_chip = 0; i_chip < chip_No; ++i_chip)
-			{
-				if (_chip_v[i_layer][i_chip].size())
-					b_chipbuffer = 1;
-			}
-		}
-		return b_chipbuffer;
-	}
+	int Chipbuffer_empty() const { return !_chip_arena.Empty(); }
+
+	/**
+	 * @brief 将一个 SPIROC 包中的芯片数据按芯片 ID 分发到对应的芯片缓冲区
+	 * @param bag SPIROC 包
+	 * @return 返回分发状态（0 表示存在无法识别的剩余数据，1 表示成功）
+	 */
+	int FillChipBuffer(const SPIROCBag &bag);
+
+private:
+	/**
+	 * @brief 解码一个存储单元的 36 个通道（SSE2 下每次 4 个通道，无逐通道分支），写入输出分支中 offset 开始的位置，输出分支需已分配
+	 * @tparam AutoGain 是否自动增益
+	 * @param slot 存储单元数据（72 个数据字 + BCID）
+	 * @param layer_id 层 ID
+	 * @param chip 芯片 ID（0-8）
+	 * @param Memo_ID 存储单元 ID
+	 * @param offset 输出分支中的起始位置
+	 */
+	template <bool AutoGain>
+	void DecodeCell(const ChipBuffer::Slot &slot, int layer_id, int chip, int Memo_ID, size_t offset);
 
-	int FillChipBuffer(vector<int> &buffer_v, int cycleID, int triggerID, int layer_id);
+	/**
+	 * @brief 将每个通道一项的输出分支（除 Cherenkov 外）调整为 size 项
+	 * @param size 通道数
+	 */
+	void ResizeColumns(size_t size);
 };
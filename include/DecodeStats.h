@@ -0,0 +1,146 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <string>
+
+using namespace std;
+
+// Counters of one Decode: input volume, SPIROC bags per layer, one counter per error message
+// of the decoder and the wall time of each stage. Written as <output>.stats.json for monitoring.
+struct DecodeStats
+{
+	static const int s_layer_No = 40;
+
+	// 1. Input volume
+	long long bytes = 0; // Input bytes read or mapped
+	long event_bags = 0;
+	long events = 0; // Events written to the output
+	long spiroc_bags = 0;
+	long empty_spiroc_bags = 0; // SPIROC bags without chip data
+	array<long, s_layer_No> layer_spiroc_bags{};
+	long cherenkov1 = 0;
+	long cherenkov2 = 0;
+	long cherenkov_coincidence = 0;
+	long long kept_channels = 0;	   // Zero suppression: channels written to Raw_Hit
+	long long suppressed_channels = 0; // Zero suppression: channels removed from Raw_Hit
+	long ped_events = 0;			   // Zero suppression: unsuppressed events in Raw_Hit_Ped
+	long skipped_bags = 0;			   // Selection: event bags outside the selected ranges, not unpacked
+	long extra_memory_cells = 0;	   // DecodeChips: memory cells after the first one of their chip
+	long recovered_bags = 0;		   // Event builder: SPIROC bags with another triggerID than the first of their event bag
+	long timed_out_events = 0;		   // Event builder: events emitted before all layers arrived
+	long late_bags = 0;				   // Event builder: SPIROC bags of an event that was emitted already, dropped
+
+	// 2. Errors
+	long footer_after_header = 0;	// CatchEventBag: footer found after next header
+	long abnormal_end = 0;			// CatchEventBag: file ends inside an event bag
+	long oversized_bag = 0;			// CatchEventBag: event bag larger than the ring buffer of a stream source or the follow buffer
+	long abnormal_event_buffer = 0; // CatchSPIROCBag: no layer byte after the SPIROC footer
+	long abnormal_layer_ff = 0;		// CatchSPIROCBag: 0xff missing after the SPIROC footer
+	long abnormal_layer = 0;		// CatchSPIROCBag: layer ID above 39
+	long wrong_bag_size = 0;		// CatchSPIROCBag: odd or too short SPIROC bag
+	long abnormal_spiroc_size = 0;	// UnpackEventBag: SPIROC bag shorter than one chip
+	long abnormal_memo_no = 0;		// FillChipBuffer: more memory cells than the chip has
+	long abnormal_chip_buffer = 0;	// FillChipBuffer: words left after the last chip ID
+	long trigger_mismatch = 0;		// UnpackEventBag: SPIROC bag with another triggerID than the event
+	long abnormal_events = 0;		// Events with at least one trigger_mismatch
+	long trigger_jump = 0;			// FillEvent: triggerID more than 10 above the previous one
+	long trigger_loops = 0;			// FillEvent: triggerID rollover
+	long corrupt_input = 0;			// CompressedInput: the compressed data is corrupt or truncated, the decode failed
+
+	// 3. Wall time per stage in seconds, summed over the threads of a stage
+	double t_frame = 0;	 // CatchEventBag or index lookup
+	double t_unpack = 0; // SPIROC bags, chip buffers and channel decoding
+	double t_write = 0;	 // Trigger checks and Fill
+	double t_total = 0;	 // Whole Decode
+
+	/**
+	 * @brief 以名字依次访问所有计数与阶段时间，断点按名字写出并恢复它们
+	 * @param field 对每个成员调用 field(名字, 成员)
+	 */
+	template <class Field>
+	void ForEachField(Field &&field) { Fields(field, *this); }
+	template <class Field>
+	void ForEachField(Field &&field) const { Fields(field, *this); }
+
+	/**
+	 * @brief 累加另一个解码器（分段或流水线工作线程）的计数与阶段时间
+	 * @param other 另一个解码器的统计
+	 */
+	void Merge(const DecodeStats &other);
+
+	/**
+	 * @brief 将统计写为 JSON 文件
+	 * @param file_name JSON 文件名
+	 * @param input_file 输入 .dat 文件名
+	 * @param output_file 输出 ROOT 文件名
+	 * @return 返回写出状态（0 表示失败，1 表示成功）
+	 */
+	int WriteJSON(const string &file_name, const string &input_file, const string &output_file) const;
+
+private:
+	// The one list of the fields: field(name, member of every one of stats...), so that Merge can walk two objects at once
+	template <class Field, class... Stats>
+	static void Fields(Field &&field, Stats &...stats)
+	{
+		field("bytes", stats.bytes...);
+		field("event_bags", stats.event_bags...);
+		field("events", stats.events...);
+		field("spiroc_bags", stats.spiroc_bags...);
+		field("empty_spiroc_bags", stats.empty_spiroc_bags...);
+		for (int i = 0; i < s_layer_No; ++i)
+			field("layer_spiroc_bags_" + to_string(i), stats.layer_spiroc_bags[i]...);
+		field("cherenkov1", stats.cherenkov1...);
+		field("cherenkov2", stats.cherenkov2...);
+		field("cherenkov_coincidence", stats.cherenkov_coincidence...);
+		field("kept_channels", stats.kept_channels...);
+		field("suppressed_channels", stats.suppressed_channels...);
+		field("ped_events", stats.ped_events...);
+		field("skipped_bags", stats.skipped_bags...);
+		field("extra_memory_cells", stats.extra_memory_cells...);
+		field("recovered_bags", stats.recovered_bags...);
+		field("timed_out_events", stats.timed_out_events...);
+		field("late_bags", stats.late_bags...);
+		Errors(field, stats...);
+		field("trigger_loops", stats.trigger_loops...);
+		field("t_frame", stats.t_frame...);
+		field("t_unpack", stats.t_unpack...);
+		field("t_write", stats.t_write...);
+		field("t_total", stats.t_total...);
+	}
+
+	// The error counters, also the "errors" object of the JSON file
+	template <class Field, class... Stats>
+	static void Errors(Field &&field, Stats &...stats)
+	{
+		field("footer_after_header", stats.footer_after_header...);
+		field("abnormal_end", stats.abnormal_end...);
+		field("oversized_bag", stats.oversized_bag...);
+		field("abnormal_event_buffer", stats.abnormal_event_buffer...);
+		field("abnormal_layer_ff", stats.abnormal_layer_ff...);
+		field("abnormal_layer", stats.abnormal_layer...);
+		field("wrong_bag_size", stats.wrong_bag_size...);
+		field("abnormal_spiroc_size", stats.abnormal_spiroc_size...);
+		field("abnormal_memo_no", stats.abnormal_memo_no...);
+		field("abnormal_chip_buffer", stats.abnormal_chip_buffer...);
+		field("trigger_mismatch", stats.trigger_mismatch...);
+		field("abnormal_events", stats.abnormal_events...);
+		field("trigger_jump", stats.trigger_jump...);
+		field("corrupt_input", stats.corrupt_input...);
+	}
+};
+
+// Adds the wall time between construction and destruction to one stage time
+class StageClock
+{
+public:
+	explicit StageClock(double &seconds) : m_seconds(seconds), m_start(chrono::steady_clock::now()) {}
+	~StageClock() { m_seconds += chrono::duration<double>(chrono::steady_clock::now() - m_start).count(); }
+
+	StageClock(const StageClock &) = delete;
+	StageClock &operator=(const StageClock &) = delete;
+
+private:
+	double &m_seconds;
+	chrono::steady_clock::time_point m_start;
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Raw data written as one file per layer by the FELIX readout. Every file is cut into 1 kB blocks with a
+// 6-byte block tag (.. .. .. .. cd ab) across each block boundary, and the DAQ data is sent in packets
+// between "ffa5 abab 0000 ffff" and "ffff 0000 baba 5aff". The tags are stripped while the files are read,
+// and the event bags of all layers with the same (cycleID, triggerID) are merged into one event bag for the
+// decoder, without writing the .dat file in between. Every layer keeps at most `window` event bags ahead,
+// so bags a little out of order are still merged and the memory does not grow with the files.
+class FelixInput
+{
+public:
+	FelixInput() {};
+	~FelixInput();
+
+	FelixInput(const FelixInput &) = delete;
+	FelixInput &operator=(const FelixInput &) = delete;
+
+	struct Counters
+	{
+		long events = 0;		 // Merged event bags
+		long partial_events = 0; // Merged from fewer layers than there are files
+		long late_bags = 0;		 // Arrived after their event was merged (more out of order than the window), dropped
+		long no_id_bags = 0;	 // Without a SPIROC bag to read cycleID and triggerID from, dropped
+		long broken_bags = 0;	 // No footer before the next header or the end of the file, dropped
+	};
+
+	/**
+	 * @brief 打开每层一个的 FELIX 原始数据文件
+	 * @param files 各层的文件名
+	 * @param window 每层最多预读的事件包数（乱序容忍窗口）
+	 * @return 返回打开状态（0 表示失败，1 表示成功）
+	 */
+	int Open(const vector<string> &files, size_t window);
+
+	/**
+	 * @brief 关闭所有文件并释放缓冲区
+	 */
+	void Close();
+
+	/**
+	 * @brief 按 (cycleID, triggerID) 取出下一个合并后的事件包
+	 * @param event 合并后的事件包（header、各层 SPIROC 包、切伦科夫计数器、footer）
+	 * @param cherenkov_counter 切伦科夫计数器（取自文件列表中第一个有该事件的层）
+	 * @return 返回状态（0 表示所有文件结束，1 表示成功）
+	 */
+	int Next(vector<unsigned char> &event, long &cherenkov_counter);
+
+	size_t Streams() const { return m_streams.size(); }
+	uint64_t RawBytes() const;
+	const Counters &GetCounters() const { return m_counters; }
+
+private:
+	static constexpr size_t s_read_size = 1 << 16;	  // Raw bytes read at once
+	static constexpr size_t s_block_size = 1024;	  // FELIX block, a block tag across every boundary
+	static constexpr size_t s_block_tag_size = 6;	  // Starts 2 bytes before the boundary
+	static constexpr size_t s_tag_size = 8;			  // Packet header and trailer tags
+	static constexpr size_t s_max_packet = 16 << 20; // A packet without trailer is passed on at this size
+
+	struct Bag
+	{
+		vector<unsigned char> payload; // SPIROC bags between the event bag header and the Cherenkov counter
+		long cherenkov_counter = 0;
+	};
+
+	struct Stream
+	{
+		string name;
+		ifstream f_in;
+		bool eof = false;
+		uint64_t raw = 0; // Raw bytes read
+
+		// 1. Block tags: bytes that may belong to the next block tag
+		vector<unsigned char> block_tag;
+
+		// 2. Packets: payload of the open packet, sent on at its trailer
+		vector<unsigned char> packet;
+		bool inside = true; // The file may start inside a packet
+		bool tagged = false;
+
+		// 3. Event bags framed in the stripped data
+		vector<unsigned char> data;
+		size_t start = 0; // Bytes before it are framed already
+		size_t scan = 0;  // Footer search of the bag at start continues here
+
+		// 4. Reorder window, keyed on cycleID and the unwrapped triggerID
+		multimap<uint64_t, Bag> window;
+	};
+
+	vector<unique_ptr<Stream>> m_streams;
+	set<pair<uint64_t, size_t>> m_heads; // First key of every window that is not empty
+	size_t m_window = 0;
+	long long m_last_trigID = -1; // Unwrapped triggerID of the last bag read from any layer
+	uint64_t m_last_key = 0;
+	bool m_emitted = false;
+	Counters m_counters;
+	vector<unsigned char> m_raw;	  // Read buffer shared by the streams
+	vector<unsigned char> m_stripped; // Raw data without the block tags
+
+	// Read and strip raw data until at least one byte is added to s.data, 0 at the end of the file
+	int Fill(Stream &s);
+	void StripBlockTags(Stream &s, const unsigned char *raw, size_t size, vector<unsigned char> &out);
+	void StripPackets(Stream &s, const vector<unsigned char> &in);
+	// Next event bag of one layer with its merge key, 0 at the end of the file
+	int NextBag(Stream &s, Bag &bag, uint64_t &key);
+	// Read layer i up to the window size and put its first key into m_heads
+	void Refill(size_t i);
+};
@@ -1,7 +1,5 @@
 #ifndef GLOBAL_HH
 #define GLOBAL_HH
-extern int int_tmp;
-extern char char_tmp[200];
 const int channel_FEE = 73;//(36charges+36times + BCIDs )*16column+ ChipID
 const int cell_SP = 16;
 const int chip_No = 9;
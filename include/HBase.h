@@ -19,10 +19,11 @@ class HBase{
 
 		protected:
 				//Protected member functions
-				virtual void ReadTree(const TString &fname,const TString &tname); //Read TTree from ROOT files
+				virtual int ReadTree(const TString &fname,const TString &tname); //Read TTree from ROOT files, 0 when the file has no usable tree
 				virtual void ReadList(const string &_list); // Read the file list and save to the protected vector
 				virtual void CreateFile(const TString &_outname); // Create output file
 				virtual void Init(const TString &_outname);// Initialize derived members
+				virtual Long64_t GetEntry(Long64_t entry); // Read one entry of tin, a compact tree is unpacked into the vectors below
 
 				// Protected member variables
 				vector<string>	list;
@@ -43,6 +44,16 @@ class HBase{
 				vector< double > *_LG_Charge;
 				vector< double > *_Hit_Time;
 
+				// Compact Raw_Hit schema (see CompactHit.h), read into these and unpacked by GetEntry
+				bool _compact;
+				vector< unsigned short > *_bcid_c;
+				vector< unsigned short > *_HG_Charge_c;
+				vector< unsigned short > *_LG_Charge_c;
+				vector< unsigned short > *_Hit_Time_c;
+				vector< unsigned char > *_hitFlags;
+				vector< int > _bcid_buf,_hitTag_buf,_gainTag_buf;
+				vector< double > _HG_Charge_buf,_LG_Charge_buf,_Hit_Time_buf;
+
 };
 
 #endif
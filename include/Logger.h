@@ -0,0 +1,140 @@
+#pragma once
+
+#include <condition_variable>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+enum LogLevel
+{
+	kDebug = 0,
+	kInfo = 1,
+	kWarning = 2,
+	kError = 3,
+};
+
+// Process-wide log written by a background thread, so the decode loop never waits for the
+// terminal or the log file. Every message type (e.g. "abnormal layer") has its own budget:
+// a burst of messages passes, then at most `rate` per second; the others are only counted
+// and reported as "suppressed" lines at the next Flush().
+class Logger
+{
+public:
+	static Logger &Instance();
+	~Logger();
+
+	Logger(const Logger &) = delete;
+	Logger &operator=(const Logger &) = delete;
+
+	/**
+	 * @brief 判断一条消息是否应当写出（级别足够且该类型的限额未用完），被限制的消息计入抑制数
+	 * @param level 消息级别
+	 * @param type 消息类型，为空表示不限速
+	 * @return 返回是否写出
+	 */
+	bool Allow(LogLevel level, const char *type);
+
+	/**
+	 * @brief 将一行消息放入写出队列，不等待写出；队列已满时丢弃并计数
+	 * @param text 消息内容（不含换行）
+	 */
+	void Write(const string &text);
+
+	/**
+	 * @brief 写出各消息类型的抑制计数，并等待队列中的消息全部写出
+	 */
+	void Flush();
+
+	/**
+	 * @brief 设置写出的最低级别
+	 * @param level 最低级别，也可以是 "debug"、"info"、"warning"、"error"
+	 */
+	void SetLevel(LogLevel level) { m_level = level; }
+	int SetLevel(const string &level);
+
+	/**
+	 * @brief 设置每种消息的限额
+	 * @param burst 开始限速前可以连续写出的条数，0 表示不限速
+	 * @param rate 之后每秒最多写出的条数
+	 */
+	void SetRateLimit(int burst, double rate);
+
+	/**
+	 * @brief 将日志写入文件而不是标准输出
+	 * @param file_name 日志文件名，空字符串表示标准输出
+	 * @return 返回打开状态（0 表示失败，继续使用标准输出，1 表示成功）
+	 */
+	int SetFile(const string &file_name);
+
+private:
+	Logger() {};
+
+	static constexpr size_t s_queue_size = 100000; // Lines waiting for the writer, more are dropped
+
+	// Budget of one message type
+	struct TypeLimit
+	{
+		double tokens = 0;
+		double last_time = -1; // Seconds since the logger started, -1 before the first message
+		long suppressed = 0;
+	};
+
+	LogLevel m_level = kInfo;
+	int m_burst = 20;
+	double m_rate = 1;
+	map<string, TypeLimit> m_limits;
+	long m_dropped = 0;
+
+	mutex m_mutex;
+	condition_variable m_not_empty;
+	condition_variable m_written;
+	vector<string> m_queue;
+	size_t m_pushed = 0;  // Lines queued since start
+	size_t m_flushed = 0; // Lines written since start
+	bool m_stop = false;
+	thread m_writer;
+	ofstream m_file;
+
+	void WriterLoop();
+	double Seconds() const;
+};
+
+// One log line, formatted only when Logger::Allow lets it pass and queued when destroyed:
+// LogLine(kWarning, "abnormal layer") << " abnormal layer " << hex << layer;
+class LogLine
+{
+public:
+	LogLine(LogLevel level, const char *type = nullptr) : m_on(Logger::Instance().Allow(level, type)) {}
+	~LogLine()
+	{
+		if (m_on)
+			Logger::Instance().Write(m_stream.str());
+	}
+
+	LogLine(const LogLine &) = delete;
+	LogLine &operator=(const LogLine &) = delete;
+
+	template <class T>
+	LogLine &operator<<(const T &value)
+	{
+		if (m_on)
+			m_stream << value;
+		return *this;
+	}
+	LogLine &operator<<(ios_base &(*manip)(ios_base &))
+	{
+		if (m_on)
+			m_stream << manip;
+		return *this;
+	}
+
+private:
+	bool m_on;
+	ostringstream m_stream;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+using namespace std;
+
+// Read-only memory mapping of a raw .dat file
+class MappedFile
+{
+public:
+	MappedFile() {};
+	~MappedFile();
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	/**
+	 * @brief 以只读方式将整个文件映射到内存
+	 * @param file_name 输入文件名
+	 * @return 返回映射状态（0 表示失败，1 表示成功）
+	 */
+	int Open(const string &file_name);
+	void Close();
+
+	/**
+	 * @brief 通知内核 [begin, end) 范围内的页面已处理完毕，可以释放，使常驻内存不随文件大小增长
+	 * @param begin 已处理数据的起始位置
+	 * @param end 已处理数据的结束位置
+	 */
+	void Release(size_t begin, size_t end) const;
+
+	bool IsOpen() const { return m_data != nullptr || m_fd >= 0; }
+	const unsigned char *Data() const { return m_data; }
+	size_t Size() const { return m_size; }
+
+private:
+	int m_fd = -1;
+	unsigned char *m_data = nullptr;
+	size_t m_size = 0;
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+// Framing words of the raw data stream (see Doc/datastructure.md)
+enum MarkerType
+{
+	kEventHead = 0,	 // 0xfb 0xee 0xfb 0xee
+	kEventFoot = 1,	 // 0xfe 0xdd 0xfe 0xdd
+	kSpirocHead = 2, // 0xfa 0x5a 0xfa 0x5a
+	kSpirocFoot = 3, // 0xfe 0xee 0xfe 0xee
+};
+
+struct MarkerPos
+{
+	size_t pos;		 // Offset of the first marker byte
+	MarkerType type; // Which marker was found
+};
+
+// Vectorized multi-pattern search for the four framing markers.
+// All markers have the form "ab cd ab cd" with ab in {fa, fb, fe}, so a block is
+// filtered 16 (SSE2) or 32 (AVX2) positions at a time and only candidates are checked.
+class MarkerScanner
+{
+public:
+	static constexpr unsigned Bit(MarkerType type) { return 1u << type; }
+	static constexpr unsigned s_event_markers = (1u << kEventHead) | (1u << kEventFoot);
+	static constexpr unsigned s_spiroc_markers = (1u << kSpirocHead) | (1u << kSpirocFoot);
+	static constexpr unsigned s_all_markers = s_event_markers | s_spiroc_markers;
+
+	/**
+	 * @brief 查找 data 中第一个类型属于 type_mask 的标志字
+	 * @param data 数据起始地址
+	 * @param size 数据长度
+	 * @param type_mask 需要查找的标志字类型（MarkerScanner::Bit 的组合）
+	 * @param type 返回找到的标志字类型，可以为空
+	 * @return 返回标志字起始位置，找不到时返回 size
+	 */
+	static size_t Find(const unsigned char *data, size_t size, unsigned type_mask, MarkerType *type = nullptr);
+
+	/**
+	 * @brief 单次扫描 data，找出所有类型属于 type_mask 的标志字位置
+	 * @param data 数据起始地址
+	 * @param size 数据长度
+	 * @param markers 按位置顺序追加找到的标志字
+	 * @param type_mask 需要查找的标志字类型
+	 */
+	static void Scan(const unsigned char *data, size_t size, vector<MarkerPos> &markers, unsigned type_mask = s_all_markers);
+
+	/**
+	 * @brief 返回当前使用的指令集名称（avx2、sse2 或 scalar）
+	 */
+	static const char *ISA();
+};
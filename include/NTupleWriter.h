@@ -0,0 +1,48 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+using namespace std;
+
+class DatManager;
+
+// Writes the events decoded by a DatManager as the RNTuple "Raw_Hit". The per-event values are
+// single fields, the per-channel values share one "Hits" collection (Hits.CellID, Hits.HG_Charge, ...).
+// Only available when hbuana is built against a ROOT with RNTuple (HBUANA_WITH_RNTUPLE).
+class NTupleWriter
+{
+public:
+	NTupleWriter();
+	~NTupleWriter();
+
+	NTupleWriter(const NTupleWriter &) = delete;
+	NTupleWriter &operator=(const NTupleWriter &) = delete;
+
+	/**
+	 * @brief 当前编译是否支持 RNTuple 输出
+	 */
+	static bool Available();
+
+	/**
+	 * @brief 创建输出文件，之后每次 Fill 读取 dm 的输出分支变量
+	 * @param file_name 输出 ROOT 文件名
+	 * @param dm 提供事例数据的 DatManager
+	 * @param compression ROOT 压缩设置（100 * 算法 + 级别），-1 表示使用默认设置
+	 * @return 返回创建状态（0 表示失败，1 表示成功）
+	 */
+	int Open(const string &file_name, const DatManager &dm, int compression = -1);
+
+	// Append the current event of the DatManager
+	void Fill();
+
+	// Write the buffered events as a cluster
+	void Flush();
+
+	// Write the footer and close the file
+	void Close();
+
+private:
+	struct Impl;
+	unique_ptr<Impl> m_impl;
+};
@@ -3,6 +3,7 @@
 
 #include "HBase.h"
 #include <TH2D.h>
+#include <TH1I.h>
 #include <vector>
 #include <map>
 #include <unordered_map>
@@ -21,6 +22,8 @@
 
 using namespace std;
 
+class DatManager;
+
 class PedestalManager : public HBase{
 
 public:
@@ -38,6 +41,8 @@ public:
 
 	void Init(const TString &_outname);
 	int AnaPedestal(const std::string &list,const int &sel_hittag);
+	// Fused mode: list holds .dat files, decoded by dm straight into the pedestal histograms without Raw_Hit files
+	int AnaPedestalRaw(const std::string &list,const int &sel_hittag,DatManager &dm,const std::string &output_dir,const bool &b_auto_gain,const bool &b_cherenkov);
 	void Setmt(bool mt){usemt = mt;};
 	
 private:
@@ -62,6 +67,13 @@ private:
 	int _cellid;
 	
 	void SaveCanvas(TH2D* h,const TString &name);
+	int DacChannel(const string &file,const int &sel_hittag); // DAC channel from the file name, -1 if none
+	TH1I *EventTimeHist(const vector<unsigned int> &times); // Events per Event_Time of one file
+	// Event selection of the usemt path: hit tag, memory cell 0, not the DAC channel
+	void FillAll(const vector<int> &cellID,const vector<int> &hitTag,const vector<double> &HG_Charge,const vector<double> &LG_Charge,const int &sel_hittag,const int &dac_chn);
+	// Event selection of the serial path: as FillAll, only if time_count (events at this Event_Time) >= 10, from the 37th channel of a chip on and above 100 ADC
+	void FillCut(const vector<int> &cellID,const vector<int> &hitTag,const vector<double> &HG_Charge,const vector<double> &LG_Charge,const int &sel_hittag,const int &dac_chn,const double &time_count,int flag[9][40]);
+	int WritePedestal(); // Fit the histograms and write the pedestal file
 };
 
 extern PedestalManager *_instance;
@@ -0,0 +1,15 @@
+#pragma once
+
+// One channel of a decoded event, the item type of the "Hits" collection in the RNTuple output.
+// Field names follow the Raw_Hit TTree branches.
+struct RawHit
+{
+	int CellID = 0;
+	int BCID = 0;
+	int HitTag = 0;
+	int GainTag = 0;
+	double HG_Charge = 0;
+	double LG_Charge = 0;
+	double Hit_Time = 0;
+	int GainTag_TDC = 0;
+};
@@ -0,0 +1,10 @@
+#ifdef __CLING__
+
+#pragma link off all globals;
+#pragma link off all classes;
+#pragma link off all functions;
+
+#pragma link C++ struct RawHit+;
+#pragma link C++ class std::vector<RawHit>+;
+
+#endif
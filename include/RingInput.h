@@ -0,0 +1,105 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MarkerScanner.h"
+
+using namespace std;
+
+// Non-seekable .dat sources: stdin ("-"), a named pipe or a Unix socket, e.g. fed by `xrdcp - | hbuana`
+// or a DAQ stand-in. A reader thread fills a ring of fixed size, so memory stays bounded however long the
+// stream is. Positions are absolute stream bytes; data in [Begin(), Written()) can be read until Release().
+class RingInput
+{
+public:
+	RingInput() {};
+	~RingInput();
+
+	RingInput(const RingInput &) = delete;
+	RingInput &operator=(const RingInput &) = delete;
+
+	/**
+	 * @brief 输入是否为不可定位的数据流（"-" 表示标准输入，或命名管道、Unix socket、字符设备）
+	 * @param name 输入文件名
+	 */
+	static bool IsStream(const string &name);
+
+	/**
+	 * @brief 打开数据流（Unix socket 时连接到该 socket）并开始在后台线程中读取
+	 * @param name 输入文件名，"-" 表示标准输入
+	 * @param capacity 环形缓冲区大小（字节）
+	 * @return 返回打开状态（0 表示失败，1 表示成功）
+	 */
+	int Open(const string &name, size_t capacity);
+
+	/**
+	 * @brief 停止读取线程，关闭数据流并释放缓冲区
+	 */
+	void Close();
+
+	/**
+	 * @brief 等待数据到达 want（最多到 Begin() + Capacity()）或数据流结束
+	 * @param want 需要的数据结束位置
+	 * @return 返回已读入的数据结束位置
+	 */
+	uint64_t Wait(uint64_t want);
+
+	/**
+	 * @brief 释放 pos 之前的数据，读取线程可以覆盖这部分缓冲区
+	 * @param pos 数据流位置，超过已读入的数据时只释放已读入的数据
+	 */
+	void Release(uint64_t pos);
+
+	/**
+	 * @brief 查找 [from, to) 中第一个类型属于 type_mask 的标志字，包括跨过环形缓冲区末尾的标志字
+	 * @param from 起始位置（不小于 Begin()）
+	 * @param to 结束位置（不大于 Written()）
+	 * @param type_mask 需要查找的标志字类型（MarkerScanner::Bit 的组合）
+	 * @param type 返回找到的标志字类型，可以为空
+	 * @return 返回标志字起始位置，找不到时返回 to
+	 */
+	uint64_t Find(uint64_t from, uint64_t to, unsigned type_mask, MarkerType *type = nullptr) const;
+
+	/**
+	 * @brief 返回 [pos, pos + size) 数据的连续视图，跨过环形缓冲区末尾时拷贝到 scratch
+	 * @param pos 数据起始位置
+	 * @param size 数据长度（不大于 Capacity()）
+	 * @param scratch 拼接用的缓冲区
+	 * @return 返回数据起始地址，在 Release() 或下一次使用 scratch 前有效
+	 */
+	const unsigned char *Data(uint64_t pos, size_t size, vector<unsigned char> &scratch) const;
+
+	unsigned char At(uint64_t pos) const { return m_data[pos % m_capacity]; }
+	size_t Capacity() const { return m_capacity; }
+	uint64_t Begin();
+	uint64_t Written();
+
+	/**
+	 * @brief 数据流是否已结束（之后不会再有新数据）
+	 */
+	bool Finished();
+
+private:
+	static constexpr int s_poll_ms = 200; // Wait for data before checking for Close()
+
+	int m_fd = -1;
+	bool m_own_fd = false; // stdin is not closed
+	vector<unsigned char> m_data;
+	size_t m_capacity = 0;
+	thread m_reader;
+
+	mutex m_mutex;
+	condition_variable m_not_empty;
+	condition_variable m_not_full;
+	uint64_t m_begin = 0;	// Oldest byte not released
+	uint64_t m_written = 0; // End of the data read so far
+	bool m_finished = false;
+	bool m_stop = false;
+
+	void ReadLoop(const string &name);
+};
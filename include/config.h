@@ -1,8 +1,11 @@
 #ifndef CONFIG_HH
 #define CONFIG_HH
 #include <string>
+#include <vector>
 #include "yaml-cpp/yaml.h"
 
+class DatManager;
+
 class Config
 {
 public:
@@ -14,6 +17,10 @@ public:
 	virtual void Print();
 	virtual void Parse(const std::string config_file);
 	virtual int Run();
+
+private:
+	void SetupDatManager(DatManager &dm);
+	int DecodeDatList(const std::vector<std::string> &dat_files, int n_threads);
 };
 
 #endif
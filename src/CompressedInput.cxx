@@ -0,0 +1,338 @@
+#include "CompressedInput.h"
+#include "Logger.h"
+#include "MappedFile.h"
+
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+
+#include <lzma.h>
+#include <zlib.h>
+#ifdef HBUANA_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+CompressedInput::~CompressedInput()
+{
+	Close();
+}
+
+CompressedInput::Format CompressedInput::Detect(const string &file_name)
+{
+	unsigned char magic[6] = {0};
+	ifstream f_in(file_name, ios::in | ios::binary);
+	f_in.read(reinterpret_cast<char *>(magic), sizeof(magic));
+	size_t n = f_in.gcount();
+	if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return kGzip;
+	if (n >= 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0)
+		return kXz;
+	if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		return kZstd;
+	return kNone;
+}
+
+const char *CompressedInput::Name(Format format)
+{
+	switch (format)
+	{
+	case kGzip:
+		return "gzip";
+	case kXz:
+		return "xz";
+	case kZstd:
+		return "zstd";
+	default:
+		return "uncompressed";
+	}
+}
+
+bool CompressedInput::Available(Format format)
+{
+#ifdef HBUANA_WITH_ZSTD
+	return format != kNone;
+#else
+	return format == kGzip || format == kXz;
+#endif
+}
+
+int CompressedInput::Open(const string &file_name, Format format, int threads)
+{
+	Close();
+	if (!Available(format))
+	{
+		LogLine(kError) << file_name << " is " << Name(format) << " compressed, hbuana was built without " << Name(format) << " support";
+		return 0;
+	}
+	if (!ifstream(file_name))
+		return 0;
+	if (threads <= 0)
+		threads = max(1u, thread::hardware_concurrency());
+	m_queue.reset(new BoundedQueue<vector<char>>(s_queue_size));
+	m_failed = false;
+	m_worker = thread([this, file_name, format, threads]()
+					  {
+		if (format == kGzip)
+			ReadGzip(file_name);
+		else if (format == kXz)
+			ReadXz(file_name, threads);
+		else
+			ReadZstd(file_name, threads);
+		m_queue->Close(); });
+	return 1;
+}
+
+void CompressedInput::Close()
+{
+	// A closed queue makes the worker stop at its next block
+	if (m_queue)
+		m_queue->Close();
+	if (m_worker.joinable())
+		m_worker.join();
+	m_queue.reset();
+	m_block = vector<char>();
+	setg(nullptr, nullptr, nullptr);
+}
+
+CompressedInput::int_type CompressedInput::underflow()
+{
+	if (gptr() < egptr())
+		return traits_type::to_int_type(*gptr());
+	m_block.clear();
+	while (m_block.empty())
+	{
+		if (!m_queue || !m_queue->Pop(m_block))
+			return traits_type::eof();
+	}
+	setg(m_block.data(), m_block.data(), m_block.data() + m_block.size());
+	return traits_type::to_int_type(*gptr());
+}
+
+void CompressedInput::Fail(const string &file_name, const string &reason)
+{
+	LogLine(kError) << file_name << ": " << reason << ", decoding the data before it";
+	m_failed = true;
+}
+
+void CompressedInput::ReadGzip(const string &file_name)
+{
+	ifstream f_in(file_name, ios::in | ios::binary);
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, 15 + 32) != Z_OK) // 32: gzip or zlib header
+	{
+		Fail(file_name, "cant initialize zlib");
+		return;
+	}
+	vector<char> in(s_read_size);
+	vector<char> block(s_block_size);
+	strm.next_out = reinterpret_cast<Bytef *>(block.data());
+	strm.avail_out = block.size();
+	int ret = Z_OK;
+	while (true)
+	{
+		if (strm.avail_in == 0)
+		{
+			f_in.read(in.data(), in.size());
+			strm.next_in = reinterpret_cast<Bytef *>(in.data());
+			strm.avail_in = f_in.gcount();
+			if (strm.avail_in == 0)
+				break;
+		}
+		ret = inflate(&strm, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END)
+		{
+			// A .gz file may hold several members (cat a.gz b.gz, parallel gzip tools)
+			inflateReset(&strm);
+		}
+		else if (ret != Z_OK && ret != Z_BUF_ERROR)
+		{
+			Fail(file_name, string("corrupt gzip data (") + (strm.msg ? strm.msg : "zlib error") + ")");
+			break;
+		}
+		if (strm.avail_out == 0)
+		{
+			if (!m_queue->Push(std::move(block)))
+			{
+				inflateEnd(&strm);
+				return;
+			}
+			block = vector<char>(s_block_size);
+			strm.next_out = reinterpret_cast<Bytef *>(block.data());
+			strm.avail_out = block.size();
+		}
+	}
+	if (!m_failed && ret != Z_STREAM_END)
+		Fail(file_name, "gzip data is truncated");
+	block.resize(block.size() - strm.avail_out);
+	m_queue->Push(std::move(block));
+	inflateEnd(&strm);
+}
+
+void CompressedInput::ReadXz(const string &file_name, int threads)
+{
+	ifstream f_in(file_name, ios::in | ios::binary);
+	lzma_stream strm = LZMA_STREAM_INIT;
+#if LZMA_VERSION >= 50040002
+	// Blocks with their sizes in the headers (xz -T) are decompressed in parallel
+	lzma_mt mt;
+	memset(&mt, 0, sizeof(mt));
+	mt.flags = LZMA_CONCATENATED;
+	mt.threads = threads;
+	mt.memlimit_threading = lzma_physmem() / 4;
+	mt.memlimit_stop = UINT64_MAX;
+	lzma_ret ret = lzma_stream_decoder_mt(&strm, &mt);
+#else
+	lzma_ret ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+	if (ret != LZMA_OK)
+	{
+		Fail(file_name, "cant initialize liblzma");
+		return;
+	}
+	vector<uint8_t> in(s_read_size);
+	vector<char> block(s_block_size);
+	strm.next_out = reinterpret_cast<uint8_t *>(block.data());
+	strm.avail_out = block.size();
+	lzma_action action = LZMA_RUN;
+	while (true)
+	{
+		if (strm.avail_in == 0 && action == LZMA_RUN)
+		{
+			f_in.read(reinterpret_cast<char *>(in.data()), in.size());
+			strm.next_in = in.data();
+			strm.avail_in = f_in.gcount();
+			if (strm.avail_in == 0)
+				action = LZMA_FINISH;
+		}
+		ret = lzma_code(&strm, action);
+		if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+		{
+			Fail(file_name, ret == LZMA_BUF_ERROR ? "xz data is truncated" : "corrupt xz data");
+			break;
+		}
+		if (strm.avail_out == 0 || ret == LZMA_STREAM_END)
+		{
+			block.resize(block.size() - strm.avail_out);
+			if (!m_queue->Push(std::move(block)) || ret == LZMA_STREAM_END)
+				break;
+			block = vector<char>(s_block_size);
+			strm.next_out = reinterpret_cast<uint8_t *>(block.data());
+			strm.avail_out = block.size();
+		}
+	}
+	if (m_failed)
+	{
+		block.resize(block.size() - strm.avail_out);
+		m_queue->Push(std::move(block));
+	}
+	lzma_end(&strm);
+}
+
+#ifdef HBUANA_WITH_ZSTD
+void CompressedInput::ReadZstd(const string &file_name, int threads)
+{
+	MappedFile f_map;
+	if (!f_map.Open(file_name))
+	{
+		Fail(file_name, "cant map the file");
+		return;
+	}
+	const char *src = reinterpret_cast<const char *>(f_map.Data());
+	size_t size = f_map.Size();
+
+	// 1. Frames with their decompressed size in the header (pzstd) are decompressed in parallel. The size comes from
+	//    the file, a frame claiming more than s_max_frame_size (corrupt header or a huge frame) is left to the streaming
+	//    decompression, which needs no buffer of that size
+	vector<pair<size_t, size_t>> frames; // Offset and compressed size
+	bool sized = true;
+	for (size_t pos = 0; pos < size && sized;)
+	{
+		size_t n = ZSTD_findFrameCompressedSize(src + pos, size - pos);
+		unsigned long long content = ZSTD_isError(n) ? ZSTD_CONTENTSIZE_ERROR : ZSTD_getFrameContentSize(src + pos, n);
+		sized = content != ZSTD_CONTENTSIZE_UNKNOWN && content != ZSTD_CONTENTSIZE_ERROR && content <= s_max_frame_size;
+		frames.emplace_back(pos, n);
+		pos += n;
+	}
+	if (sized && frames.size() > 1 && threads > 1)
+	{
+		auto decompress = [this, src, &file_name](size_t offset, size_t n)
+		{
+			vector<char> out(ZSTD_getFrameContentSize(src + offset, n));
+			size_t ret = ZSTD_decompress(out.data(), out.size(), src + offset, n);
+			if (ZSTD_isError(ret))
+			{
+				Fail(file_name, string("corrupt zstd frame (") + ZSTD_getErrorName(ret) + ")");
+				out.clear();
+			}
+			return out;
+		};
+		// Up to threads frames in flight, handed to the decoder in file order
+		deque<future<vector<char>>> running;
+		size_t next = 0;
+		while (next < frames.size() || !running.empty())
+		{
+			while (next < frames.size() && running.size() < static_cast<size_t>(threads))
+			{
+				running.push_back(async(launch::async, decompress, frames[next].first, frames[next].second));
+				next++;
+			}
+			vector<char> block;
+			try
+			{
+				block = running.front().get();
+			}
+			catch (const exception &e)
+			{
+				Fail(file_name, string("cant decompress a zstd frame (") + e.what() + ")");
+			}
+			running.pop_front();
+			if (m_failed || !m_queue->Push(std::move(block)))
+				break;
+		}
+		return; // The futures left wait for their frame when destroyed
+	}
+
+	// 2. Streaming decompression, also for frames without a size and for truncated files
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+	ZSTD_inBuffer in = {src, size, 0};
+	vector<char> block(s_block_size);
+	ZSTD_outBuffer out = {block.data(), block.size(), 0};
+	size_t ret = 0;
+	while (true)
+	{
+		ret = ZSTD_decompressStream(dctx, &out, &in);
+		if (ZSTD_isError(ret))
+		{
+			Fail(file_name, string("corrupt zstd data (") + ZSTD_getErrorName(ret) + ")");
+			break;
+		}
+		if (out.pos == out.size)
+		{
+			if (!m_queue->Push(std::move(block)))
+			{
+				ZSTD_freeDCtx(dctx);
+				return;
+			}
+			block = vector<char>(s_block_size);
+			out = {block.data(), block.size(), 0};
+			continue; // More output may be waiting in the context
+		}
+		if (in.pos == in.size)
+			break;
+	}
+	if (!m_failed && ret != 0)
+		Fail(file_name, "zstd data is truncated");
+	block.resize(out.pos);
+	m_queue->Push(std::move(block));
+	ZSTD_freeDCtx(dctx);
+}
+#else
+void CompressedInput::ReadZstd(const string &file_name, int)
+{
+	Fail(file_name, "hbuana was built without zstd support");
+}
+#endif
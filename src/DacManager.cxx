@@ -91,12 +91,12 @@ int DacManager::AnaDac(const std::string &list,const TString &mode)
 			int_input_dac = stoi(input_dac);
 		}
 		//cout<<skipchn<<endl;
-		this->ReadTree(TString(tmp.c_str()),"Raw_Hit");
+		if(!this->ReadTree(TString(tmp.c_str()),"Raw_Hit"))continue;
 		int Nentry = tin->GetEntries();
 		for(int ientry=0;ientry<Nentry;ientry++)
 		{
 			if(ientry<5)continue; // Skip the first 5 events from Hao Liu
-			tin->GetEntry(ientry);
+			GetEntry(ientry);
 			for(int i=0;i<_hitTag->size();i++)
 			{
 				if(mode=="dac" && _hitTag->at(i)!=1)continue; // For DAC we set =1 , for cosmic rays we skip 0
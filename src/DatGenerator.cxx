@@ -0,0 +1,193 @@
+#include "DatGenerator.h"
+
+#include <iostream>
+
+using namespace std;
+
+int DatGenerator::Generate(const string &file_name, long n_events)
+{
+	ofstream f_out(file_name, ios::out | ios::binary);
+	if (!f_out)
+	{
+		cout << "cant create " << file_name << endl;
+		return 0;
+	}
+	m_error_No = 0;
+	m_time = 1000;
+	vector<unsigned char> event;
+	for (long i = 0; i < n_events; ++i)
+	{
+		event.clear();
+		GenerateEvent(i, event);
+		f_out.write(reinterpret_cast<const char *>(event.data()), event.size());
+	}
+	return f_out.good() ? 1 : 0;
+}
+
+int DatGenerator::GenerateFelix(const string &list_file, long n_events, long late_events)
+{
+	string base = list_file.substr(0, list_file.find_last_of('.'));
+	ofstream f_list(list_file);
+	ofstream f_dat(base + ".dat", ios::out | ios::binary);
+	if (!f_list || !f_dat)
+	{
+		cout << "cant create " << list_file << " or " << base << ".dat" << endl;
+		return 0;
+	}
+	vector<ofstream> f_layers(m_layers);
+	vector<uint64_t> raw(m_layers);
+	for (int layer = 0; layer < m_layers; ++layer)
+	{
+		string layer_file = base + "_layer" + to_string(layer) + ".felix";
+		f_layers[layer].open(layer_file, ios::out | ios::binary);
+		if (!f_layers[layer])
+		{
+			cout << "cant create " << layer_file << endl;
+			return 0;
+		}
+		f_list << layer_file << endl;
+	}
+	double error_rate = m_error_rate;
+	m_error_rate = 0; // The event bags are split at the SPIROC bag footers, they have to be complete
+	m_error_No = 0;
+	m_time = 1000;
+	vector<unsigned char> event, merged, bag;
+	for (long i = 0; i < n_events; ++i)
+	{
+		event.clear();
+		GenerateEvent(i, event);
+		// Header, the SPIROC bags ending with fe ee fe ee ff <layer>, then the Cherenkov counter and the footer
+		merged.assign(event.begin(), event.begin() + 4);
+		size_t begin = 4;
+		for (int layer = 0; layer < m_layers; ++layer)
+		{
+			size_t end = begin;
+			while (event[end] != 0xfe || event[end + 1] != 0xee || event[end + 2] != 0xfe || event[end + 3] != 0xee || event[end + 4] != 0xff)
+				end += 2;
+			end += 6;
+			if (layer % 2 == 0 || i >= late_events)
+			{
+				merged.insert(merged.end(), event.begin() + begin, event.begin() + end);
+				bag.assign(event.begin(), event.begin() + 4);
+				bag.insert(bag.end(), event.begin() + begin, event.begin() + end);
+				bag.insert(bag.end(), event.end() - 8, event.end());
+				PutFelixPacket(f_layers[layer], raw[layer], bag);
+			}
+			begin = end;
+		}
+		merged.insert(merged.end(), event.end() - 8, event.end());
+		f_dat.write(reinterpret_cast<const char *>(merged.data()), merged.size());
+	}
+	m_error_rate = error_rate;
+	bool good = f_list.good() && f_dat.good();
+	for (const ofstream &f_layer : f_layers)
+		good = good && f_layer.good();
+	return good ? 1 : 0;
+}
+
+void DatGenerator::GenerateEvent(long event, vector<unsigned char> &out)
+{
+	int cycleID = event / m_events_per_cycle;
+	int triggerID = (m_first_trigger + event) % 65536;
+	int error = Chance(m_error_rate) ? Random(0, kErrorTypes - 1) : -1;
+	int error_layer = Random(0, m_layers - 1); // Layer hit by kBadLayer, kTriggerMismatch or kTruncatedChip
+	if (error >= 0)
+		m_error_No++;
+
+	// 1. Event header
+	out.insert(out.end(), {0xfb, 0xee, 0xfb, 0xee});
+
+	// 2. One SPIROC bag per layer
+	for (int layer = 0; layer < m_layers; ++layer)
+	{
+		bool bad_layer = layer == error_layer;
+		out.insert(out.end(), {0xfa, 0x5a, 0xfa, 0x5a});
+		PutWord(out, cycleID >> 16);
+		PutWord(out, cycleID);
+		PutWord(out, (bad_layer && error == kTriggerMismatch) ? triggerID + 1 : triggerID);
+		bool truncate = bad_layer && error == kTruncatedChip;
+		for (int chip = 1; chip <= m_chips; ++chip)
+		{
+			if (!Chance(m_chip_occupancy))
+				continue;
+			PutChip(out, chip, truncate);
+			truncate = false;
+		}
+		out.insert(out.end(), {0xfe, 0xee, 0xfe, 0xee, 0xff});
+		out.push_back((bad_layer && error == kBadLayer) ? 0x40 : layer);
+	}
+
+	// 3. Cherenkov counter: two trigger bits and 30 bits of event time
+	m_time += Random(1, 50);
+	unsigned int counter = m_time & 0x3fffffff;
+	if (Chance(m_cherenkov_rate))
+		counter |= 0x80000000;
+	if (Chance(m_cherenkov_rate))
+		counter |= 0x40000000;
+	PutWord(out, counter >> 16);
+	PutWord(out, counter);
+
+	// 4. Event footer
+	if (error != kNoFooter)
+		out.insert(out.end(), {0xfe, 0xdd, 0xfe, 0xdd});
+	if (error == kGarbage)
+	{
+		int n = Random(1, 64);
+		for (int i = 0; i < n; ++i)
+			out.push_back(Random(0, 255));
+	}
+}
+
+void DatGenerator::PutChip(vector<unsigned char> &out, int chip_id, bool truncate)
+{
+	// n memory cells: n x (36 TDC + 36 ADC) words, n BCIDs, then the chip ID
+	int memo_No = Random(1, m_memo_cells);
+	size_t begin = out.size();
+	// One 32-bit draw per word: bits 0-11 value, bit 12 gain, bits 16-31 against the hit occupancy
+	unsigned int hit_cut = m_hit_occupancy * 65536;
+	for (int memo = 0; memo < memo_No; ++memo)
+	{
+		for (int ch = 0; ch < 36; ++ch)
+		{
+			unsigned int r = m_rng();
+			PutWord(out, ((r >> 16) < hit_cut ? 0x1000 : 0) | ((r & 0x1000) ? 0x2000 : 0) | (r & 0x0fff));
+		}
+		for (int ch = 0; ch < 36; ++ch)
+		{
+			unsigned int r = m_rng();
+			PutWord(out, ((r & 0x1000) ? 0x2000 : 0) | (r & 0x0fff));
+		}
+	}
+	for (int memo = 0; memo < memo_No; ++memo)
+		PutWord(out, Random(10, 4000));
+	PutWord(out, chip_id);
+	if (truncate)
+		out.erase(out.begin() + begin, out.begin() + begin + 2 * Random(1, 36));
+}
+
+void DatGenerator::PutFelixPacket(ofstream &f_out, uint64_t &raw, const vector<unsigned char> &bag)
+{
+	static const unsigned char packet_header[] = {0xff, 0xa5, 0xab, 0xab, 0x00, 0x00, 0xff, 0xff};
+	static const unsigned char packet_trailer[] = {0xff, 0xff, 0x00, 0x00, 0xba, 0xba, 0x5a, 0xff};
+	static const char block_tag[] = {0x00, 0x00, 0x00, 0x00, char(0xcd), char(0xab)};
+	vector<unsigned char> packet(packet_header, packet_header + sizeof(packet_header));
+	packet.insert(packet.end(), bag.begin(), bag.end());
+	packet.insert(packet.end(), packet_trailer, packet_trailer + sizeof(packet_trailer));
+	for (unsigned char c : packet)
+	{
+		// The block tag covers the bytes k * 1024 - 2 to k * 1024 + 3
+		if (raw % 1024 == 1022)
+		{
+			f_out.write(block_tag, sizeof(block_tag));
+			raw += sizeof(block_tag);
+		}
+		f_out.put(c);
+		raw++;
+	}
+}
+
+void DatGenerator::PutWord(vector<unsigned char> &out, int word)
+{
+	out.push_back((word >> 8) & 0xff);
+	out.push_back(word & 0xff);
+}
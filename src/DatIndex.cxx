@@ -0,0 +1,109 @@
+#include "DatIndex.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <sys/stat.h>
+
+using namespace std;
+
+constexpr char DatIndex::s_magic[8];
+
+int DatIndex::Stat(const string &dat_file, Header &header)
+{
+	struct stat st;
+	if (stat(dat_file.c_str(), &st) != 0)
+		return 0;
+	memcpy(header.magic, s_magic, sizeof(s_magic));
+	header.file_size = st.st_size;
+	header.mtime_sec = st.st_mtim.tv_sec;
+	header.mtime_nsec = st.st_mtim.tv_nsec;
+	return 1;
+}
+
+int DatIndex::Load(const string &dat_file)
+{
+	m_records.clear();
+	Header current, saved;
+	if (!Stat(dat_file, current))
+		return 0;
+	ifstream f_idx(FileName(dat_file), ios::in | ios::binary);
+	if (!f_idx || !f_idx.read(reinterpret_cast<char *>(&saved), sizeof(saved)))
+		return 0;
+	if (memcmp(saved.magic, s_magic, sizeof(s_magic)) != 0 || saved.file_size != current.file_size ||
+		saved.mtime_sec != current.mtime_sec || saved.mtime_nsec != current.mtime_nsec)
+	{
+		LogLine(kInfo) << "DatIndex: " << FileName(dat_file) << " does not match " << dat_file << ", rebuilding";
+		return 0;
+	}
+	// A corrupt record count must not size the allocation: the records have to be in the sidecar, and every
+	// event bag takes at least s_least_bag_size bytes of the .dat file
+	f_idx.seekg(0, ios::end);
+	uint64_t idx_size = f_idx.tellg();
+	f_idx.seekg(sizeof(saved));
+	if (saved.record_No > (idx_size - sizeof(saved)) / sizeof(IndexRecord) || saved.record_No > current.file_size / s_least_bag_size)
+	{
+		LogLine(kWarning) << "DatIndex: " << FileName(dat_file) << " has " << saved.record_No << " records in " << idx_size << " bytes for a "
+						  << current.file_size << " bytes file, rebuilding";
+		return 0;
+	}
+	m_records.resize(saved.record_No);
+	if (!f_idx.read(reinterpret_cast<char *>(m_records.data()), m_records.size() * sizeof(IndexRecord)))
+	{
+		LogLine(kWarning) << "DatIndex: " << FileName(dat_file) << " is truncated, rebuilding";
+		m_records.clear();
+		return 0;
+	}
+	// The records are used as views into the mapped file, each has to lie inside it, after the one before
+	uint64_t previous_end = 0;
+	for (size_t i = 0; i < m_records.size(); ++i)
+	{
+		const IndexRecord &record = m_records[i];
+		if (record.offset < previous_end || record.length < s_least_bag_size || record.offset > current.file_size ||
+			record.length > current.file_size - record.offset)
+		{
+			LogLine(kWarning) << "DatIndex: record " << i << " of " << FileName(dat_file) << " (offset " << record.offset << " length "
+							  << record.length << ") is not an event bag of the " << current.file_size << " bytes file, rebuilding";
+			m_records.clear();
+			return 0;
+		}
+		previous_end = record.offset + record.length;
+	}
+	return 1;
+}
+
+int DatIndex::Save(const string &dat_file) const
+{
+	Header header;
+	if (!Stat(dat_file, header))
+		return 0;
+	header.record_No = m_records.size();
+	string idx_name = FileName(dat_file);
+	string tmp_name = idx_name + ".tmp";
+	ofstream f_idx(tmp_name, ios::out | ios::binary);
+	if (!f_idx)
+	{
+		LogLine(kError) << "cant create " << tmp_name;
+		return 0;
+	}
+	f_idx.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	f_idx.write(reinterpret_cast<const char *>(m_records.data()), m_records.size() * sizeof(IndexRecord));
+	f_idx.close();
+	if (!f_idx || rename(tmp_name.c_str(), idx_name.c_str()) != 0)
+	{
+		LogLine(kError) << "cant write " << idx_name;
+		remove(tmp_name.c_str());
+		return 0;
+	}
+	return 1;
+}
+
+size_t DatIndex::LowerBound(uint64_t pos) const
+{
+	return lower_bound(m_records.begin(), m_records.end(), pos, [](const IndexRecord &record, uint64_t p)
+					   { return record.offset < p; }) -
+		   m_records.begin();
+}
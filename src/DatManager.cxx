@@ -1,17 +1,34 @@
 #include "DatManager.h"
-#include "Global.h"
+#include "MarkerScanner.h"
+#include "Logger.h"
 
-using namespace std;
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <memory>
+#include <thread>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-extern char char_tmp[200];
-int int_tmp = 0;
-int flag = 0;
+#include <Compression.h>
+#include <TNamed.h>
+#include <TROOT.h>
+
+using namespace std;
 
-int DatManager::CatchEventBag(ifstream &f_in, vector<int> &buffer_v, long &cherenkov_counter)
+int DatManager::CatchEventBag(istream &f_in, EventBagView &bag, long &cherenkov_counter)
 {
 	// 1. Initialization
 	std::vector<unsigned char> temp_buffer(s_read_size);
-	buffer_v.clear();
+	bag.offset = 0;
+	bag.length = 0;
 
 	// 2. Clean up buffer if it gets too large (avoid memory bloat)
 	if (m_buffer.size() > s_buffer_size && m_buffer_start > s_half_buffer_size)
@@ -21,20 +38,14 @@ int DatManager::CatchEventBag(ifstream &f_in, vector<int> &buffer_v, long &chere
 	}
 
 	// 3. Find header
+	MarkerType marker;
 	bool found_header = false;
-	size_t header_pos = 0;
-
-	// Check if header exists in remaining data
-	if (m_buffer_start < m_buffer.size())
+	size_t header_pos = m_buffer_start + MarkerScanner::Find(m_buffer.data() + m_buffer_start, m_buffer.size() - m_buffer_start,
+															 MarkerScanner::Bit(kEventHead));
+	if (header_pos < m_buffer.size())
 	{
-		auto it = std::search(m_buffer.begin() + m_buffer_start, m_buffer.end(),
-							  s_event_head.begin(), s_event_head.end());
-		if (it != m_buffer.end())
-		{
-			found_header = true;
-			header_pos = std::distance(m_buffer.begin(), it);
-			m_buffer_start = header_pos; // Update start position to header
-		}
+		found_header = true;
+		m_buffer_start = header_pos; // Update start position to header
 	}
 
 	// If header not found, read more data from file
@@ -43,16 +54,16 @@ int DatManager::CatchEventBag(ifstream &f_in, vector<int> &buffer_v, long &chere
 		size_t bytes_read = f_in.gcount();
 		size_t old_size = m_buffer.size();
 		m_buffer.insert(m_buffer.end(), temp_buffer.begin(), temp_buffer.begin() + bytes_read);
+		m_stats.bytes += bytes_read;
 
 		// Search for header in the newly added data plus some overlap
 		size_t search_start = std::max(m_buffer_start,
 									   old_size > s_event_head_overlap ? old_size - s_event_head_overlap : 0);
-		auto it = std::search(m_buffer.begin() + search_start, m_buffer.end(),
-							  s_event_head.begin(), s_event_head.end());
-		if (it != m_buffer.end())
+		header_pos = search_start + MarkerScanner::Find(m_buffer.data() + search_start, m_buffer.size() - search_start,
+														MarkerScanner::Bit(kEventHead));
+		if (header_pos < m_buffer.size())
 		{
 			found_header = true;
-			header_pos = std::distance(m_buffer.begin(), it);
 			m_buffer_start = header_pos; // Update start position to header
 			break;
 		}
@@ -63,88 +74,66 @@ int DatManager::CatchEventBag(ifstream &f_in, vector<int> &buffer_v, long &chere
 		return 0;
 	}
 
-	// 4. Find footer
+	// 4. Find footer or the next header in a single pass, whichever comes first
 	bool found_footer = false;
 	bool found_next_header = false;
 	size_t footer_end_pos = 0;
-
-	// Check if footer already exists in current buffer
-	auto it_footer = std::search(m_buffer.begin() + m_buffer_start, m_buffer.end(),
-								 s_event_foot.begin(), s_event_foot.end());
-	auto it_next_head = std::search(m_buffer.begin() + m_buffer_start + s_event_head_size, m_buffer.end(),
-									s_event_head.begin(), s_event_head.end());
-	size_t pos_footer = std::distance(m_buffer.begin(), it_footer);
-	size_t pos_next_head = std::distance(m_buffer.begin(), it_next_head);
-	if (pos_footer < pos_next_head) // 找到 footer 并小于下一个 header
-	{
-		found_footer = true;
-		footer_end_pos = pos_footer + s_event_foot_size;
-	}
-	else if (pos_next_head < pos_footer) // 找到 next_header 并小于下一个 footer
+	size_t search_start = m_buffer_start + s_event_head_size;
+	while (true)
 	{
-		cout << "CatchEventBag: footer found after next header." << endl;
-		found_next_header = true;
-		footer_end_pos = pos_next_head;
-	}
+		size_t pos_marker = search_start + MarkerScanner::Find(m_buffer.data() + search_start, m_buffer.size() - search_start,
+															   MarkerScanner::s_event_markers, &marker);
+		if (pos_marker < m_buffer.size() && marker == kEventFoot) // 找到 footer 并小于下一个 header
+		{
+			found_footer = true;
+			footer_end_pos = pos_marker + s_event_foot_size;
+			break;
+		}
+		else if (pos_marker < m_buffer.size()) // 找到 next_header 并小于下一个 footer
+		{
+			LogLine(kWarning, "footer found after next header") << "CatchEventBag: footer found after next header.";
+			m_stats.footer_after_header++;
+			found_next_header = true;
+			footer_end_pos = pos_marker;
+			break;
+		}
 
-	// If footer or next header not found in current buffer, read more data from file
-	while (!found_footer && !found_next_header &&
-		   f_in.read(reinterpret_cast<char *>(temp_buffer.data()), s_read_size))
-	{
+		// If footer or next header not found in current buffer, read more data from file
+		if (!f_in.read(reinterpret_cast<char *>(temp_buffer.data()), s_read_size))
+			break;
 		size_t bytes_read = f_in.gcount();
 		size_t old_size = m_buffer.size();
 		m_buffer.insert(m_buffer.end(), temp_buffer.begin(), temp_buffer.begin() + bytes_read);
+		m_stats.bytes += bytes_read;
 
-		// Search for footer in the newly added data plus some overlap
-		size_t search_start = old_size - s_event_foot_overlap; // Now at least 4 bytes after m_buffer_start
-		it_footer = std::search(m_buffer.begin() + search_start, m_buffer.end(),
-								s_event_foot.begin(), s_event_foot.end());
-		it_next_head = std::search(m_buffer.begin() + search_start, m_buffer.end(),
-								   s_event_head.begin(), s_event_head.end());
-	pos_footer = std::distance(m_buffer.begin(), it_footer);
-	pos_next_head = std::distance(m_buffer.begin(), it_next_head);
-	if (pos_footer < pos_next_head) // 找到 footer 并小于下一个 header
-	{
-		found_footer = true;
-		footer_end_pos = pos_footer + s_event_foot_size;
-		break;
-	}
-	else if (pos_next_head < pos_footer) // 找到 next_header 并小于下一个 footer
-	{
-		cout << "CatchEventBag: footer found after next header." << endl;
-		found_next_header = true;
-		footer_end_pos = pos_next_head;
-		break;
-	}
+		// Search in the newly added data plus some overlap
+		search_start = std::max(m_buffer_start + s_event_head_size, old_size - s_event_foot_overlap);
 	}
 
 	if (!found_footer && !found_next_header)
 	{
-		cout << "CatchEventBag:abnormal end" << endl;
+		LogLine(kWarning, "abnormal end") << "CatchEventBag:abnormal end";
+		m_stats.abnormal_end++;
 		return 0;
 	}
 
-	// 3. Copy event data to buffer_v using iterators (more efficient)
-	size_t event_size = footer_end_pos - header_pos;
-	buffer_v.reserve(event_size); // Reserve space to avoid reallocation
-	buffer_v.assign(m_buffer.begin() + header_pos,
-					m_buffer.begin() + footer_end_pos);
+	// 5. Return a view of the event data, valid until the next call (no copy)
+	bag.offset = header_pos;
+	bag.length = footer_end_pos - header_pos;
+	m_buffer_start = footer_end_pos;
 
-	if (buffer_v.size() < s_least_event_size)
+	if (bag.length < s_least_event_size)
 	{
 		return 0;
 	}
 
-	// 4. Get Cherenkov Counter
-	cherenkov_counter = (buffer_v[buffer_v.size() - 8] << 24) +
-						(buffer_v[buffer_v.size() - 7] << 16) +
-						(buffer_v[buffer_v.size() - 6] << 8) +
-						(buffer_v[buffer_v.size() - 5]);
-
-	// 5. Update start position for next call (no erase needed!)
-	m_buffer_start = footer_end_pos;
+	// 6. Get Cherenkov Counter
+	cherenkov_counter = ((long)m_buffer[footer_end_pos - 8] << 24) +
+						((long)m_buffer[footer_end_pos - 7] << 16) +
+						((long)m_buffer[footer_end_pos - 6] << 8) +
+						((long)m_buffer[footer_end_pos - 5]);
 
-	// 6. Check if end of file
+	// 7. Check if end of file
 	if (f_in.eof())
 	{
 		return 0;
@@ -155,452 +144,2144 @@ int DatManager::CatchEventBag(ifstream &f_in, vector<int> &buffer_v, long &chere
 	}
 }
 
-int DatManager::CatchSPIROCBag(ifstream &f_in, vector<int> &buffer_v, int &layer_id, int &cycleID, int &triggerID)
+int DatManager::CatchEventBag(const MappedFile &f_map, size_t &pos, EventBagView &bag, long &cherenkov_counter)
 {
-	// cout<<"catch a bag"<<endl;
-	bool b_begin = 0;
-	bool b_end = 0;
-	int buffer = 0;
-	while (!b_begin && f_in.read((char *)(&buffer), 1))
-	{
-		// cout<<hex<<buffer<<" ";
-		buffer_v.push_back(buffer);
-		if (buffer_v.size() > 4)
-			buffer_v.erase(buffer_v.begin(), buffer_v.begin() + buffer_v.size() - 4);
-		if (buffer_v[0] == 0xfa && buffer_v[1] == 0x5a && buffer_v[2] == 0xfa && buffer_v[3] == 0x5a && buffer_v.size() == 4)
-			b_begin = 1;
-	}
-	while (!b_end && f_in.read((char *)(&buffer), 1))
-	{
-		buffer_v.push_back(buffer);
-		int_tmp = buffer_v.size();
-		// if(int_tmp>4 && buffer_v[int_tmp-2] == 0xfe && buffer_v[int_tmp-1] == 0xee && buffer_v[int_tmp-4] == 0xfe && buffer_v[int_tmp-3] == 0xee) b_end=1;
-		if (int_tmp >= 4 && buffer_v[int_tmp - 2] == 0xfe && buffer_v[int_tmp - 1] == 0xee && buffer_v[int_tmp - 4] == 0xfe && buffer_v[int_tmp - 3] == 0xee)
-			b_end = 1;
-	}
-	f_in.read((char *)(&buffer), 1);
-	if (buffer != 0xff)
-	{
-		cout << " abnormal layer ff " << hex << buffer << endl;
-		buffer_v.clear();
+	// 1. Initialization
+	const unsigned char *data = f_map.Data();
+	const unsigned char *end = data + f_map.Size();
+	bag.offset = 0;
+	bag.length = 0;
+	if (!data || pos >= f_map.Size())
+	{
 		return 0;
 	}
-	f_in.read((char *)(&buffer), 1);
-	if (buffer < 0 || buffer > 39)
+
+	// 2. Find header
+	MarkerType marker;
+	const unsigned char *header = data + pos + MarkerScanner::Find(data + pos, end - (data + pos), MarkerScanner::Bit(kEventHead));
+	if (header == end)
 	{
-		cout << " abnormal layer " << hex << buffer << endl;
-		buffer_v.clear();
+		pos = f_map.Size();
 		return 0;
 	}
-	layer_id = buffer;
-	// cout<<"cycleID "<<hex<<cycleID<<endl;
-	if ((buffer_v.size()) % 2)
+
+	// 3. Find footer, or the next header if it comes first (single pass)
+	const unsigned char *search_start = header + s_event_head_size;
+	const unsigned char *footer_end = search_start + MarkerScanner::Find(search_start, end - search_start, MarkerScanner::s_event_markers, &marker);
+	if (footer_end == end)
 	{
-		cout << "wrong bag size " << dec << buffer_v.size() << endl;
-		buffer_v.clear();
-		return 0; // b_readover
+		LogLine(kWarning, "abnormal end") << "CatchEventBag:abnormal end";
+		m_stats.abnormal_end++;
+		pos = f_map.Size();
+		return 0;
 	}
-	for (int i = 0; i < buffer_v.size() / 2; ++i)
+	else if (marker == kEventFoot)
 	{
-		buffer_v[i] = buffer_v[2 * i] * 0x100 + buffer_v[2 * i + 1];
+		footer_end += s_event_foot_size;
 	}
-	buffer_v.erase(buffer_v.begin() + buffer_v.size() / 2, buffer_v.end());
-	cycleID = buffer_v[2] * 0x10000 + buffer_v[3];
-	triggerID = buffer_v[4];
-	buffer_v.erase(buffer_v.begin() + 2, buffer_v.begin() + 5);
-	if (f_in.eof())
-		return 0;
 	else
+	{
+		LogLine(kWarning, "footer found after next header") << "CatchEventBag: footer found after next header.";
+		m_stats.footer_after_header++;
+	}
+
+	// 4. Return a view into the mapped file
+	bag.offset = header - data;
+	bag.length = footer_end - header;
+	pos = footer_end - data;
+
+	// 5. Get Cherenkov Counter
+	if (bag.length >= s_least_event_size)
+	{
+		cherenkov_counter = ((long)footer_end[-8] << 24) +
+							((long)footer_end[-7] << 16) +
+							((long)footer_end[-6] << 8) +
+							((long)footer_end[-5]);
+	}
+	return 1;
+}
+
+int DatManager::CatchEventBag(RingInput &ring, size_t &pos, EventBagView &bag, long &cherenkov_counter)
+{
+	bag.offset = 0;
+	bag.length = 0;
+	while (true)
+	{
+		// 1. Find header, waiting for the stream while there is none; the data searched is released
+		uint64_t header = 0;
+		uint64_t end = 0;
+		for (uint64_t from = pos;; from = end - s_event_head_overlap)
+		{
+			ring.Release(from);
+			end = ring.Wait(from + s_event_head_size);
+			header = ring.Find(from, end, MarkerScanner::Bit(kEventHead));
+			if (header < end)
+				break;
+			if (end < from + s_event_head_size) // Stream ended
+			{
+				pos = end;
+				return 0;
+			}
+		}
+		ring.Release(header);
+
+		// 2. Find footer, or the next header if it comes first; the whole bag has to stay in the ring
+		MarkerType marker;
+		uint64_t footer_end = 0;
+		bool b_oversized = false;
+		for (uint64_t from = header + s_event_head_size;; from = end - s_event_foot_overlap)
+		{
+			end = ring.Wait(from + s_event_foot_size);
+			footer_end = ring.Find(from, end, MarkerScanner::s_event_markers, &marker);
+			if (footer_end < end)
+				break;
+			if (end >= header + ring.Capacity())
+			{
+				b_oversized = true;
+				break;
+			}
+			if (end < from + s_event_foot_size)
+			{
+				LogLine(kWarning, "abnormal end") << "CatchEventBag:abnormal end";
+				m_stats.abnormal_end++;
+				pos = end;
+				return 0;
+			}
+		}
+		if (b_oversized)
+		{
+			LogLine(kWarning, "event bag larger than the ring buffer") << "CatchEventBag: event bag at byte " << header << " is larger than the "
+																	   << (ring.Capacity() >> 20) << " MB ring buffer, skipped (raise ring-size)";
+			m_stats.oversized_bag++;
+			pos = end - s_event_head_overlap;
+			continue;
+		}
+		if (marker == kEventFoot)
+		{
+			footer_end += s_event_foot_size;
+		}
+		else
+		{
+			LogLine(kWarning, "footer found after next header") << "CatchEventBag: footer found after next header.";
+			m_stats.footer_after_header++;
+		}
+
+		// 3. Return the position in the stream, the bag stays in the ring until the next call
+		bag.offset = header;
+		bag.length = footer_end - header;
+		pos = footer_end;
+
+		// 4. Get Cherenkov Counter
+		if (bag.length >= s_least_event_size)
+		{
+			cherenkov_counter = ((long)ring.At(footer_end - 8) << 24) +
+								((long)ring.At(footer_end - 7) << 16) +
+								((long)ring.At(footer_end - 6) << 8) +
+								((long)ring.At(footer_end - 5));
+		}
 		return 1;
+	}
 }
 
-int DatManager::CatchSPIROCBag(vector<int> &event_v, vector<int> &buffer_v, int &layer_id, int &cycleID, int &triggerID)
+int DatManager::CatchSPIROCBag(const unsigned char *event, size_t event_size, size_t &pos, SPIROCBag &bag)
 {
 	// cout<<"catch a bag"<<endl;
-	if (event_v.size() < 74)
+	if (event_size - pos < s_least_spiroc_size)
 	{
-		event_v.clear();
+		pos = event_size;
 		return 0;
 	}
-	buffer_v.clear();
-	bool b_begin = 0;
-	bool b_end = 0;
-	int buffer = 0;
-	int i_begin = 0;
-	int i_end = 0;
-	// cout <<hex<<event_v[0]<<" "<<event_v[1]<<" "<<event_v[2]<<" "<<event_v[3]<<" "<<event_v.size()<<endl;
-	for (int i = 0; i < event_v.size(); ++i)
+	// The header must leave room for at least one more byte, the footer follows the header
+	const unsigned char *begin = event + pos + MarkerScanner::Find(event + pos, event_size - 1 - pos, MarkerScanner::Bit(kSpirocHead));
+	const unsigned char *end = event + event_size;
+	if (begin != event + event_size - 1)
 	{
-		if (b_begin == 0 && i < event_v.size() - 4 && event_v[i] == 0xfa && event_v[i + 1] == 0x5a &&
-			event_v[i + 2] == 0xfa && event_v[i + 3] == 0x5a)
-		{
-			b_begin = 1;
-			i_begin = i;
-			// cout<<hex<<i_begin<<" "<<event_v[i]<<" "<<event_v[i+1]<<" "<<event_v[i+2]<<" "<<event_v[i+3]<<" "<<event_v.size()<<endl;
-		}
-		if (b_begin == 1 && i > 2 && event_v[i - 3] == 0xfe && event_v[i - 2] == 0xee &&
-			event_v[i - 1] == 0xfe && event_v[i] == 0xee)
-		{
-			b_end = 1;
-			i_end = i;
-			break;
-		}
+		const unsigned char *search_start = begin + s_spiroc_head.size();
+		end = search_start + MarkerScanner::Find(search_start, end - search_start, MarkerScanner::Bit(kSpirocFoot));
 	}
-	// cout<<hex<<i_begin<<" "<<i_end<<" "<<event_v.size()<<" "<<b_begin<<" "<<b_end<<endl;
-	if ((b_begin * b_end) == 0)
+	if (end == event + event_size)
 	{
-		buffer_v.clear();
-		event_v.clear();
+		pos = event_size;
 		return 0;
 	}
-	buffer_v.assign(event_v.begin() + i_begin, event_v.begin() + i_end + 1);
-	event_v.erase(event_v.begin(), event_v.begin() + i_end + 1);
+	end += s_spiroc_foot.size();
+	pos = end - event;
 	// Read in buffer over
-	if (event_v.size() < 2)
+	if (event_size - pos < 2)
 	{
-		event_v.clear();
-		buffer_v.clear();
-		cout << " abnormal Eventbuffer " << endl;
+		pos = event_size;
+		LogLine(kWarning, "abnormal Eventbuffer") << " abnormal Eventbuffer ";
+		m_stats.abnormal_event_buffer++;
 		return 0;
 	}
-	if (event_v[0] != 0xff)
+	if (event[pos] != 0xff)
 	{
-		cout << " abnormal layer ff " << hex << event_v[0] << endl;
-		buffer_v.clear();
+		LogLine(kWarning, "abnormal layer ff") << " abnormal layer ff " << hex << (int)event[pos];
+		m_stats.abnormal_layer_ff++;
 		return 0;
 	}
-	if (event_v[1] < 0 || event_v[1] > 39)
+	if (event[pos + 1] > 39)
 	{
-		cout << " abnormal layer " << hex << event_v[1] << endl;
-		buffer_v.clear();
+		LogLine(kWarning, "abnormal layer") << " abnormal layer " << hex << (int)event[pos + 1];
+		m_stats.abnormal_layer++;
 		return 0;
 	}
-	layer_id = event_v[1];
-	event_v.erase(event_v.begin(), event_v.begin() + 2);
+	int layer_id = event[pos + 1];
+	pos += 2;
 	// cout<<"cycleID "<<hex<<cycleID<<endl;
-	if ((buffer_v.size()) % 2)
+	size_t bag_size = end - begin;
+	if (bag_size % 2 || bag_size < s_spiroc_head.size() + s_spiroc_id_size + s_spiroc_foot.size())
 	{
-		cout << "wrong bag size " << dec << buffer_v.size() << endl;
-		buffer_v.clear();
+		LogLine(kWarning, "wrong bag size") << "wrong bag size " << dec << bag_size;
+		m_stats.wrong_bag_size++;
 		return 0;
 	}
-	for (int i = 0; i < buffer_v.size() / 2; ++i)
+	const unsigned char *id = begin + s_spiroc_head.size();
+	bag.layer_id = layer_id;
+	bag.cycleID = ((id[0] * 0x100 + id[1]) * 0x10000) + (id[2] * 0x100 + id[3]);
+	bag.triggerID = id[4] * 0x100 + id[5];
+	bag.data = id + s_spiroc_id_size;
+	bag.word_No = (end - s_spiroc_foot.size() - bag.data) / 2;
+	m_stats.spiroc_bags++;
+	m_stats.layer_spiroc_bags[layer_id]++;
+	if (bag.word_No == 0)
+		m_stats.empty_spiroc_bags++;
+	return 1;
+}
+
+int DatManager::DecodeAEvent(const ChipBuffer::Slot &slot, int layer_id, int chip, int Memo_ID, const bool b_auto_gain)
+{
+	size_t offset = _cellID.size();
+	ResizeColumns(offset + channel_No);
+	if (b_auto_gain)
+		DecodeCell<true>(slot, layer_id, chip, Memo_ID, offset);
+	else
+		DecodeCell<false>(slot, layer_id, chip, Memo_ID, offset);
+	return 1;
+}
+
+#ifdef __SSE2__
+namespace
+{
+	// Converts 4 int lanes to double and stores them at out
+	inline void StoreDouble(double *out, __m128i v)
 	{
-		buffer_v[i] = buffer_v[2 * i] * 0x100 + buffer_v[2 * i + 1];
+		_mm_storeu_pd(out, _mm_cvtepi32_pd(v));
+		_mm_storeu_pd(out + 2, _mm_cvtepi32_pd(_mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2))));
 	}
-	buffer_v.erase(buffer_v.begin() + buffer_v.size() / 2, buffer_v.end());
-	cycleID = buffer_v[2] * 0x10000 + buffer_v[3];
-	triggerID = buffer_v[4];
-	buffer_v.erase(buffer_v.begin() + 2, buffer_v.begin() + 5);
-	return 1;
 }
+#endif
 
-int DatManager::DecodeAEvent(vector<int> &chip_v, int layer_id, int Memo_ID, const bool b_auto_gain)
+template <bool AutoGain>
+void DatManager::DecodeCell(const ChipBuffer::Slot &slot, int layer_id, int chip, int Memo_ID, size_t offset)
 {
-	int size = chip_v.size();
-	if ((size % 73) != 1)
+	// Word i is the TDC (high gain) word of channel 35 - i, word 36 + i its ADC (low gain) word:
+	// value in bits 0-11, hit bit 12, gain bit 13
+	const uint16_t *tdc = slot.word;
+	const uint16_t *adc = slot.word + channel_No;
+	const int cell_base = layer_id * 100000 + chip * 10000 + Memo_ID * 100 + channel_No - 1;
+	const int BCID = slot.BCID();
+	int *cellID = _cellID.data() + offset;
+	int *bcid = _bcid.data() + offset;
+	int *hitTag = _hitTag.data() + offset;
+	int *gainTag_tdc = _gainTag_tdc.data() + offset;
+	int *gainTag = _gainTag.data() + offset;
+	double *HG_Charge = _HG_Charge.data() + offset;
+	double *LG_Charge = _LG_Charge.data() + offset;
+	double *Hit_Time = _Hit_Time.data() + offset;
+	int i = 0;
+#ifdef __SSE2__
+	// 4 channels per step in 32-bit lanes
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128i minus_one = _mm_set1_epi32(-1);
+	const __m128i value_mask = _mm_set1_epi32(0x0fff);
+	const __m128i lane = _mm_set_epi32(3, 2, 1, 0);
+	const __m128i bcid_v = _mm_set1_epi32(BCID);
+	for (; i + 4 <= channel_No; i += 4)
 	{
-		cout << "wrong chip size " << chip_v.size() << endl;
-		return 0;
+		__m128i t = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(tdc + i)), zero);
+		__m128i a = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(adc + i)), zero);
+		__m128i t_value = _mm_and_si128(t, value_mask);
+		__m128i a_value = _mm_and_si128(a, value_mask);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(cellID + i), _mm_sub_epi32(_mm_set1_epi32(cell_base - i), lane));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(bcid + i), bcid_v);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(hitTag + i), _mm_and_si128(_mm_srli_epi32(t, 12), one));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(gainTag_tdc + i), _mm_and_si128(_mm_srli_epi32(t, 13), one));
+		if (AutoGain)
+		{
+			// The gain bit of the ADC word selects HG or LG, the other one is -1
+			__m128i gain = _mm_and_si128(_mm_srli_epi32(a, 13), one);
+			__m128i gain_mask = _mm_sub_epi32(zero, gain);
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(gainTag + i), gain);
+			StoreDouble(HG_Charge + i, _mm_or_si128(a_value, _mm_xor_si128(gain_mask, minus_one)));
+			StoreDouble(LG_Charge + i, _mm_or_si128(a_value, gain_mask));
+			StoreDouble(Hit_Time + i, t_value);
+		}
+		else
+		{
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(gainTag + i), minus_one);
+			StoreDouble(HG_Charge + i, t_value);
+			StoreDouble(LG_Charge + i, a_value);
+			StoreDouble(Hit_Time + i, minus_one);
+		}
 	}
-	int Memo_No = size / channel_FEE;
-	int offset = 72 * (Memo_No - 1);
-	for (int i_ch = 0; i_ch < channel_No; ++i_ch)
-	{ // 72+BCID+Chip
-		int chanID = channel_No - 1 - i_ch;
-		int gain = chip_v.at(i_ch + offset + channel_No) & 0x2000;
-		int hit = chip_v.at(i_ch + offset) & 0x1000;
-		int tdc = chip_v.at(i_ch + offset) & 0x0fff;
-		int gainTag_tdc = chip_v.at(i_ch + offset) & 0x2000;
-		int adc = chip_v.at(i_ch + offset + channel_No) & 0x0fff;
-		int chip = chip_v[size - 1] - 1;
-		int BCID = chip_v[size - 2];
-		// if(hit<=1)continue;
-		_cellID.push_back(layer_id * 1E5 + chip * pow(10, 4) + Memo_ID * pow(10, 2) + chanID);
-		_bcid.push_back(BCID);
-		if (hit > 1)
-			_hitTag.push_back(1);
+#endif
+	for (; i < channel_No; ++i)
+	{
+		int t_value = tdc[i] & 0x0fff;
+		int a_value = adc[i] & 0x0fff;
+		cellID[i] = cell_base - i;
+		bcid[i] = BCID;
+		hitTag[i] = (tdc[i] >> 12) & 1;
+		gainTag_tdc[i] = (tdc[i] >> 13) & 1;
+		if (AutoGain)
+		{
+			int gain = (adc[i] >> 13) & 1;
+			gainTag[i] = gain;
+			HG_Charge[i] = gain ? a_value : -1;
+			LG_Charge[i] = gain ? -1 : a_value;
+			Hit_Time[i] = t_value;
+		}
 		else
-			_hitTag.push_back(0);
+		{
+			gainTag[i] = -1;
+			HG_Charge[i] = t_value;
+			LG_Charge[i] = a_value;
+			Hit_Time[i] = -1;
+		}
+	}
+}
+
+void DatManager::ResizeColumns(size_t size)
+{
+	_cellID.resize(size);
+	_bcid.resize(size);
+	_hitTag.resize(size);
+	_gainTag_tdc.resize(size);
+	_gainTag.resize(size);
+	_HG_Charge.resize(size);
+	_LG_Charge.resize(size);
+	_Hit_Time.resize(size);
+}
+
+int DatManager::FillChipBuffer(const SPIROCBag &bag)
+{
+	// for (size_t i = 0; i < bag.word_No; ++i)
+	// 	cout << hex << bag.Word(i) << " ";
+	size_t start = 0; // First word not yet assigned to a chip
+	for (size_t i = channel_FEE; start + i < bag.word_No; i = i + channel_FEE)
+	{
+		// cout<<dec<<i<<" "<<bag.word_No<<" "<<hex<<bag.Word(start + i)<<endl;
+		int chip_id = bag.Word(start + i);
+		if (chip_id < 1 || chip_id > 9)
+			continue;
+		// i / 73 memory cells: 72 data words each, then one BCID each, then the chip ID
+		int memo_No = i / channel_FEE;
+		ChipBuffer::Slot *slot = _chip_arena.Acquire(bag.layer_id, chip_id - 1, memo_No);
+		if (!slot)
+		{
+			LogLine(kWarning, "abnormal Memo_No") << "FillChipBuffer:abnormal Memo_No " << dec << memo_No << " layer " << bag.layer_id << " chip " << chip_id - 1;
+			m_stats.abnormal_memo_no++;
+		}
+		for (int i_memo = 0; slot && i_memo < memo_No; ++i_memo)
+		{
+			for (int j = 0; j < channel_FEE - 1; ++j)
+				slot[i_memo].word[j] = bag.Word(start + i_memo * (channel_FEE - 1) + j);
+			slot[i_memo].word[channel_FEE - 1] = bag.Word(start + memo_No * (channel_FEE - 1) + i_memo);
+		}
+		start += i + 1;
+		// cout<<endl<<dec<<chip_id<<" FillChipBuffer "<<" "<<bag.word_No - start<<endl;
+		i = 0;
+	}
+	if (start < bag.word_No)
+	{
+		count_chipbuffer++;
+		m_stats.abnormal_chip_buffer++;
+		LogLine(kWarning, "abnormal chip buffer") << hex << bag.cycleID << " " << bag.Word(bag.word_No - 1) << " FillChipBuffer:abnormal chip buffer " << dec << " " << bag.layer_id << " " << bag.word_No - start << " " << count_chipbuffer;
+		return 0;
+	}
+	return 1;
+}
+
+void DatManager::DecodeEventBag(const unsigned char *event, size_t event_size, long cherenkov_counter, TTree *tree, const bool b_auto_gain, const bool b_cherenkov)
+{
+	if (m_builder_window > 0)
+	{
+		BuildEvents(event, event_size, cherenkov_counter, tree, b_auto_gain, b_cherenkov);
+		return;
+	}
+	int unpacked = 0;
+	{
+		StageClock clock(m_stats.t_unpack);
+		unpacked = UnpackEventBag(event, event_size, cherenkov_counter, b_auto_gain, b_cherenkov);
+	}
+	if (unpacked)
+	{
+		StageClock clock(m_stats.t_write);
+		FillEvent(tree);
+	}
+}
 
-		if (b_auto_gain)
+int DatManager::UnpackEventBag(const unsigned char *event, size_t event_size, long cherenkov_counter, const bool b_auto_gain, const bool b_cherenkov)
+{
+	DecodeStatus &st = m_status;
+	SPIROCBag bag;
+	size_t pos = 0;
+	bool b_Event = 0;
+	bool b_chipbuffer = Chipbuffer_empty(); // just in case
+	// cout << dec << st.Bag_No << " CatchEventBag size " << event_size << " cherenkov_counter " << cherenkov_counter << endl;
+	while (event_size - pos > s_least_spiroc_size)
+	{
+		// Size of the bag in words including the fa5a/feee markers, 4 for an empty layer
+		size_t bag_size = CatchSPIROCBag(event, event_size, pos, bag) ? bag.word_No + s_spiroc_marker_words : 0;
+		// if(bag.triggerID==last_trigID){
+		// 	continue;
+		// }
+		if (b_chipbuffer == 0)
 		{
-			if (gain)
+			st.pre_trigID = bag.triggerID;
+			st.pre_cycleID = bag.cycleID;
+		}
+		if (bag_size < 74)
+		{
+			if (bag_size != 4)
 			{
-				_gainTag.push_back(1);
-				_HG_Charge.push_back(adc);
-				_LG_Charge.push_back(-1);
+				LogLine(kWarning, "abnormal SPIROC bag size") << "abnormal SPIROC bag size " << bag_size;
+				m_stats.abnormal_spiroc_size++;
 			}
-			else
+			if (!b_chipbuffer)
+				continue;
+		}
+		if (bag.triggerID != st.pre_trigID)
+		{
+			b_Event = 1;
+			LogLine(kWarning, "abnormal ID") << st.pre_cycleID << " " << st.pre_trigID << " abnormal ID " << bag.cycleID << " " << bag.triggerID;
+			m_stats.trigger_mismatch++;
+			continue;
+		}
+		if (bag_size >= 74)
+			FillChipBuffer(bag);
+		b_chipbuffer = Chipbuffer_empty();
+	}
+	if (b_Event)
+		st.Abnormal_Event_No++;
+	if (!b_chipbuffer)
+		return 0;
+	DecodeChips(cherenkov_counter, b_auto_gain, b_cherenkov);
+	return 1;
+}
+
+void DatManager::DecodeChips(long cherenkov_counter, const bool b_auto_gain, const bool b_cherenkov)
+{
+	BranchClear();
+	_cycleID = m_status.pre_cycleID;
+	// All memory cells of every chip, the output columns are sized once for the whole event
+	size_t cell_No = 0;
+	size_t chip_count = 0;
+	for (uint64_t layers = _chip_arena.LayerMask(); layers; layers &= layers - 1)
+	{
+		int i_layer = __builtin_ctzll(layers);
+		for (unsigned chips = _chip_arena.ChipMask(i_layer); chips; chips &= chips - 1, ++chip_count)
+			cell_No += _chip_arena.MemoNo(i_layer, __builtin_ctz(chips));
+	}
+	m_stats.extra_memory_cells += cell_No - chip_count;
+	ResizeColumns(cell_No * channel_No);
+	size_t offset = 0;
+	for (uint64_t layers = _chip_arena.LayerMask(); layers; layers &= layers - 1)
+	{
+		int i_layer = __builtin_ctzll(layers);
+		for (unsigned chips = _chip_arena.ChipMask(i_layer); chips; chips &= chips - 1)
+		{
+			int i_chip = __builtin_ctz(chips);
+			// Memory cell i is the i-th one in the SPIROC bag, with its own BCID
+			int Memo_No = _chip_arena.MemoNo(i_layer, i_chip);
+			for (int i_memo = 0; i_memo < Memo_No; ++i_memo)
 			{
-				_gainTag.push_back(0);
-				_HG_Charge.push_back(-1);
-				_LG_Charge.push_back(adc);
+				if (b_auto_gain)
+					DecodeCell<true>(_chip_arena.Get(i_layer, i_chip, i_memo), i_layer, i_chip, i_memo, offset);
+				else
+					DecodeCell<false>(_chip_arena.Get(i_layer, i_chip, i_memo), i_layer, i_chip, i_memo, offset);
+				offset += channel_No;
 			}
-			_Hit_Time.push_back(tdc);
-			if (gainTag_tdc)
-				_gainTag_tdc.push_back(1);
-			else
-				_gainTag_tdc.push_back(0);
 		}
-		else
+	}
+	_chip_arena.Clear();
+	_Event_Time = (cherenkov_counter & 0x3fffffff);
+	if (b_cherenkov)
+	{
+		_cherenkov.push_back((cherenkov_counter & 0x80000000) / 0x80000000);
+		_cherenkov.push_back((cherenkov_counter & 0x40000000) / 0x40000000);
+	}
+	else
+	{
+		_cherenkov.push_back(-1);
+		_cherenkov.push_back(-1);
+	}
+}
+
+void DatManager::SetEventBuilderLayers(const vector<int> &layers)
+{
+	m_builder_config_layers = 0;
+	for (int layer : layers)
+		if (layer >= 0 && layer < Layer_No)
+			m_builder_config_layers |= uint64_t(1) << layer;
+}
+
+void DatManager::BuildEvents(const unsigned char *event, size_t event_size, long cherenkov_counter, TTree *tree, const bool b_auto_gain, const bool b_cherenkov)
+{
+	// Without configured layers, the layers of the first window of event bags are expected in every event;
+	// until then no event is complete, so an event is not emitted before its late layers are known
+	const long window = static_cast<long>(m_builder_window);
+	const bool b_learning = !m_builder_config_layers && m_status.Bag_No <= window;
+
+	// 1. Keys of emitted events are released one window after the emission, their late bags cannot open
+	//    a second event with the same (cycleID, triggerID)
+	while (!m_closed_keys.empty() && m_status.Bag_No - m_closed_keys.front().second > window)
+	{
+		m_open_index.erase(m_closed_keys.front().first);
+		m_closed_keys.pop_front();
+	}
+
+	// 2. Every SPIROC bag goes to the open event with its (cycleID, triggerID), or opens one
+	{
+		StageClock clock(m_stats.t_unpack);
+		SPIROCBag bag;
+		size_t pos = 0;
+		int first_trigID = -1;
+		while (event_size - pos > s_least_spiroc_size)
 		{
-			_HG_Charge.push_back(tdc);
-			_LG_Charge.push_back(adc);
-			_Hit_Time.push_back(-1);
-			_gainTag.push_back(-1);
-			if (gainTag_tdc)
-				_gainTag_tdc.push_back(1);
+			if (!CatchSPIROCBag(event, event_size, pos, bag))
+				continue;
+			// Counted where the decode without the builder would report "abnormal ID" and drop the bag
+			if (first_trigID < 0)
+				first_trigID = bag.triggerID;
+			bool b_other = bag.triggerID != first_trigID;
+			uint64_t key = (uint64_t(uint32_t(bag.cycleID)) << 16) + bag.triggerID;
+			auto it = m_open_index.find(key);
+			OpenEvent *ev = nullptr;
+			if (it != m_open_index.end() && !it->second)
+			{
+				LogLine(kWarning, "late SPIROC bag") << bag.cycleID << " " << bag.triggerID << " SPIROC bag of layer " << bag.layer_id << " after its event was written, dropped";
+				m_stats.late_bags++;
+				continue;
+			}
+			if (it != m_open_index.end())
+				ev = it->second;
 			else
-				_gainTag_tdc.push_back(0);
-		}
-	}
-	/*for (int i = 0; i < chip_v.size(); ++i){
-	  cout<<hex<<chip_v[i]<<" ";
-	  }
-	  cout<<endl;
-	  */
-	chip_v.erase(chip_v.end() - 2, chip_v.end() - 1);
-	chip_v.erase(chip_v.begin() + offset, chip_v.begin() + offset + 72);
-	if (chip_v.size() == 1)
-		chip_v.clear();
-	return 1;
+			{
+				if (m_open_events.size() >= m_builder_window)
+				{
+					StageClock clock_write(m_stats.t_write);
+					EmitOpenEvent(tree, b_auto_gain, b_cherenkov);
+				}
+				m_open_events.emplace_back();
+				ev = &m_open_events.back();
+				ev->cycleID = bag.cycleID;
+				ev->triggerID = bag.triggerID;
+				ev->cherenkov_counter = cherenkov_counter;
+				ev->opened = m_status.Bag_No;
+				m_open_index[key] = ev;
+			}
+			if (b_other)
+				m_stats.recovered_bags++;
+			ev->layer_mask |= uint64_t(1) << bag.layer_id;
+			if (b_learning)
+				m_builder_layers |= uint64_t(1) << bag.layer_id;
+			ev->data.insert(ev->data.end(), bag.data, bag.data + 2 * bag.word_No);
+			ev->bags.push_back(bag);
+			ev->bags.back().data = nullptr; // Points into the event bag, which is gone when the event is emitted
+		}
+	}
+
+	// 3. Emit in the order the events were opened: complete, or open for m_builder_window event bags
+	StageClock clock(m_stats.t_write);
+	while (!m_open_events.empty())
+	{
+		const OpenEvent &ev = m_open_events.front();
+		bool b_complete = !b_learning && (ev.layer_mask & m_builder_layers) == m_builder_layers;
+		if (!b_complete && m_status.Bag_No - ev.opened < window)
+			break;
+		EmitOpenEvent(tree, b_auto_gain, b_cherenkov);
+	}
 }
 
-int DatManager::FillChipBuffer(vector<int> &buffer_v, int cycleID, int triggerID, int layer_id)
+void DatManager::EmitOpenEvent(TTree *tree, const bool b_auto_gain, const bool b_cherenkov)
 {
-	int size = buffer_v.size();
-	if (size < 4)
+	OpenEvent &ev = m_open_events.front();
+	if ((ev.layer_mask & m_builder_layers) != m_builder_layers)
+		m_stats.timed_out_events++;
+	m_status.pre_trigID = ev.triggerID;
+	m_status.pre_cycleID = ev.cycleID;
+	const unsigned char *data = ev.data.data();
+	for (SPIROCBag &bag : ev.bags)
 	{
-		// cout<<"FillChipBuffer:wrong bag size "<<size<<endl;
-		buffer_v.clear();
-		return 0;
+		bag.data = data;
+		data += 2 * bag.word_No;
+		if (bag.word_No + s_spiroc_marker_words >= 74)
+			FillChipBuffer(bag);
 	}
-	if (buffer_v[0] != 0xfa5a || buffer_v[1] != 0xfa5a || buffer_v[size - 2] != 0xfeee || buffer_v[size - 1] != 0xfeee)
+	if (!_chip_arena.Empty())
 	{
-		cout << "FillChipBuffer:wrong bag package " << hex << buffer_v[0] << " " << buffer_v[1] << " " << buffer_v[size - 2] << " " << buffer_v[size - 1] << endl;
-		buffer_v.clear();
-		return 0;
+		DecodeChips(ev.cherenkov_counter, b_auto_gain, b_cherenkov);
+		FillEvent(tree);
 	}
-	else
+	uint64_t key = (uint64_t(uint32_t(ev.cycleID)) << 16) + ev.triggerID;
+	m_open_index[key] = nullptr;
+	m_closed_keys.emplace_back(key, m_status.Bag_No);
+	m_open_events.pop_front();
+}
+
+void DatManager::FillEvent(TTree *tree)
+{
+	DecodeStatus &st = m_status;
+	if ((st.pre_trigID - st.last_trigID) > 10 && st.last_trigID != 0)
+	{
+		LogLine(kWarning, "Abnormal triggerID") << hex << st.pre_cycleID << " Abnormal triggerID " << st.pre_trigID << " " << st.last_trigID;
+		if (st.last_trigID >= 0) // Not the first event of a file or chunk
+			m_stats.trigger_jump++;
+	}
+	if (st.last_trigID - st.pre_trigID > 40000)
 	{
-		buffer_v.erase(buffer_v.begin(), buffer_v.begin() + 2);
-		buffer_v.erase(buffer_v.end() - 2, buffer_v.end());
-		size = buffer_v.size();
+		LogLine(kInfo, "Loop") << "Loop " << st.pre_trigID << " " << st.last_trigID;
+		m_stats.trigger_loops++;
+		st.Loop_No++;
 	}
-	for (int i = 0; i < buffer_v.size(); ++i)
+	_triggerID = st.pre_trigID + st.Loop_No * pow(2, 16);
+	// if(_Event_Time==st.last_Event_Time)cout<<"abnormal Event Time "<<_Event_Time<<" "<<st.last_Event_Time<<" "<<hex<<st.pre_trigID<<" "<<st.last_trigID<<endl;
+	if (_cherenkov[0] > 0)
+		st.Cherenkov_Event_No1++;
+	if (_cherenkov[1] > 0)
+		st.Cherenkov_Event_No2++;
+	if (_cherenkov[0] * _cherenkov[1] > 0)
+		st.Cherenkov_Event_No++;
+	if (st.Event_No == 0)
+		st.first_trigID = st.pre_trigID;
+	st.Event_No++;
+	WriteEvent(tree);
+	BranchClear();
+	st.last_trigID = st.pre_trigID;
+	st.last_cycleID = st.pre_cycleID;
+	st.last_Event_Time = _Event_Time;
+}
+
+void DatManager::WriteEvent(TTree *tree)
+{
+	if (m_event_sink)
+	{
+		m_event_sink(*this);
+		return;
+	}
+	if (tree && m_zero_suppress)
 	{
-		// cout<<hex<<buffer_v[i]<<" ";
+		if (m_ped_tree && m_zs_event_No % m_zs_prescale == 0)
+		{
+			m_suppressed_No = 0;
+			if (m_compact)
+				PackCompact();
+			m_ped_tree->Fill();
+			m_stats.ped_events++;
+		}
+		if (m_time_tree)
+			m_time_tree->Fill();
+		m_zs_event_No++;
+		SuppressChannels();
 	}
-	for (int i = channel_FEE; i < buffer_v.size(); i = i + channel_FEE)
+	if (tree && m_compact)
+		PackCompact();
+	if (tree)
+		tree->Fill();
+	else
+		m_ntuple.Fill();
+}
+
+int DatManager::ZSCellIndex(int cellID)
+{
+	int layer = cellID / 100000;
+	int chip = cellID / 10000 % 10;
+	int memo = cellID / 100 % 100;
+	int channel = cellID % 100;
+	if (cellID < 0 || layer >= Layer_No || chip >= chip_No || memo >= cell_SP || channel >= channel_No)
+		return -1;
+	return ((layer * chip_No + chip) * cell_SP + memo) * channel_No + channel;
+}
+
+void DatManager::SuppressChannels()
+{
+	size_t n = _cellID.size();
+	size_t kept = 0;
+	for (size_t i = 0; i < n; ++i)
 	{
-		// cout<<dec<<i<<" "<<buffer_v.size()<<" "<<hex<<buffer_v[i]<<endl;
-		if (buffer_v[i] < 1 || buffer_v[i] > 9)
+		double threshold = m_zs_threshold;
+		if (!m_zs_cell_threshold.empty())
+		{
+			int index = ZSCellIndex(_cellID[i]);
+			if (index >= 0 && !isnan(m_zs_cell_threshold[index]))
+				threshold = m_zs_cell_threshold[index];
+		}
+		// In auto gain mode only one of HG_Charge and LG_Charge is valid, the other one is -1
+		double charge = _HG_Charge[i] >= 0 ? _HG_Charge[i] : _LG_Charge[i];
+		if (_hitTag[i] != 1 && !(threshold >= 0 && charge > threshold))
 			continue;
-		int chip = buffer_v[i] - 1;
-		_chip_v[layer_id][chip].assign(buffer_v.begin(), buffer_v.begin() + i + 1);
-		buffer_v.erase(buffer_v.begin(), buffer_v.begin() + i + 1);
-		// cout<<endl<<dec<<_chip_v[layer_id][chip].back()<<" FillChipBuffer "<<" "<<buffer_v.size()<<endl;
-		i = 0;
+		if (kept != i)
+		{
+			_cellID[kept] = _cellID[i];
+			_bcid[kept] = _bcid[i];
+			_hitTag[kept] = _hitTag[i];
+			_gainTag_tdc[kept] = _gainTag_tdc[i];
+			_gainTag[kept] = _gainTag[i];
+			_HG_Charge[kept] = _HG_Charge[i];
+			_LG_Charge[kept] = _LG_Charge[i];
+			_Hit_Time[kept] = _Hit_Time[i];
+		}
+		kept++;
+	}
+	ResizeColumns(kept);
+	m_suppressed_No = n - kept;
+	m_stats.kept_channels += kept;
+	m_stats.suppressed_channels += m_suppressed_No;
+}
+
+int DatManager::SetZSThresholdFile(const string &file_name)
+{
+	m_zs_cell_threshold.clear();
+	if (file_name == "")
+		return 1;
+	ifstream f_in(file_name);
+	if (!f_in)
+	{
+		LogLine(kError) << "cant open " << file_name;
+		return 0;
 	}
-	if (buffer_v.size())
+	vector<float> cell_threshold(Layer_No * chip_No * cell_SP * channel_No, numeric_limits<float>::quiet_NaN());
+	int cellID;
+	double threshold;
+	while (f_in >> cellID >> threshold)
 	{
-		count_chipbuffer++;
-		cout << hex << cycleID << " " << buffer_v.back() << " FillChipBuffer:abnormal chip buffer " << dec << " " << layer_id << " " << buffer_v.size() << " " << count_chipbuffer << endl;
-		for (int i_chip = 0; i_chip < chip_No; ++i_chip)
+		int index = ZSCellIndex(cellID);
+		if (index < 0)
 		{
-			//_chip_v[layer_id][i_chip].clear();
+			LogLine(kWarning, "abnormal CellID") << "abnormal CellID " << cellID << " in " << file_name;
+			continue;
 		}
-		buffer_v.clear();
+		cell_threshold[index] = threshold;
+	}
+	if (!f_in.eof())
+	{
+		LogLine(kError) << "cant read " << file_name;
 		return 0;
 	}
+	m_zs_cell_threshold.swap(cell_threshold);
 	return 1;
 }
 
+void DatManager::SwapEvent(EventRecord &rec)
+{
+	swap(_cycleID, rec.cycleID);
+	swap(m_status.pre_trigID, rec.triggerID);
+	swap(_Event_Time, rec.Event_Time);
+	_cellID.swap(rec.cellID);
+	_bcid.swap(rec.bcid);
+	_hitTag.swap(rec.hitTag);
+	_gainTag_tdc.swap(rec.gainTag_tdc);
+	_gainTag.swap(rec.gainTag);
+	_cherenkov.swap(rec.cherenkov);
+	_HG_Charge.swap(rec.HG_Charge);
+	_LG_Charge.swap(rec.LG_Charge);
+	_Hit_Time.swap(rec.Hit_Time);
+}
+
+DatManager::DecodeModes DatManager::SelectModes(InputKind input) const
+{
+	DecodeModes modes;
+	// A selection decodes on one thread, skipped bags are only framed; the event builder needs all bags in file order
+	modes.select = Selecting();
+	modes.build = m_builder_window > 0;
+	// Mapping, the index and the chunks need the whole uncompressed file, the pipeline an input that is read once from the start
+	bool b_file = input == InputKind::kFile;
+	bool b_one_pass = b_file || input == InputKind::kCompressed;
+	modes.follow = m_follow && b_file;
+	modes.map = (m_use_mmap || m_chunks > 1 || m_use_index) && b_file && !modes.follow;
+	modes.index = m_use_index && modes.map;
+	modes.chunks = m_chunks > 1 && modes.map && !modes.select && !modes.build && !m_event_sink;
+	modes.pipeline = m_unpackers > 0 && b_one_pass && !modes.follow && !modes.select && !modes.build;
+	// Checkpoints are taken between the event bags of the serial decode of a file into a TTree, without open events
+	modes.checkpoint = m_checkpoint_interval > 0 && b_one_pass && !modes.follow && !modes.chunks && !modes.pipeline && !modes.build && !m_event_sink && !m_rntuple;
+
+	vector<string> unavailable;
+	if (m_use_mmap && !modes.map)
+		unavailable.push_back("mmap");
+	if (m_chunks > 1 && !modes.map)
+		unavailable.push_back("chunks");
+	if (m_use_index && !modes.map)
+		unavailable.push_back("index");
+	if (m_unpackers > 0 && (!b_one_pass || modes.follow))
+		unavailable.push_back("pipeline");
+	if (m_follow && !modes.follow)
+		unavailable.push_back("follow");
+	if (unavailable.empty())
+		return modes;
+	const char *need = "";
+	switch (input)
+	{
+	case InputKind::kFile:
+		need = "a complete file"; // Only when following it
+		break;
+	case InputKind::kCompressed:
+		need = "an uncompressed file";
+		break;
+	case InputKind::kStream:
+		need = "a regular file";
+		break;
+	case InputKind::kFelix:
+		need = "a .dat file";
+		break;
+	}
+	modes.unavailable = " (";
+	for (size_t i = 0; i < unavailable.size(); ++i)
+		modes.unavailable += (i == 0 ? "" : i + 1 < unavailable.size() ? ", " : " and ") + unavailable[i];
+	modes.unavailable += string(unavailable.size() > 1 ? " need " : " needs ") + need + ")";
+	return modes;
+}
+
 int DatManager::Decode(const string &input_file, const string &output_file, const bool b_auto_gain, const bool b_cherenkov)
 {
-	// 1. Initialize variables
+	// 1. Open input file and reset buffers
+	auto start_time = chrono::steady_clock::now();
+	m_stats = DecodeStats();
+	m_summary.clear(); // Also for a file that fails to open, its caller prints the summary
+
 	ifstream f_in;
-	int layer_id;
-	int cycleID;
-	int triggerID;
-	int BCID[Layer_No][chip_No];
-	int Memo_ID[Layer_No][chip_No];
-	f_in.open(input_file, ios::in);
-	if (!f_in)
+	CompressedInput z_buf;
+	istream z_in(&z_buf);
+	istream *in = &f_in; // Stream input, the plain file or the decompressed data
+	RingInput ring;
+	FelixInput felix;
+	InputKind input = m_felix ? InputKind::kFelix : RingInput::IsStream(input_file) ? InputKind::kStream : InputKind::kFile;
+	// Reading the magic bytes would take them from a pipe, stream sources are never decompressed here
+	CompressedInput::Format format = input == InputKind::kFile ? CompressedInput::Detect(input_file) : CompressedInput::kNone;
+	if (format != CompressedInput::kNone)
+		input = InputKind::kCompressed;
+	DecodeModes modes = SelectModes(input);
+	if (input == InputKind::kFelix)
 	{
-		cout << "cant open " << input_file << endl;
-		return 0;
+		// The input is a list of per-layer FELIX files, one per line
+		vector<string> layer_files;
+		ifstream f_list(input_file);
+		for (string layer_file; f_list >> layer_file;)
+			layer_files.push_back(layer_file);
+		if (layer_files.empty() || !felix.Open(layer_files, m_felix_window))
+		{
+			Summary(" cant open " + input_file, kError);
+			return 0;
+		}
+	}
+	else if (input == InputKind::kStream)
+	{
+		if (!ring.Open(input_file, m_ring_size))
+		{
+			Summary(" cant open " + input_file, kError);
+			return 0;
+		}
+	}
+	else if (input == InputKind::kCompressed)
+	{
+		if (!z_buf.Open(input_file, format, m_decompress_threads))
+		{
+			Summary(" cant open " + input_file, kError);
+			return 0;
+		}
+		in = &z_in;
+	}
+	else if (modes.map)
+	{
+		if (!m_map.Open(input_file))
+		{
+			Summary(" cant open " + input_file, kError);
+			return 0;
+		}
 	}
-	for (int i_layer = 0; i_layer < Layer_No; ++i_layer)
+	else
 	{
-		_buffer_v.clear();
-		for (int i_chip = 0; i_chip < chip_No; ++i_chip)
+		f_in.open(input_file, ios::in);
+		if (!f_in)
 		{
-			BCID[i_layer][i_chip] = -1;
-			Memo_ID[i_layer][i_chip] = 0;
-			_chip_v[i_layer][i_chip].clear();
+			Summary(" cant open " + input_file, kError);
+			return 0;
 		}
 	}
+	m_buffer.clear();
+	m_buffer_start = 0;
+	_chip_arena.Clear();
+	m_open_events.clear();
+	m_open_index.clear();
+	m_closed_keys.clear();
+	m_builder_layers = m_builder_config_layers;
+	m_status = DecodeStatus();
+	count_chipbuffer = 0;
 
 	// 2. Set output file name and create TFile and TTree
-	string tmp_string = input_file;
+	string tmp_string = input_file == "-" ? "stdin" : input_file;
 	tmp_string = tmp_string.substr(tmp_string.find_last_of('/') + 1);
+	if (format != CompressedInput::kNone)
+		tmp_string = tmp_string.substr(0, tmp_string.find_last_of('.')); // .gz, .xz or .zst
 	tmp_string = tmp_string.substr(0, tmp_string.find_last_of('.'));
 	string str_out = output_file + "/" + tmp_string + ".root";
 	tmp_string = str_out.substr(str_out.find("Run") + 3);
 	tmp_string = tmp_string.substr(0, tmp_string.find_first_of("_"));
 	stringstream geek(tmp_string);
 	geek >> _Run_No;
-	TFile *fout;
-	fout = TFile::Open(str_out.c_str(), "RECREATE");
-	if (!fout)
+	TFile *fout = nullptr;
+	TTree *tree = nullptr; // Stays null with RNTuple output or an event sink, events then go to m_ntuple or m_event_sink
+	m_ped_tree = nullptr;
+	m_time_tree = nullptr;
+	m_zs_event_No = 0;
+	if (m_checkpoint_interval > 0 && !modes.checkpoint)
+		LogLine(kWarning) << "checkpoints need the serial decode of a file into a TTree (no stream source, FELIX list, event builder, follow, chunks, pipeline, RNTuple or event sink), decoding without";
+	size_t resume_offset = 0;
+	if (modes.checkpoint)
 	{
-		cout << "cant create " << str_out << endl;
-		return 0;
+		ostringstream settings;
+		settings << input_file.substr(input_file.find_last_of('/') + 1) << " size " << ifstream(input_file, ios::in | ios::ate).tellg()
+				 << " auto_gain " << b_auto_gain << " cherenkov " << b_cherenkov << " compact " << m_compact
+				 << " zero_suppress " << m_zero_suppress << " zs_threshold " << m_zs_threshold << " zs_prescale " << m_zs_prescale
+				 << " select " << m_select_event.min << " " << m_select_event.max << " " << m_select_cycle.min << " " << m_select_cycle.max
+				 << " " << m_select_time.min << " " << m_select_time.max << " " << m_select_byte.min << " " << m_select_byte.max;
+		m_checkpoint_settings = settings.str();
 	}
-	TTree *tree = new TTree("Raw_Hit", "data from binary file");
-	SetTreeBranch(tree);
-
+	if (m_event_sink)
+		LogLine(kDebug) << "events go to the event sink, " << str_out << " is not written";
+	else if (m_rntuple)
+	{
+		if (m_zero_suppress)
+			LogLine(kWarning) << "zero suppression needs the TTree output, writing all channels";
+		if (!m_ntuple.Open(str_out, *this, m_compression))
+		{
+			Summary(" cant create " + str_out, kError);
+			m_map.Close();
+			return 0;
+		}
+	}
+	else
+	{
+		if (modes.checkpoint)
+			tree = ResumeCheckpoint(str_out, fout, resume_offset);
+		if (!tree)
+		{
+			fout = TFile::Open(str_out.c_str(), "RECREATE");
+			if (!fout)
+			{
+				Summary(" cant create " + str_out, kError);
+				m_map.Close();
+				return 0;
+			}
+			if (m_compression >= 0)
+				fout->SetCompressionSettings(m_compression);
+			tree = new TTree("Raw_Hit", "data from binary file");
+			SetTreeBranch(tree);
+			if (m_basket_size > 0)
+				tree->SetBasketSize("*", m_basket_size);
+			if (m_autoflush != 0)
+				tree->SetAutoFlush(m_autoflush);
+			if (m_autosave != 0)
+				tree->SetAutoSave(m_autosave);
+			if (m_zero_suppress && m_zs_prescale > 0)
+			{
+				// Every m_zs_prescale-th event, the event counts per Event_Time come from Raw_Hit_Time
+				m_ped_tree = new TTree("Raw_Hit_Ped", "unsuppressed events for the pedestal analysis");
+				SetTreeBranch(m_ped_tree);
+				m_time_tree = new TTree("Raw_Hit_Time", "Event_Time of all events");
+				m_time_tree->Branch("Event_Time", &_Event_Time);
+				for (TTree *t : {m_ped_tree, m_time_tree})
+				{
+					if (m_basket_size > 0)
+						t->SetBasketSize("*", m_basket_size);
+					if (m_autoflush != 0)
+						t->SetAutoFlush(m_autoflush);
+					if (m_autosave != 0)
+						t->SetAutoSave(m_autosave);
+				}
+			}
+		}
+		if (modes.checkpoint)
+		{
+			m_checkpoint_file = fout;
+			m_next_checkpoint = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(m_checkpoint_interval));
+		}
+	}
+
 	// 3. Initialize variables for event processing
-	int Bag_No = 0;
-	int Event_No = 0;
-	int Cherenkov_signal = 0;
-	int Cherenkov_Event_No1 = 0;
-	int Cherenkov_Event_No2 = 0;
-	int Cherenkov_Event_No = 0;
-	int Abnormal_Event_No = 0;
-	int coincidence_No = 0;
-	int Loop_No = 0;
-	unsigned int last_Event_Time = 0;
 	long cherenkov_counter = 0;
-	long pre_trigID = 0;
-	long pre_cycleID = 0;
-	long last_trigID = -1;
-	long last_cycleID = -1;
-	long tmp_ID = 0;
-	bool b_ReadOver = 1;
-	bool b_chipbuffer = 0;
-	bool b_Event = 0;
-	cout << " Start Read File: " << str_out << " auto gain: " << b_auto_gain << " cherenkov: " << b_cherenkov << " Run:" << _Run_No << endl;
-
-	// 4. Read event data
-	while (!(f_in.eof()) || b_chipbuffer)
-	{
-		// while((!(f_in.eof()) || b_chipbuffer) && Event_No<=1E4){
-		// if (Event_No % 1000 == 0)
-		// 	cout << "Event_No: " << Event_No << " Bag_No " << Bag_No << endl;
-		_buffer_v.clear();
-		m_event_v.clear();
-		CatchEventBag(f_in, m_event_v, cherenkov_counter);
-		Bag_No++;
-		b_Event = 0;
-		b_chipbuffer = Chipbuffer_empty(); // just in case
-		// cout << dec << Bag_No << " CatchEventBag size " << m_event_v.size() << " cherenkov_counter " << cherenkov_counter << endl;
-		while (m_event_v.size() > 74) // 74 is the minimum size for a valid SPIROC bag
-		{
-			CatchSPIROCBag(m_event_v, _buffer_v, layer_id, cycleID, triggerID);
-			// if(triggerID==last_trigID){
-			// 	m_event_v.clear();
-			// 	_buffer_v.clear();
-			// 	continue;
-			// }
-			if (b_chipbuffer == 0)
+	EventBagView bag;
+	ostringstream summary;
+	summary << " Start Read File: " << str_out << " auto gain: " << b_auto_gain << " cherenkov: " << b_cherenkov << " Run:" << _Run_No;
+	Summary(summary.str());
+	summary.str("");
+	switch (input)
+	{
+	case InputKind::kFile:
+		if (modes.follow)
+			summary << " Input: followed while it is written";
+		break;
+	case InputKind::kCompressed:
+		summary << " Input: " << CompressedInput::Name(format) << " compressed, read as a stream";
+		break;
+	case InputKind::kStream:
+		summary << " Input: stream source, read through a " << (ring.Capacity() >> 20) << " MB ring buffer";
+		break;
+	case InputKind::kFelix:
+		summary << " Input: FELIX, " << felix.Streams() << " layer files merged by (cycleID, triggerID), " << m_felix_window << " event bags read ahead per layer";
+		break;
+	}
+	if (summary.tellp() > 0)
+		Summary(summary.str() + modes.unavailable);
+	if (resume_offset > 0)
+	{
+		summary.str("");
+		summary << " Resumed from the checkpoint at byte " << resume_offset << ", Event No " << m_status.Event_No << " Bag No " << m_status.Bag_No;
+		Summary(summary.str());
+	}
+
+	// 4. Read event data, from the index when there is one
+	const DatIndex *index = nullptr;
+	if (modes.index)
+	{
+		LoadIndex(input_file);
+		index = &m_index;
+	}
+	// A selection starts at its first event bag when the index or the byte range tells where that is
+	size_t begin = resume_offset;
+	if (modes.select && resume_offset == 0)
+	{
+		if (index)
+			begin = SelectStart(*index);
+		else if (m_select_byte.min > 0)
+			begin = m_select_byte.min;
+		if (begin > 0)
+		{
+			summary.str("");
+			summary << " Selection: start at byte " << begin << (index ? ", event bag " + to_string(m_status.select_bag_No) + " of the index" : "");
+			Summary(summary.str());
+		}
+		if (begin > 0 && !modes.map && input != InputKind::kStream && input != InputKind::kFelix)
+		{
+			if (in == &f_in)
+				f_in.seekg(begin);
+			else
+				in->ignore(begin);
+			m_stats.bytes = begin;
+		}
+	}
+	if (resume_offset > 0 && m_map.IsOpen())
+		m_stats.bytes = resume_offset; // DecodeRange adds the rest of the file
+	else if (resume_offset > 0)
+	{
+		// The stream is read in whole s_read_size blocks from the start of the file, keep that alignment so
+		// that the bags and the dropped tail of the file are the same as in one pass
+		size_t aligned = resume_offset / s_read_size * s_read_size;
+		if (in == &f_in)
+			f_in.seekg(aligned);
+		else
+			in->ignore(aligned);
+		m_buffer.resize(s_read_size);
+		if (in->read(reinterpret_cast<char *>(m_buffer.data()), s_read_size))
+		{
+			m_buffer_start = resume_offset - aligned;
+			m_stats.bytes = aligned + s_read_size;
+		}
+		else
+		{
+			m_buffer.clear();
+			m_stats.bytes = aligned;
+		}
+	}
+	// A corrupt or truncated compressed input ends the stream early, the events before it are kept but the file failed
+	bool b_input_failed = false;
+	int incomplete_chunks = 0; // Chunks only partly appended to the output
+	if (input == InputKind::kFelix)
+		DecodeFelix(felix, tree, b_auto_gain, b_cherenkov);
+	else if (input == InputKind::kStream)
+	{
+		DecodeRing(ring, begin, tree, b_auto_gain, b_cherenkov);
+		ring.Close();
+	}
+	else if (modes.follow)
+	{
+		DecodeFollow(f_in, tree, b_auto_gain, b_cherenkov);
+		f_in.close();
+	}
+	else if (modes.chunks)
+	{
+		incomplete_chunks = DecodeChunks(tree, str_out, b_auto_gain, b_cherenkov, index);
+		m_map.Close();
+	}
+	else if (modes.pipeline)
+	{
+		DecodePipeline(*in, tree, b_auto_gain, b_cherenkov, index);
+		m_map.Close();
+		f_in.close();
+		b_input_failed = z_buf.Failed();
+		z_buf.Close();
+	}
+	else if (modes.map)
+	{
+		size_t end = m_select_byte.max >= 0 ? min<size_t>(m_map.Size(), m_select_byte.max + 1) : m_map.Size();
+		DecodeRange(m_map, min(begin, end), end, tree, b_auto_gain, b_cherenkov, index);
+		m_map.Close();
+	}
+	else
+	{
+		while (!(in->eof()))
+		{
+			// if (m_status.Event_No % 1000 == 0)
+			// 	cout << "Event_No: " << m_status.Event_No << " Bag_No " << m_status.Bag_No << endl;
 			{
-				pre_trigID = triggerID;
-				pre_cycleID = cycleID;
+				StageClock clock(m_stats.t_frame);
+				CatchEventBag(*in, bag, cherenkov_counter);
 			}
-			if (_buffer_v.size() < 74)
+			m_status.Bag_No++;
+			int selected = modes.select ? SelectBag(m_buffer.data() + bag.offset, bag.length, cherenkov_counter, m_stats.bytes - m_buffer.size() + bag.offset) : 1;
+			if (selected < 0)
+				break;
+			if (selected)
+				DecodeEventBag(m_buffer.data() + bag.offset, bag.length, cherenkov_counter, tree, b_auto_gain, b_cherenkov);
+			if (m_checkpoint_file)
+				Checkpoint(tree, m_stats.bytes - (m_buffer.size() - m_buffer_start));
+		}
+		f_in.close();
+		b_input_failed = z_buf.Failed();
+		z_buf.Close();
+	}
+	// Events still open at the end of the file are emitted as they are
+	while (!m_open_events.empty())
+		EmitOpenEvent(tree, b_auto_gain, b_cherenkov);
+	summary.str("");
+	summary << m_status.Abnormal_Event_No << " cherenkov1 " << m_status.Cherenkov_Event_No1 << " cherenkov2 " << m_status.Cherenkov_Event_No2 << " cherenkov coincidence " << m_status.Cherenkov_Event_No << " Event No " << m_status.Event_No << " Bag No  " << m_status.Bag_No;
+	Summary(summary.str());
+	if (modes.select)
+	{
+		summary.str("");
+		summary << " Selection: " << m_stats.skipped_bags << " event bags skipped";
+		Summary(summary.str());
+	}
+	if (modes.build)
+	{
+		summary.str("");
+		summary << " Event builder: " << m_stats.recovered_bags << " SPIROC bags merged into the event of their triggerID, "
+				<< m_stats.timed_out_events << " events emitted before all " << __builtin_popcountll(m_builder_layers) << " layers arrived, "
+				<< m_stats.late_bags << " late SPIROC bags dropped";
+		Summary(summary.str());
+	}
+	if (input == InputKind::kFelix)
+	{
+		const FelixInput::Counters &c = felix.GetCounters();
+		summary.str("");
+		summary << " FELIX: " << c.events << " events merged, " << c.partial_events << " from fewer layers, dropped " << c.late_bags << " late, "
+				<< c.broken_bags << " broken and " << c.no_id_bags << " event bags without IDs";
+		Summary(summary.str());
+		felix.Close();
+	}
+	if (b_input_failed)
+	{
+		m_stats.corrupt_input++;
+		Summary(" " + input_file + ": the " + CompressedInput::Name(format) + " data is corrupt or truncated, only the events before it are written", kError);
+	}
+	if (incomplete_chunks > 0)
+		Summary(" " + to_string(incomplete_chunks) + " chunks of " + input_file + " are only partly in " + str_out, kError);
+	if (tree && m_zero_suppress)
+	{
+		summary.str("");
+		summary << " Zero suppression: kept " << m_stats.kept_channels << " suppressed " << m_stats.suppressed_channels << " channels, "
+				<< m_stats.ped_events << " events in Raw_Hit_Ped";
+		Summary(summary.str());
+	}
+	if (tree)
+	{
+		if (m_checkpoint_file && !b_input_failed)
+			fout->Delete("Decode_Checkpoint;*"); // Complete, a rerun decodes from the start
+		m_checkpoint_file = nullptr;
+		tree->Write();
+		if (m_ped_tree)
+			m_ped_tree->Write();
+		if (m_time_tree)
+			m_time_tree->Write();
+		summary.str("");
+		summary << " Output: compression " << fout->GetCompressionSettings() << " basket size " << (m_basket_size > 0 ? m_basket_size : 32000)
+				<< " AutoFlush " << tree->GetAutoFlush() << " AutoSave " << tree->GetAutoSave()
+				<< " implicit MT " << (ROOT::IsImplicitMTEnabled() ? ROOT::GetThreadPoolSize() : 0)
+				<< " bytes " << tree->GetTotBytes() << " zipped " << tree->GetZipBytes();
+		Summary(summary.str());
+		fout->Write();
+		fout->Close();
+		m_ped_tree = nullptr;
+		m_time_tree = nullptr;
+	}
+	else if (m_rntuple && !m_event_sink)
+		m_ntuple.Close();
+
+	// 5. Statistics
+	m_stats.event_bags = m_status.Bag_No;
+	m_stats.events = m_status.Event_No;
+	m_stats.cherenkov1 = m_status.Cherenkov_Event_No1;
+	m_stats.cherenkov2 = m_status.Cherenkov_Event_No2;
+	m_stats.cherenkov_coincidence = m_status.Cherenkov_Event_No;
+	m_stats.abnormal_events = m_status.Abnormal_Event_No;
+	m_stats.t_total = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+	if (m_write_stats && !m_event_sink)
+		m_stats.WriteJSON(str_out.substr(0, str_out.size() - 5) + ".stats.json", input_file, str_out);
+	Logger::Instance().Flush();
+	return b_input_failed || incomplete_chunks > 0 ? 0 : 1;
+}
+
+void DatManager::DecodeRange(const MappedFile &f_map, size_t begin, size_t end, TTree *tree, const bool b_auto_gain, const bool b_cherenkov, const DatIndex *index)
+{
+	EventBagView bag;
+	long cherenkov_counter = 0;
+	size_t pos = begin;
+	size_t released = begin;
+	size_t i_record = index ? index->LowerBound(begin) : 0;
+	m_stats.bytes += end - begin;
+	// A bag belongs to the range its header starts in, it may end past the range
+	while (true)
+	{
+		{
+			StageClock clock(m_stats.t_frame);
+			if (!NextEventBag(f_map, index, pos, i_record, bag, cherenkov_counter) || bag.offset >= end)
+				break;
+		}
+		m_status.Bag_No++;
+		int selected = Selecting() ? SelectBag(f_map.Data() + bag.offset, bag.length, cherenkov_counter, bag.offset) : 1;
+		if (selected < 0)
+			break;
+		if (selected)
+			DecodeEventBag(f_map.Data() + bag.offset, bag.length, cherenkov_counter, tree, b_auto_gain, b_cherenkov);
+		if (m_checkpoint_file)
+			Checkpoint(tree, pos);
+		if (pos >= released + s_release_size)
+		{
+			// Only pages of the own range, a neighbouring chunk may still be reading past end
+			f_map.Release(released, min(pos, end));
+			released = pos;
+		}
+	}
+}
+
+void DatManager::DecodeRing(RingInput &ring, size_t begin, TTree *tree, const bool b_auto_gain, const bool b_cherenkov)
+{
+	EventBagView bag;
+	long cherenkov_counter = 0;
+	size_t pos = begin;
+	vector<unsigned char> scratch; // Event bags split by the wrap point of the ring
+	// Bytes before begin are read and dropped
+	for (uint64_t written = 0; written < begin && !ring.Finished();)
+	{
+		ring.Release(begin);
+		written = ring.Wait(begin);
+	}
+	while (true)
+	{
+		{
+			StageClock clock(m_stats.t_frame);
+			if (!CatchEventBag(ring, pos, bag, cherenkov_counter))
+				break;
+		}
+		m_status.Bag_No++;
+		const unsigned char *event = ring.Data(bag.offset, bag.length, scratch);
+		int selected = Selecting() ? SelectBag(event, bag.length, cherenkov_counter, bag.offset) : 1;
+		if (selected < 0)
+			break;
+		if (selected)
+			DecodeEventBag(event, bag.length, cherenkov_counter, tree, b_auto_gain, b_cherenkov);
+	}
+	m_stats.bytes += ring.Written();
+}
+
+void DatManager::DecodeFelix(FelixInput &felix, TTree *tree, const bool b_auto_gain, const bool b_cherenkov)
+{
+	vector<unsigned char> event;
+	long cherenkov_counter = 0;
+	size_t offset = 0; // Position in the merged data, as if it was written to a .dat file
+	while (true)
+	{
+		{
+			StageClock clock(m_stats.t_frame);
+			if (!felix.Next(event, cherenkov_counter))
+				break;
+		}
+		m_status.Bag_No++;
+		int selected = Selecting() ? SelectBag(event.data(), event.size(), cherenkov_counter, offset) : 1;
+		if (selected < 0)
+			break;
+		if (selected)
+			DecodeEventBag(event.data(), event.size(), cherenkov_counter, tree, b_auto_gain, b_cherenkov);
+		offset += event.size();
+	}
+	m_stats.bytes += felix.RawBytes();
+}
+
+int DatManager::DecodeChunks(TTree *tree, const string &str_out, const bool b_auto_gain, const bool b_cherenkov, const DatIndex *index)
+{
+	ROOT::EnableThreadSafety();
+	// 1. Split the file at event bag headers, so every bag is decoded by exactly one chunk
+	const unsigned char *data = m_map.Data();
+	size_t size = m_map.Size();
+	vector<size_t> bound(1, 0);
+	for (int i = 1; i < m_chunks; ++i)
+	{
+		size_t from = max(bound.back(), size / m_chunks * i);
+		if (index)
+		{
+			size_t i_record = index->LowerBound(from);
+			bound.push_back(i_record < index->Size() ? (*index)[i_record].offset : size);
+		}
+		else
+			bound.push_back(from + MarkerScanner::Find(data + from, size - from, MarkerScanner::Bit(kEventHead)));
+	}
+	bound.push_back(size);
+	auto run_chunks = [&](const function<void(int)> &job)
+	{
+		vector<thread> threads;
+		for (int i = 0; i < m_chunks; ++i)
+			threads.emplace_back(job, i);
+		for (thread &t : threads)
+			t.join();
+	};
+
+	// 2. Loop_No and the last raw triggerID before every chunk, from the triggerIDs of the event bags
+	//    (the index records or a framing scan), so that the chunks are written with their final TriggerIDs
+	vector<TriggerSpan> spans(m_chunks);
+	run_chunks([&](int i)
+			   { spans[i] = ScanTriggers(m_map, bound[i], bound[i + 1], index); });
+	vector<int> start_loop(m_chunks, 0);
+	vector<long> start_trigID(m_chunks, -1);
+	for (int i = 1; i < m_chunks; ++i)
+	{
+		const TriggerSpan &prev = spans[i - 1];
+		start_loop[i] = start_loop[i - 1];
+		start_trigID[i] = start_trigID[i - 1];
+		if (prev.first < 0)
+			continue;
+		if (start_trigID[i] - prev.first > 40000)
+			start_loop[i]++;
+		start_loop[i] += prev.loops;
+		start_trigID[i] = prev.last;
+	}
+
+	// 3. Decode every chunk into its own temporary file with the settings of the output. Zero suppression (its
+	//    prescale counts the events of the whole file) and RNTuple output are applied when the chunks are replayed
+	bool b_replay = !tree || m_zero_suppress;
+	vector<unique_ptr<DatManager>> workers(m_chunks);
+	vector<string> chunk_name;
+	for (int i = 0; i < m_chunks; ++i)
+		chunk_name.push_back(str_out + ".chunk" + to_string(i));
+	auto decode_chunk = [&](int i, int Loop_No, long last_trigID) -> int
+	{
+		workers[i].reset(new DatManager());
+		DatManager &dm = *workers[i];
+		dm._Run_No = _Run_No;
+		dm.m_compact = m_compact && !b_replay;
+		dm.m_status.Loop_No = Loop_No;
+		dm.m_status.last_trigID = last_trigID;
+		TFile *f_chunk = TFile::Open(chunk_name[i].c_str(), "RECREATE");
+		if (!f_chunk || f_chunk->IsZombie())
+		{
+			LogLine(kError) << "cant create " << chunk_name[i];
+			delete f_chunk;
+			return 0;
+		}
+		if (m_compression >= 0)
+			f_chunk->SetCompressionSettings(m_compression);
+		TTree *t_chunk = new TTree("Raw_Hit", "data from binary file");
+		dm.SetTreeBranch(t_chunk);
+		if (m_basket_size > 0)
+			t_chunk->SetBasketSize("*", m_basket_size);
+		if (m_autoflush != 0)
+			t_chunk->SetAutoFlush(m_autoflush);
+		dm.DecodeRange(m_map, bound[i], bound[i + 1], t_chunk, b_auto_gain, b_cherenkov, index);
+		int ok = t_chunk->Write() > 0;
+		f_chunk->Close();
+		delete f_chunk;
+		if (!ok)
+			LogLine(kError) << "cant write " << chunk_name[i];
+		return ok;
+	};
+	vector<int> written(m_chunks, 0);
+	run_chunks([&](int i)
+			   { written[i] = decode_chunk(i, start_loop[i], start_trigID[i]); });
+
+	// 4. Append the chunks in file order. The scan compared the triggerIDs of all event bags, the decode only those of
+	//    events: when a bag without event before a chunk changes the loop of its first event, the chunk is decoded again
+	DecodeStatus &st = m_status;
+	int incomplete = 0;
+	for (int i = 0; i < m_chunks; ++i)
+	{
+		const DecodeStatus *cs = &workers[i]->m_status;
+		if (written[i] && cs->Event_No > 0)
+		{
+			bool loop = st.last_trigID - cs->first_trigID > 40000;
+			bool assumed_loop = start_trigID[i] - cs->first_trigID > 40000;
+			if (st.Loop_No + loop != start_loop[i] + assumed_loop)
 			{
-				if (_buffer_v.size() != 4)
-					cout << "abnormal SPIROC bag size " << _buffer_v.size() << endl;
-				_buffer_v.clear();
-				if (!b_chipbuffer)
-					continue;
+				LogLine(kWarning) << "chunk " << i << " starts in trigger loop " << st.Loop_No + loop << " instead of " << start_loop[i] + assumed_loop << ", decoding it again";
+				written[i] = decode_chunk(i, st.Loop_No, st.last_trigID);
+				cs = &workers[i]->m_status;
 			}
-			if (triggerID != pre_trigID)
+			else
 			{
-				b_Event = 1;
-				cout << pre_cycleID << " " << pre_trigID << " abnormal ID " << cycleID << " " << triggerID << endl;
-				_buffer_v.clear();
-				continue;
+				// The chunk counted the loop and trigger jump of its first event against the bag before it
+				bool jump = cs->first_trigID - st.last_trigID > 10 && st.last_trigID >= 0;
+				bool assumed_jump = cs->first_trigID - start_trigID[i] > 10 && start_trigID[i] >= 0;
+				m_stats.trigger_loops += loop - assumed_loop;
+				m_stats.trigger_jump += jump - assumed_jump;
 			}
-			else
+		}
+		int appended = written[i] ? AppendChunk(chunk_name[i], tree, !b_replay) : 0;
+		remove(chunk_name[i].c_str());
+		if (appended == 0)
+		{
+			// Nothing of the chunk is in the output yet, its byte range is decoded here as in the serial decode
+			LogLine(kWarning) << "chunk " << i << " could not be written or read back, decoding it on the main thread";
+			DecodeRange(m_map, bound[i], bound[i + 1], tree, b_auto_gain, b_cherenkov, index);
+			continue;
+		}
+		incomplete += appended < 0;
+		st.Bag_No += cs->Bag_No;
+		st.Event_No += cs->Event_No;
+		st.Cherenkov_Event_No1 += cs->Cherenkov_Event_No1;
+		st.Cherenkov_Event_No2 += cs->Cherenkov_Event_No2;
+		st.Cherenkov_Event_No += cs->Cherenkov_Event_No;
+		st.Abnormal_Event_No += cs->Abnormal_Event_No;
+		count_chipbuffer += workers[i]->count_chipbuffer;
+		m_stats.Merge(workers[i]->m_stats);
+		if (cs->Event_No > 0)
+		{
+			if (st.first_trigID < 0)
+				st.first_trigID = cs->first_trigID;
+			st.Loop_No = cs->Loop_No;
+			st.last_trigID = cs->last_trigID;
+			st.last_cycleID = cs->last_cycleID;
+			st.last_Event_Time = cs->last_Event_Time;
+		}
+	}
+	return incomplete;
+}
+
+DatManager::TriggerSpan DatManager::ScanTriggers(const MappedFile &f_map, size_t begin, size_t end, const DatIndex *index) const
+{
+	TriggerSpan span;
+	auto add = [&span](long triggerID)
+	{
+		if (triggerID < 0)
+			return;
+		if (span.first < 0)
+			span.first = triggerID;
+		else if (span.last - triggerID > 40000)
+			span.loops++;
+		span.last = triggerID;
+	};
+	if (index)
+	{
+		for (size_t i = index->LowerBound(begin); i < index->Size() && (*index)[i].offset < end; ++i)
+			add((*index)[i].triggerID);
+		return span;
+	}
+	// IDs of the first SPIROC bag after every event bag header, like PeekIDs, without framing the bags
+	const unsigned char *data = f_map.Data();
+	size_t size = f_map.Size();
+	size_t pos = begin;
+	while (pos < end)
+	{
+		pos += MarkerScanner::Find(data + pos, end - pos, MarkerScanner::Bit(kEventHead));
+		if (pos >= end)
+			break;
+		pos += s_event_head_size;
+		MarkerType type = kEventHead;
+		pos += MarkerScanner::Find(data + pos, size - pos, MarkerScanner::Bit(kEventHead) | MarkerScanner::Bit(kSpirocHead), &type);
+		if (pos >= size || type != kSpirocHead)
+			continue;
+		const unsigned char *id = data + pos + s_spiroc_head.size();
+		if (pos + s_spiroc_head.size() + s_spiroc_id_size <= size)
+			add(id[4] * 0x100 + id[5]);
+		pos += s_spiroc_head.size();
+	}
+	return span;
+}
+
+void DatManager::DecodePipeline(istream &f_in, TTree *tree, const bool b_auto_gain, const bool b_cherenkov, const DatIndex *index)
+{
+	const size_t queue_size = 2 * m_unpackers + 2; // Batches waiting between two stages
+	BoundedQueue<BagBatch> bag_queue(queue_size);
+	BoundedQueue<BagBatch> event_queue(queue_size);
+	int Bag_No = 0;
+
+	// 1. Reader: collect event bags into batches, copied out of m_buffer in stream mode
+	auto reader = [&]()
+	{
+		long cherenkov_counter = 0;
+		size_t pos = 0;
+		size_t i_record = 0;
+		EventBagView bag;
+		BagBatch batch;
+		for (size_t seq = 0;; ++seq)
+		{
+			batch = BagBatch();
+			batch.seq = seq;
+			batch.mapped = m_map.IsOpen();
+			bool more = true;
+			while (batch.bags.size() < s_batch_bags)
 			{
-				FillChipBuffer(_buffer_v, cycleID, triggerID, layer_id);
+				StageClock clock(m_stats.t_frame);
+				if (batch.mapped)
+				{
+					if (!(more = NextEventBag(m_map, index, pos, i_record, bag, cherenkov_counter)))
+						break;
+					batch.end = pos;
+				}
+				else
+				{
+					if (!(more = !f_in.eof()))
+						break;
+					CatchEventBag(f_in, bag, cherenkov_counter);
+					batch.data.insert(batch.data.end(), m_buffer.begin() + bag.offset, m_buffer.begin() + bag.offset + bag.length);
+					bag.offset = batch.data.size() - bag.length;
+				}
+				batch.bags.push_back(bag);
+				batch.cherenkov_counter.push_back(cherenkov_counter);
+				Bag_No++;
 			}
-			FillChipBuffer(_buffer_v, cycleID, triggerID, layer_id);
-			b_chipbuffer = Chipbuffer_empty();
+			if (!batch.bags.empty())
+				bag_queue.Push(std::move(batch));
+			if (!more)
+				break;
 		}
-		if (b_Event)
-			Abnormal_Event_No++;
-		while (b_chipbuffer != 0)
+		bag_queue.Close();
+	};
+
+	// 2. Unpackers: one DatManager each, events leave as EventRecords with the raw triggerID
+	vector<unique_ptr<DatManager>> workers;
+	for (int i = 0; i < m_unpackers; ++i)
+	{
+		workers.emplace_back(new DatManager());
+	}
+	atomic<int> running(m_unpackers);
+	auto unpacker = [&](DatManager &dm)
+	{
+		BagBatch batch;
+		while (bag_queue.Pop(batch))
 		{
-			if ((pre_trigID - last_trigID) > 10 && last_trigID != 0)
+			const unsigned char *base = batch.mapped ? m_map.Data() : batch.data.data();
+			for (size_t i = 0; i < batch.bags.size(); ++i)
 			{
-				cout << hex << pre_cycleID << " Abnormal triggerID " << pre_trigID << " " << last_trigID << endl;
+				StageClock clock(dm.m_stats.t_unpack);
+				if (!dm.UnpackEventBag(base + batch.bags[i].offset, batch.bags[i].length, batch.cherenkov_counter[i], b_auto_gain, b_cherenkov))
+					continue;
+				batch.events.emplace_back();
+				dm.SwapEvent(batch.events.back());
 			}
-			if (last_trigID - pre_trigID > 40000)
+			batch.data = vector<unsigned char>();
+			event_queue.Push(std::move(batch));
+		}
+		if (--running == 0)
+			event_queue.Close();
+	};
+
+	vector<thread> threads;
+	threads.emplace_back(reader);
+	for (int i = 0; i < m_unpackers; ++i)
+		threads.emplace_back(unpacker, ref(*workers[i]));
+
+	// 3. Writer: restore the file order, then loop tracking and Fill as in the serial decode
+	map<size_t, BagBatch> pending;
+	size_t next_seq = 0;
+	size_t released = 0;
+	BagBatch batch;
+	while (event_queue.Pop(batch))
+	{
+		size_t seq = batch.seq;
+		pending.emplace(seq, std::move(batch));
+		for (auto it = pending.find(next_seq); it != pending.end(); it = pending.find(++next_seq))
+		{
+			for (EventRecord &rec : it->second.events)
 			{
-				cout << "Loop " << pre_trigID << " " << last_trigID << endl;
-				Loop_No++;
+				StageClock clock(m_stats.t_write);
+				SwapEvent(rec);
+				m_status.pre_cycleID = _cycleID;
+				FillEvent(tree);
 			}
-			BranchClear();
-			for (int i_layer = 0; i_layer < Layer_No; ++i_layer)
+			if (it->second.mapped && it->second.end >= released + s_release_size)
 			{
-				for (int i_chip = 0; i_chip < chip_No; ++i_chip)
-				{
-					int size = _chip_v[i_layer][i_chip].size();
-					if (size == 0)
-						continue;
-					_cycleID = pre_cycleID;
-					_triggerID = pre_trigID + Loop_No * pow(2, 16);
-					Memo_ID[i_layer][i_chip] = int(size / 73);
-					DecodeAEvent(_chip_v[i_layer][i_chip], i_layer, Memo_ID[i_layer][i_chip] - 1, b_auto_gain);
-					if (Memo_ID[i_layer][i_chip] != 1)
-					{
-						_chip_v[i_layer][i_chip].clear();
-						cout << "abnormal Memo_ID " << Memo_ID[i_layer][i_chip] << endl;
-					}
-				}
+				m_map.Release(released, it->second.end);
+				released = it->second.end;
 			}
-			_Event_Time = (cherenkov_counter & 0x3fffffff);
-			// if(_Event_Time==last_Event_Time)cout<<"abnormal Event Time "<<_Event_Time<<" "<<last_Event_Time<<" "<<hex<<pre_trigID<<" "<<last_trigID<<endl;
-			if (b_cherenkov)
+			pending.erase(it);
+		}
+	}
+	for (thread &t : threads)
+		t.join();
+
+	m_status.Bag_No += Bag_No;
+	if (m_map.IsOpen())
+		m_stats.bytes += m_map.Size();
+	for (auto &dm : workers)
+	{
+		m_status.Abnormal_Event_No += dm->m_status.Abnormal_Event_No;
+		count_chipbuffer += dm->count_chipbuffer;
+		m_stats.Merge(dm->m_stats);
+	}
+}
+
+void DatManager::DecodeFollow(ifstream &f_in, TTree *tree, const bool b_auto_gain, const bool b_cherenkov)
+{
+	EventBagView bag;
+	long cherenkov_counter = 0;
+	auto last_data = chrono::steady_clock::now();
+	auto last_save = last_data;
+	while (true)
+	{
+		size_t bytes_read = ReadAvailable(f_in);
+		while (true)
+		{
 			{
-				_cherenkov.push_back((cherenkov_counter & 0x80000000) / 0x80000000);
-				_cherenkov.push_back((cherenkov_counter & 0x40000000) / 0x40000000);
+				StageClock clock(m_stats.t_frame);
+				if (!CatchBufferedBag(bag, cherenkov_counter))
+					break;
 			}
-			else
+			m_status.Bag_No++;
+			int selected = Selecting() ? SelectBag(m_buffer.data() + bag.offset, bag.length, cherenkov_counter, m_stats.bytes - m_buffer.size() + bag.offset) : 1;
+			if (selected < 0)
+				return; // Nothing the DAQ writes from now on is selected
+			if (selected)
+				DecodeEventBag(m_buffer.data() + bag.offset, bag.length, cherenkov_counter, tree, b_auto_gain, b_cherenkov);
+		}
+		auto now = chrono::steady_clock::now();
+		if (now - last_save >= chrono::seconds(m_autosave_interval))
+		{
+			if (tree)
 			{
-				_cherenkov.push_back(-1);
-				_cherenkov.push_back(-1);
+				tree->AutoSave("SaveSelf");
+				if (m_ped_tree)
+					m_ped_tree->AutoSave("SaveSelf");
+				if (m_time_tree)
+					m_time_tree->AutoSave("SaveSelf");
 			}
-			if (_cherenkov[0] > 0)
-				Cherenkov_Event_No1++;
-			if (_cherenkov[1] > 0)
-				Cherenkov_Event_No2++;
-			if (_cherenkov[0] * _cherenkov[1] > 0)
-				Cherenkov_Event_No++;
-			Event_No++;
-			tree->Fill();
-			BranchClear();
-			b_chipbuffer = Chipbuffer_empty();
-			last_trigID = pre_trigID;
-			last_cycleID = pre_cycleID;
-			last_Event_Time = _Event_Time;
-		}
-	}
-	cout << Abnormal_Event_No << " cherenkov1 " << Cherenkov_Event_No1 << " cherenkov2 " << Cherenkov_Event_No2 << " cherenkov coincidence " << Cherenkov_Event_No << " Event No " << Event_No << " Bag No  " << Bag_No << endl;
-	f_in.close();
-	tree->Write();
-	fout->Write();
-	fout->Close();
+			else
+				m_ntuple.Flush();
+			last_save = now;
+			LogLine(kInfo) << "Follow: Event No " << dec << m_status.Event_No << " Bag No " << m_status.Bag_No;
+		}
+		if (bytes_read > 0)
+			last_data = now;
+		else if (now - last_data >= chrono::seconds(m_follow_timeout))
+			break;
+		else
+			this_thread::sleep_for(chrono::milliseconds(s_follow_poll_ms));
+	}
+	// A bag the DAQ never finished is left out
+	if (MarkerScanner::Find(m_buffer.data() + m_buffer_start, m_buffer.size() - m_buffer_start, MarkerScanner::Bit(kEventHead)) < m_buffer.size() - m_buffer_start)
+	{
+		LogLine(kWarning, "abnormal end") << "CatchEventBag:abnormal end";
+		m_stats.abnormal_end++;
+	}
+}
+
+size_t DatManager::ReadAvailable(ifstream &f_in)
+{
+	std::vector<unsigned char> temp_buffer(s_read_size);
+	size_t total = 0;
+	if (m_buffer.size() > s_buffer_size && m_buffer_start > s_half_buffer_size)
+	{
+		m_buffer.erase(m_buffer.begin(), m_buffer.begin() + m_buffer_start);
+		m_buffer_start = 0;
+	}
+	// Stop at a full buffer, a large existing file is then decoded piece by piece
+	while (m_buffer.size() - m_buffer_start < s_buffer_size)
+	{
+		f_in.read(reinterpret_cast<char *>(temp_buffer.data()), s_read_size);
+		size_t bytes_read = f_in.gcount();
+		m_buffer.insert(m_buffer.end(), temp_buffer.begin(), temp_buffer.begin() + bytes_read);
+		total += bytes_read;
+		m_stats.bytes += bytes_read;
+		if (!f_in)
+		{
+			f_in.clear(); // End of the data written so far, the next read continues from here
+			break;
+		}
+	}
+	return total;
+}
+
+int DatManager::CatchBufferedBag(EventBagView &bag, long &cherenkov_counter)
+{
+	// 1. Find header, garbage before it is dropped
+	MarkerType marker;
+	size_t header_pos = m_buffer_start + MarkerScanner::Find(m_buffer.data() + m_buffer_start, m_buffer.size() - m_buffer_start,
+															 MarkerScanner::Bit(kEventHead));
+	if (header_pos >= m_buffer.size())
+	{
+		// Keep the last bytes, they may be the beginning of a header
+		m_buffer_start = max(m_buffer_start, m_buffer.size() > s_event_head_overlap ? m_buffer.size() - s_event_head_overlap : 0);
+		return 0;
+	}
+	m_buffer_start = header_pos;
+
+	// 2. Find footer or the next header, the bag is complete only when one of them is in the buffer
+	size_t search_start = header_pos + s_event_head_size;
+	size_t pos_marker = search_start + MarkerScanner::Find(m_buffer.data() + search_start, m_buffer.size() - search_start,
+														   MarkerScanner::s_event_markers, &marker);
+	if (pos_marker >= m_buffer.size())
+	{
+		// ReadAvailable stops at a full buffer, so a bag filling it would never be completed: it is skipped like a bag
+		// larger than the ring of a stream source
+		if (m_buffer.size() - header_pos >= s_buffer_size)
+		{
+			LogLine(kWarning, "event bag larger than the buffer") << "CatchEventBag: event bag at byte " << m_stats.bytes - (m_buffer.size() - header_pos)
+																  << " has no footer or next header in " << s_buffer_size << " bytes, skipped";
+			m_stats.oversized_bag++;
+			m_buffer_start = m_buffer.size() - s_event_head_overlap;
+		}
+		return 0;
+	}
+	size_t footer_end_pos = pos_marker;
+	if (marker == kEventFoot)
+		footer_end_pos += s_event_foot_size;
+	else
+	{
+		LogLine(kWarning, "footer found after next header") << "CatchEventBag: footer found after next header.";
+		m_stats.footer_after_header++;
+	}
+
+	// 3. Return a view of the event data and get Cherenkov Counter
+	bag.offset = header_pos;
+	bag.length = footer_end_pos - header_pos;
+	m_buffer_start = footer_end_pos;
+	if (bag.length >= s_least_event_size)
+	{
+		cherenkov_counter = ((long)m_buffer[footer_end_pos - 8] << 24) +
+							((long)m_buffer[footer_end_pos - 7] << 16) +
+							((long)m_buffer[footer_end_pos - 6] << 8) +
+							((long)m_buffer[footer_end_pos - 5]);
+	}
+	return 1;
+}
+
+int DatManager::NextEventBag(const MappedFile &f_map, const DatIndex *index, size_t &pos, size_t &i_record, EventBagView &bag, long &cherenkov_counter)
+{
+	if (!index)
+		return CatchEventBag(f_map, pos, bag, cherenkov_counter);
+	if (i_record >= index->Size())
+	{
+		pos = f_map.Size();
+		return 0;
+	}
+	const IndexRecord &record = (*index)[i_record++];
+	bag.offset = record.offset;
+	bag.length = record.length;
+	cherenkov_counter = record.counter;
+	pos = record.offset + record.length;
+	return 1;
+}
+
+void DatManager::BuildIndex(const MappedFile &f_map, DatIndex &index)
+{
+	index.Clear();
+	EventBagView bag;
+	long cherenkov_counter = 0;
+	size_t pos = 0;
+	while (CatchEventBag(f_map, pos, bag, cherenkov_counter))
+	{
+		IndexRecord record;
+		record.offset = bag.offset;
+		record.length = bag.length;
+		record.counter = cherenkov_counter;
+		int cycleID = -1;
+		int triggerID = -1;
+		if (PeekIDs(f_map.Data() + bag.offset, bag.length, cycleID, triggerID))
+		{
+			record.cycleID = cycleID;
+			record.triggerID = triggerID;
+		}
+		index.Add(record);
+	}
+}
+
+int DatManager::PeekIDs(const unsigned char *event, size_t event_size, int &cycleID, int &triggerID) const
+{
+	// IDs of the first SPIROC bag, read directly so the layer checks are only reported while decoding
+	size_t head = MarkerScanner::Find(event, event_size, MarkerScanner::Bit(kSpirocHead));
+	if (head + s_spiroc_head.size() + s_spiroc_id_size > event_size)
+		return 0;
+	const unsigned char *id = event + head + s_spiroc_head.size();
+	cycleID = ((id[0] * 0x100 + id[1]) * 0x10000) + (id[2] * 0x100 + id[3]);
+	triggerID = id[4] * 0x100 + id[5];
+	return 1;
+}
+
+int DatManager::SelectBag(const unsigned char *event, size_t event_size, long cherenkov_counter, size_t offset)
+{
+	long long bag_No = m_status.select_bag_No++;
+	if ((m_select_event.max >= 0 && bag_No > m_select_event.max) || (m_select_byte.max >= 0 && static_cast<long long>(offset) > m_select_byte.max))
+		return -1;
+	int cycleID = -1;
+	int triggerID = -1;
+	bool has_IDs = PeekIDs(event, event_size, cycleID, triggerID);
+	if (m_select_event.Contains(bag_No) && m_select_byte.Contains(offset) && m_select_time.Contains(cherenkov_counter & 0x3fffffff) &&
+		(m_select_cycle.All() || (has_IDs && m_select_cycle.Contains(cycleID))))
+		return 1;
+	if (has_IDs)
+		SkipTrigger(triggerID);
+	m_stats.skipped_bags++;
+	return 0;
+}
+
+void DatManager::SkipTrigger(long triggerID)
+{
+	DecodeStatus &st = m_status;
+	if (st.last_trigID - triggerID > 40000)
+	{
+		m_stats.trigger_loops++;
+		st.Loop_No++;
+	}
+	st.last_trigID = triggerID;
+}
+
+size_t DatManager::SelectStart(const DatIndex &index)
+{
+	// The index records hold everything the selection looks at, so the skipped bags are not even read
+	size_t i = 0;
+	for (; i < index.Size(); ++i)
+	{
+		const IndexRecord &record = index[i];
+		if ((m_select_event.max >= 0 && static_cast<long long>(i) > m_select_event.max) ||
+			(m_select_byte.max >= 0 && static_cast<long long>(record.offset) > m_select_byte.max))
+			break;
+		if (m_select_event.Contains(i) && m_select_byte.Contains(record.offset) && m_select_time.Contains(record.counter & 0x3fffffff) &&
+			(m_select_cycle.All() || (record.cycleID >= 0 && m_select_cycle.Contains(record.cycleID))))
+		{
+			m_status.select_bag_No = i;
+			return record.offset;
+		}
+		if (record.triggerID >= 0)
+			SkipTrigger(record.triggerID);
+	}
+	m_status.select_bag_No = i;
+	return m_map.Size();
+}
+
+void DatManager::LoadIndex(const string &input_file)
+{
+	ostringstream summary;
+	if (m_index.Load(input_file))
+	{
+		summary << " Index: " << DatIndex::FileName(input_file) << " " << m_index.Size() << " event bags";
+		Summary(summary.str());
+		return;
+	}
+	BuildIndex(m_map, m_index);
+	int saved = m_index.Save(input_file);
+	summary << " Index: built " << m_index.Size() << " event bags" << (saved ? ", saved to " + DatIndex::FileName(input_file) : ", not saved");
+	Summary(summary.str());
+}
+
+void DatManager::Checkpoint(TTree *tree, size_t offset)
+{
+	auto now = chrono::steady_clock::now();
+	if (now < m_next_checkpoint)
+		return;
+	m_next_checkpoint = now + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(m_checkpoint_interval));
+	// Between two event bags the chip buffers are empty, so the offset, the status and the counters are the whole state
+	ostringstream text;
+	text << setprecision(17); // Stage times are restored exactly
+	text << "settings " << m_checkpoint_settings << "\n"
+		 << "offset " << offset << "\n"
+		 << "entries " << tree->GetEntries() << "\n"
+		 << "ped_entries " << (m_ped_tree ? m_ped_tree->GetEntries() : -1) << "\n"
+		 << "time_entries " << (m_time_tree ? m_time_tree->GetEntries() : -1) << "\n"
+		 << "zs_event_No " << m_zs_event_No << "\n"
+		 << "count_chipbuffer " << count_chipbuffer << "\n";
+	m_status.ForEachField([&text](const string &name, const auto &value)
+						  { text << "status." << name << " " << value << "\n"; });
+	m_stats.ForEachField([&text](const string &name, const auto &value)
+						 { text << "stats." << name << " " << value << "\n"; });
+	// Raw_Hit is saved last, its AutoSave also writes the key list that makes the checkpoint visible
+	if (m_ped_tree)
+		m_ped_tree->AutoSave("SaveSelf");
+	if (m_time_tree)
+		m_time_tree->AutoSave("SaveSelf");
+	TNamed checkpoint("Decode_Checkpoint", text.str().c_str());
+	m_checkpoint_file->WriteTObject(&checkpoint, "Decode_Checkpoint", "Overwrite");
+	tree->AutoSave("SaveSelf");
+	LogLine(kDebug) << "checkpoint at byte " << offset << " Event No " << m_status.Event_No;
+	if (m_checkpoint_hook)
+		m_checkpoint_hook(offset);
+}
+
+TTree *DatManager::ResumeCheckpoint(const string &str_out, TFile *&fout, size_t &offset)
+{
+	// 1. Output file of an earlier run, ROOT recovers the trees of the last AutoSave when it was not closed
+	if (!ifstream(str_out))
+		return nullptr;
+	TFile *file = TFile::Open(str_out.c_str(), "UPDATE");
+	TNamed *checkpoint = nullptr;
+	TTree *tree = nullptr;
+	TTree *ped_tree = nullptr;
+	TTree *time_tree = nullptr;
+	if (file && !file->IsZombie())
+	{
+		file->GetObject("Decode_Checkpoint", checkpoint);
+		file->GetObject("Raw_Hit", tree);
+		file->GetObject("Raw_Hit_Ped", ped_tree);
+		file->GetObject("Raw_Hit_Time", time_tree);
+	}
+	if (!checkpoint)
+	{
+		// A complete output or one without checkpoints
+		if (file)
+			file->Close();
+		delete file;
+		return nullptr;
+	}
+
+	// 2. The checkpoint must match the saved trees, the input file and the decode settings
+	map<string, string> values;
+	istringstream text(checkpoint->GetTitle());
+	delete checkpoint; // GetObject reads a new copy that belongs to the caller
+	for (string line; getline(text, line);)
+	{
+		size_t space = line.find(' ');
+		values[line.substr(0, space)] = space == string::npos ? "" : line.substr(space + 1);
+	}
+	Long64_t entries = -1;
+	Long64_t ped_entries = -1;
+	Long64_t time_entries = -1;
+	istringstream(values["entries"]) >> entries;
+	istringstream(values["ped_entries"]) >> ped_entries;
+	istringstream(values["time_entries"]) >> time_entries;
+	// Every field of the decoder state by its name, a checkpoint without one of them is not used
+	bool b_fields = true;
+	auto restore = [&values, &b_fields](const string &prefix)
+	{
+		return [&values, &b_fields, prefix](const string &name, auto &value)
+		{
+			auto it = values.find(prefix + name);
+			if (it == values.end() || !(istringstream(it->second) >> value))
+				b_fields = false;
+		};
+	};
+	DecodeStatus status;
+	DecodeStats stats;
+	status.ForEachField(restore("status."));
+	stats.ForEachField(restore("stats."));
+	if (!tree || values["settings"] != m_checkpoint_settings || entries != tree->GetEntries() ||
+		ped_entries != (ped_tree ? ped_tree->GetEntries() : -1) || time_entries != (time_tree ? time_tree->GetEntries() : -1) || !b_fields)
+	{
+		LogLine(kWarning) << "the checkpoint in " << str_out << " does not match the output or the settings, decoding from the start";
+		file->Close();
+		delete file;
+		return nullptr;
+	}
+
+	// 3. Restore the decoder and continue the trees
+	istringstream(values["offset"]) >> offset;
+	istringstream(values["zs_event_No"]) >> m_zs_event_No;
+	istringstream(values["count_chipbuffer"]) >> count_chipbuffer;
+	m_status = status;
+	m_stats = stats;
+	m_branch_objects.clear();
+	AttachTreeBranch(tree);
+	if (ped_tree)
+		AttachTreeBranch(ped_tree);
+	if (time_tree)
+		time_tree->SetBranchAddress("Event_Time", &_Event_Time);
+	m_ped_tree = ped_tree;
+	m_time_tree = time_tree;
+	if (m_compression >= 0)
+		file->SetCompressionSettings(m_compression);
+	fout = file;
+	return tree;
+}
+
+// Vector branches of a tree read from a file take the address of a pointer, which has to live as long as the tree
+template <class T>
+static void SetObjectAddress(TTree *tree, const char *name, T *object, deque<void *> &objects)
+{
+	objects.push_back(object);
+	tree->SetBranchAddress(name, reinterpret_cast<T **>(&objects.back()));
+}
+
+void DatManager::AttachTreeBranch(TTree *tree)
+{
+	deque<void *> &objects = m_branch_objects;
+	tree->SetBranchAddress("Run_Num", &_Run_No);
+	tree->SetBranchAddress("Event_Time", &_Event_Time);
+	tree->SetBranchAddress("CycleID", &_cycleID);
+	tree->SetBranchAddress("TriggerID", &_triggerID);
+	SetObjectAddress(tree, "CellID", &_cellID, objects);
+	if (m_compact)
+	{
+		SetObjectAddress(tree, "BCID", &m_compact_bcid, objects);
+		SetObjectAddress(tree, "HitFlags", &m_compact_flags, objects);
+		SetObjectAddress(tree, "HG_Charge", &m_compact_HG, objects);
+		SetObjectAddress(tree, "LG_Charge", &m_compact_LG, objects);
+		SetObjectAddress(tree, "Hit_Time", &m_compact_time, objects);
+	}
+	else
+	{
+		SetObjectAddress(tree, "BCID", &_bcid, objects);
+		SetObjectAddress(tree, "HitTag", &_hitTag, objects);
+		SetObjectAddress(tree, "GainTag", &_gainTag, objects);
+		SetObjectAddress(tree, "HG_Charge", &_HG_Charge, objects);
+		SetObjectAddress(tree, "LG_Charge", &_LG_Charge, objects);
+		SetObjectAddress(tree, "Hit_Time", &_Hit_Time, objects);
+		SetObjectAddress(tree, "GainTag_TDC", &_gainTag_tdc, objects);
+	}
+	SetObjectAddress(tree, "Cherenkov", &_cherenkov, objects);
+	if (m_zero_suppress)
+		tree->SetBranchAddress("Suppressed_No", &m_suppressed_No);
+}
+
+int DatManager::AppendChunk(const string &file_name, TTree *tree, bool b_fast)
+{
+	TFile *f_chunk = TFile::Open(file_name.c_str(), "READ");
+	if (!f_chunk || f_chunk->IsZombie())
+	{
+		LogLine(kError) << "cant open " << file_name;
+		delete f_chunk;
+		return 0;
+	}
+	TTree *t_chunk = (TTree *)f_chunk->Get("Raw_Hit");
+	if (!t_chunk)
+	{
+		LogLine(kError) << "no Raw_Hit in " << file_name;
+		f_chunk->Close();
+		delete f_chunk;
+		return 0;
+	}
+	Long64_t n_entries = t_chunk->GetEntries();
+	Long64_t appended = 0;
+	if (b_fast)
+	{
+		// Same branches, compression and basket size: the baskets are copied without unzipping them
+		Long64_t before = tree->GetEntries();
+		tree->CopyEntries(t_chunk, -1, "fast");
+		appended = tree->GetEntries() - before;
+		f_chunk->Close();
+		delete f_chunk;
+		if (appended != n_entries)
+			LogLine(kError) << "appended " << appended << " of the " << n_entries << " entries of " << file_name;
+		return appended == n_entries ? 1 : appended == 0 ? 0 : -1;
+	}
+	// Read straight into the members the output branches point to
+	vector<int> *cellID = &_cellID, *bcid = &_bcid, *hitTag = &_hitTag, *gainTag = &_gainTag, *gainTag_tdc = &_gainTag_tdc, *cherenkov = &_cherenkov;
+	vector<double> *HG_Charge = &_HG_Charge, *LG_Charge = &_LG_Charge, *Hit_Time = &_Hit_Time;
+	t_chunk->SetBranchAddress("Run_Num", &_Run_No);
+	t_chunk->SetBranchAddress("Event_Time", &_Event_Time);
+	t_chunk->SetBranchAddress("CycleID", &_cycleID);
+	t_chunk->SetBranchAddress("TriggerID", &_triggerID);
+	t_chunk->SetBranchAddress("CellID", &cellID);
+	t_chunk->SetBranchAddress("BCID", &bcid);
+	t_chunk->SetBranchAddress("HitTag", &hitTag);
+	t_chunk->SetBranchAddress("GainTag", &gainTag);
+	t_chunk->SetBranchAddress("HG_Charge", &HG_Charge);
+	t_chunk->SetBranchAddress("LG_Charge", &LG_Charge);
+	t_chunk->SetBranchAddress("Hit_Time", &Hit_Time);
+	t_chunk->SetBranchAddress("GainTag_TDC", &gainTag_tdc);
+	t_chunk->SetBranchAddress("Cherenkov", &cherenkov);
+	for (; appended < n_entries; ++appended)
+	{
+		if (t_chunk->GetEntry(appended) <= 0)
+		{
+			LogLine(kError) << "cant read entry " << appended << " of " << file_name;
+			break;
+		}
+		WriteEvent(tree);
+	}
+	t_chunk->ResetBranchAddresses();
+	f_chunk->Close();
+	delete f_chunk;
+	BranchClear();
+	return appended == n_entries ? 1 : appended == 0 ? 0 : -1;
+}
+
+int DatManager::SetCompression(const string &algorithm, int level)
+{
+	typedef ROOT::RCompressionSetting::EAlgorithm Algorithm;
+	Algorithm::EValues alg;
+	if (algorithm == "")
+	{
+		m_compression = -1;
+		return 1;
+	}
+	else if (algorithm == "zlib")
+		alg = Algorithm::kZLIB;
+	else if (algorithm == "lzma")
+		alg = Algorithm::kLZMA;
+	else if (algorithm == "lz4")
+		alg = Algorithm::kLZ4;
+	else if (algorithm == "zstd")
+		alg = Algorithm::kZSTD;
+	else
+	{
+		LogLine(kWarning) << "unknown compression algorithm " << algorithm << ", using the ROOT default";
+		m_compression = -1;
+		return 0;
+	}
+	m_compression = ROOT::CompressionSettings(alg, level);
 	return 1;
 }
 
+void DatManager::Summary(const string &line, LogLevel level)
+{
+	m_summary += line + "\n";
+	if (m_print_summary)
+		LogLine(level) << line;
+}
+
+void DatManager::PackCompact()
+{
+	size_t n = _cellID.size();
+	m_compact_bcid.resize(n);
+	m_compact_HG.resize(n);
+	m_compact_LG.resize(n);
+	m_compact_time.resize(n);
+	m_compact_flags.resize(n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		m_compact_bcid[i] = _bcid[i];
+		m_compact_HG[i] = CompactHit::Pack(_HG_Charge[i]);
+		m_compact_LG[i] = CompactHit::Pack(_LG_Charge[i]);
+		m_compact_time[i] = CompactHit::Pack(_Hit_Time[i]);
+		unsigned char flags = 0;
+		if (_hitTag[i] == 1)
+			flags |= CompactHit::kHitTag;
+		if (_gainTag[i] == 1)
+			flags |= CompactHit::kGainTag;
+		else if (_gainTag[i] == -1)
+			flags |= CompactHit::kNoGainTag;
+		if (_gainTag_tdc[i] == 1)
+			flags |= CompactHit::kGainTagTDC;
+		m_compact_flags[i] = flags;
+	}
+}
+
 void DatManager::SetTreeBranch(TTree *tree)
 {
+	if (m_compact)
+	{
+		tree->Branch("Run_Num", &_Run_No);
+		tree->Branch("Event_Time", &_Event_Time);
+		tree->Branch("CycleID", &_cycleID);
+		tree->Branch("TriggerID", &_triggerID);
+		tree->Branch("CellID", &_cellID);
+		tree->Branch("BCID", &m_compact_bcid);
+		tree->Branch("HitFlags", &m_compact_flags);
+		tree->Branch("HG_Charge", &m_compact_HG);
+		tree->Branch("LG_Charge", &m_compact_LG);
+		tree->Branch("Hit_Time", &m_compact_time);
+		tree->Branch("Cherenkov", &_cherenkov);
+		if (m_zero_suppress)
+			tree->Branch("Suppressed_No", &m_suppressed_No);
+		return;
+	}
 	tree->Branch("Run_Num", &_Run_No);
 	tree->Branch("Event_Time", &_Event_Time);
 	tree->Branch("CycleID", &_cycleID);
@@ -614,6 +2295,8 @@ void DatManager::SetTreeBranch(TTree *tree)
 	tree->Branch("Hit_Time", &_Hit_Time);
 	tree->Branch("GainTag_TDC", &_gainTag_tdc);
 	tree->Branch("Cherenkov", &_cherenkov);
+	if (m_zero_suppress)
+		tree->Branch("Suppressed_No", &m_suppressed_No);
 }
 
 void DatManager::BranchClear()
@@ -628,83 +2311,6 @@ void DatManager::BranchClear()
 	_gainTag_tdc.clear();
 	_cherenkov.clear();
 }
-/*int raw2Root::RMFelixTag(string inputDir,string outputDir){
-  ifstream f_datalist,f_in[Layer_No];
-  ofstream f_out[Layer_No];
-  string str_datalist=inputDir+"/datalist";
-  f_datalist.open(str_datalist,ios::in);
-  if (!f_datalist){
-  cout<<"cant open "<<str_datalist<<endl;
-  return 0;
-  }
-  for (int i = 0; f_datalist>>str_tmp; ++i){
-  f_in[i].open(str_tmp,ios::in);
-  if (!f_in[i]){
-  cout<<"f_in cant open "<<str_tmp<<endl;
-  continue;
-  }
-  else cout<<"Read "<<str_tmp<<endl;
-  str_tmp=find_datname(str_tmp);
-  str_tmp=outputDir+"/"+str_tmp+".dat";
-  cout<<str_tmp<<endl;
-  f_out[i].open(str_tmp,ios::out|ios::binary);
-  if (!f_out[i]){
-  cout<<"f_out cant open "<<str_tmp<<endl;
-  continue;
-  }
-  else cout<<"Write "<<str_tmp<<endl;
-  bool b_felix=0;
-  int buffer=0;
-  int size=0;
-  int count=0;
-  std::vector<int> v;
-//ffff 0000 baba 5afff ******* ffa5 abab 0000 ffff
-while(f_in[i].read((char*)(&buffer),1)){
-count++;
-v.push_back(buffer);
-int size = v.size();
-if( count>=6 && count%1024 == 4 && v[size-1] == 0xab && v[size-2] == 0xcd){
-v.erase(v.end()-6,v.end());
-continue;
-}
-if( size%2==1 || size<8 )continue;
-if( v[size-1]==0xff && v[size-2]==0xff && v[size-3]==0x00 && v[size-4]==0x00 &&
-v[size-5]==0xab && v[size-6]==0xab && v[size-7]==0xa5 && v[size-8]==0xff){//ffa5 abab 0000 ffff
-v.clear();
-v.push_back(0x00);v.push_back(0x00);v.push_back(0xff);v.push_back(0xff);//0000 ffff
-continue;
-}
-if( v[size-1]==0xff && v[size-2]==0x5a && v[size-3]==0xba && v[size-4]==0xba &&
-v[size-5]==0x00 && v[size-6]==0x00 && v[size-7]==0xff && v[size-8]==0xff){//ffff 0000 baba 5aff
-if(v[0]==0x00 && v[1]==0x00 && v[2]==0xff && v[3]==0xff) v.erase(v.begin(),v.begin()+4);
-v.erase(v.end()-8,v.end());
-size=v.size();
-/*if(v[size-20]==0xfa && v[size-19]==0x23 && v[size-16]==0xcd && v[size-15]==0xab){
-v.erase(v.end()-20,v.end()-14);
-size=v.size();
-}
-else cout<<"no felix tag before"<<hex<<v[size-20]<<" "<<v[size-19]<<" "<<v[size-18]<<" "<<v[size-17]<<" "<<v[size-16]<<" "<<endl;
-for (int i_v = 0; i_v < size; ++i_v){
-buffer=v[i_v];
-f_out[i].write((char*)(&buffer),1);
-}
-v.clear();
-v.push_back(0xff);v.push_back(0xff);v.push_back(0x00);v.push_back(0x00);//ffff 0000
-continue;
-}
-}
-if(v[0]==0xff && v[1]==0xff && v[2]==0x00 && v[3]==0x00) v.clear();
-else if(v[0]==0x00 && v[1]==0x00 && v[2]==0xff && v[3]==0xff){
-for (int i_v = 4; i_v < v.size(); ++i_v){
-buffer=v[i_v];
-f_out[i].write((char*)(&buffer),1);
-}
-}
-else cout<<"Felix Tag error "<<hex<<v[0]<<v[1]<<v[2]<<v[3]<<endl;
-v.clear();
-}
-return 1;
-}*/
 DatManager::~DatManager()
 {
 }
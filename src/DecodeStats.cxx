@@ -0,0 +1,67 @@
+#include "DecodeStats.h"
+
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+void DecodeStats::Merge(const DecodeStats &other)
+{
+	// The workers never set t_total, the Decode that merges them does
+	Fields([](const string &, auto &sum, const auto &value)
+		   { sum += value; },
+		   *this, other);
+}
+
+// File names are the only strings, escape what JSON does not allow inside quotes
+static string JSONString(const string &s)
+{
+	string out = "\"";
+	for (char c : s)
+	{
+		if (c == '"' || c == '\\')
+			out += '\\';
+		if (static_cast<unsigned char>(c) >= 0x20)
+			out += c;
+	}
+	return out + "\"";
+}
+
+int DecodeStats::WriteJSON(const string &file_name, const string &input_file, const string &output_file) const
+{
+	ofstream f_out(file_name);
+	if (!f_out)
+	{
+		cout << "cant create " << file_name << endl;
+		return 0;
+	}
+	f_out << "{\n"
+		  << "  \"input\": " << JSONString(input_file) << ",\n"
+		  << "  \"output\": " << JSONString(output_file) << ",\n"
+		  << "  \"bytes\": " << bytes << ",\n"
+		  << "  \"event_bags\": " << event_bags << ",\n"
+		  << "  \"events\": " << events << ",\n"
+		  << "  \"spiroc_bags\": " << spiroc_bags << ",\n"
+		  << "  \"empty_spiroc_bags\": " << empty_spiroc_bags << ",\n"
+		  << "  \"layer_spiroc_bags\": [";
+	for (int i = 0; i < s_layer_No; ++i)
+		f_out << (i ? ", " : "") << layer_spiroc_bags[i];
+	f_out << "],\n"
+		  << "  \"cherenkov\": {\"cherenkov1\": " << cherenkov1 << ", \"cherenkov2\": " << cherenkov2 << ", \"coincidence\": " << cherenkov_coincidence << "},\n"
+		  << "  \"zero_suppression\": {\"kept_channels\": " << kept_channels << ", \"suppressed_channels\": " << suppressed_channels << ", \"ped_events\": " << ped_events << "},\n"
+		  << "  \"skipped_bags\": " << skipped_bags << ",\n"
+		  << "  \"extra_memory_cells\": " << extra_memory_cells << ",\n"
+		  << "  \"event_builder\": {\"recovered_bags\": " << recovered_bags << ", \"timed_out_events\": " << timed_out_events << ", \"late_bags\": " << late_bags << "},\n"
+		  << "  \"errors\": {";
+	const char *separator = "\n";
+	Errors([&f_out, &separator](const string &name, const long &value)
+		   { f_out << separator << "    \"" << name << "\": " << value; separator = ",\n"; },
+		   *this);
+	f_out << "\n  },\n"
+		  << "  \"trigger_loops\": " << trigger_loops << ",\n"
+		  << "  \"seconds\": {\"frame\": " << t_frame << ", \"unpack\": " << t_unpack << ", \"write\": " << t_write << ", \"total\": " << t_total << "},\n"
+		  << "  \"MB_per_s\": " << (t_total > 0 ? bytes / t_total / 1e6 : 0.) << ",\n"
+		  << "  \"events_per_s\": " << (t_total > 0 ? events / t_total : 0.) << "\n"
+		  << "}\n";
+	return f_out.good() ? 1 : 0;
+}
@@ -0,0 +1,299 @@
+#include "FelixInput.h"
+#include "Logger.h"
+#include "MarkerScanner.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+static const unsigned char s_packet_header[] = {0xff, 0xa5, 0xab, 0xab, 0x00, 0x00, 0xff, 0xff};
+static const unsigned char s_packet_trailer[] = {0xff, 0xff, 0x00, 0x00, 0xba, 0xba, 0x5a, 0xff};
+static const unsigned char s_event_head[] = {0xfb, 0xee, 0xfb, 0xee};
+static const unsigned char s_event_foot[] = {0xfe, 0xdd, 0xfe, 0xdd};
+
+FelixInput::~FelixInput()
+{
+	Close();
+}
+
+int FelixInput::Open(const vector<string> &files, size_t window)
+{
+	Close();
+	for (const string &name : files)
+	{
+		unique_ptr<Stream> s(new Stream);
+		s->name = name;
+		s->f_in.open(name, ios::in | ios::binary);
+		if (!s->f_in)
+		{
+			LogLine(kError) << "cant open " << name;
+			Close();
+			return 0;
+		}
+		m_streams.push_back(std::move(s));
+	}
+	m_window = max<size_t>(window, 1);
+	m_raw.resize(s_read_size);
+	for (size_t i = 0; i < m_streams.size(); ++i)
+		Refill(i);
+	return m_streams.empty() ? 0 : 1;
+}
+
+void FelixInput::Close()
+{
+	m_streams.clear();
+	m_heads.clear();
+	m_last_trigID = -1;
+	m_last_key = 0;
+	m_emitted = false;
+	m_counters = Counters();
+	m_raw = vector<unsigned char>();
+	m_stripped = vector<unsigned char>();
+}
+
+uint64_t FelixInput::RawBytes() const
+{
+	uint64_t bytes = 0;
+	for (const auto &s : m_streams)
+		bytes += s->raw;
+	return bytes;
+}
+
+void FelixInput::StripBlockTags(Stream &s, const unsigned char *raw, size_t size, vector<unsigned char> &out)
+{
+	// The tag of block boundary k covers [k * 1024 - 2, k * 1024 + 4), it is dropped when it ends with cd ab
+	for (size_t i = 0; i < size;)
+	{
+		uint64_t pos = s.raw + i;
+		uint64_t in_block = pos % s_block_size;
+		bool b_tag = pos >= s_block_size - 2 && (in_block >= s_block_size - 2 || in_block < s_block_tag_size - 2);
+		if (!b_tag)
+		{
+			size_t n = min<uint64_t>(size - i, s_block_size - 2 - in_block);
+			out.insert(out.end(), raw + i, raw + i + n);
+			i += n;
+			continue;
+		}
+		s.block_tag.push_back(raw[i++]);
+		if (s.block_tag.size() == s_block_tag_size)
+		{
+			if (s.block_tag[4] != 0xcd || s.block_tag[5] != 0xab)
+				out.insert(out.end(), s.block_tag.begin(), s.block_tag.end());
+			s.block_tag.clear();
+		}
+	}
+	s.raw += size;
+}
+
+void FelixInput::StripPackets(Stream &s, const vector<unsigned char> &in)
+{
+	// Tags start on a 16-bit word of the packet; bytes outside the packets are dropped
+	for (unsigned char c : in)
+	{
+		s.packet.push_back(c);
+		size_t n = s.packet.size();
+		if (c != 0xff || n % 2 || n < s_tag_size)
+			continue;
+		const unsigned char *tag = s.packet.data() + n - s_tag_size;
+		if (memcmp(tag, s_packet_header, s_tag_size) == 0)
+		{
+			s.packet.clear();
+			s.inside = true;
+			s.tagged = true;
+		}
+		else if (s.inside && memcmp(tag, s_packet_trailer, s_tag_size) == 0)
+		{
+			s.data.insert(s.data.end(), s.packet.begin(), s.packet.end() - s_tag_size);
+			s.packet.clear();
+			s.inside = false;
+			s.tagged = true;
+		}
+	}
+	size_t n = s.packet.size();
+	if (!s.inside && n > s_tag_size)
+	{
+		// Only a partial header tag is kept, an even number of bytes keeps the word alignment
+		size_t drop = (n - s_tag_size) & ~size_t(1);
+		s.packet.erase(s.packet.begin(), s.packet.begin() + drop);
+	}
+	else if (s.inside && n >= s_max_packet)
+	{
+		LogLine(kWarning, "FELIX packet without trailer") << s.name << ": FELIX packet without trailer after " << n << " bytes, passed on";
+		s.data.insert(s.data.end(), s.packet.begin(), s.packet.end());
+		s.packet.clear();
+	}
+}
+
+int FelixInput::Fill(Stream &s)
+{
+	if (s.eof)
+		return 0;
+	if (s.start > 0)
+	{
+		s.data.erase(s.data.begin(), s.data.begin() + s.start);
+		s.scan = s.scan > s.start ? s.scan - s.start : 0;
+		s.start = 0;
+	}
+	size_t before = s.data.size();
+	while (s.data.size() == before)
+	{
+		s.f_in.read(reinterpret_cast<char *>(m_raw.data()), m_raw.size());
+		size_t n = s.f_in.gcount();
+		m_stripped.clear();
+		if (n == 0)
+		{
+			// An unfinished block tag is data, an unfinished packet is kept like the old RMFelixTag did
+			s.eof = true;
+			m_stripped.swap(s.block_tag);
+			StripPackets(s, m_stripped);
+			if (s.inside)
+			{
+				if (!s.tagged)
+					LogLine(kWarning) << s.name << ": no FELIX packet tags, read as plain data";
+				s.data.insert(s.data.end(), s.packet.begin(), s.packet.end());
+			}
+			s.packet.clear();
+			return s.data.size() > before ? 1 : 0;
+		}
+		StripBlockTags(s, m_raw.data(), n, m_stripped);
+		StripPackets(s, m_stripped);
+	}
+	return 1;
+}
+
+int FelixInput::NextBag(Stream &s, Bag &bag, uint64_t &key)
+{
+	while (true)
+	{
+		// 1. Find header
+		size_t size = s.data.size();
+		size_t header = s.start + MarkerScanner::Find(s.data.data() + s.start, size - s.start, MarkerScanner::Bit(kEventHead));
+		if (header == size)
+		{
+			s.start = max(s.start, size > 3 ? size - 3 : 0);
+			s.scan = 0;
+			if (!Fill(s))
+				return 0;
+			continue;
+		}
+		s.start = header;
+
+		// 2. Find footer, or the next header if the footer is missing
+		MarkerType marker = kEventHead;
+		size_t from = max(header + sizeof(s_event_head), s.scan);
+		size_t end = from + MarkerScanner::Find(s.data.data() + from, size - from, MarkerScanner::s_event_markers, &marker);
+		if (end == size)
+		{
+			s.scan = size - 3;
+			if (!Fill(s))
+			{
+				m_counters.broken_bags++;
+				s.start = s.data.size();
+				return 0;
+			}
+			continue;
+		}
+		s.scan = 0;
+		if (marker == kEventHead)
+		{
+			LogLine(kWarning, "FELIX bag without footer") << s.name << ": event bag without footer, dropped";
+			m_counters.broken_bags++;
+			s.start = end;
+			continue;
+		}
+		end += sizeof(s_event_foot);
+		s.start = end;
+
+		// 3. SPIROC bags and Cherenkov counter
+		const unsigned char *event = s.data.data() + header;
+		size_t event_size = end - header;
+		if (event_size < sizeof(s_event_head) + 4 + sizeof(s_event_foot))
+		{
+			m_counters.no_id_bags++;
+			continue;
+		}
+		const unsigned char *counter = event + event_size - sizeof(s_event_foot) - 4;
+		bag.payload.assign(event + sizeof(s_event_head), counter);
+		bag.cherenkov_counter = ((long)counter[0] << 24) + ((long)counter[1] << 16) + ((long)counter[2] << 8) + ((long)counter[3]);
+
+		// 4. Key of the first SPIROC bag, the triggerID is unwrapped to the value nearest to the last one read from
+		//    any layer, so that bags swapped around a wrap of the 16-bit counter keep their order and layer files
+		//    starting on both sides of a wrap get the same keys
+		size_t head = MarkerScanner::Find(bag.payload.data(), bag.payload.size(), MarkerScanner::Bit(kSpirocHead));
+		if (head + 4 + 6 > bag.payload.size())
+		{
+			m_counters.no_id_bags++;
+			continue;
+		}
+		const unsigned char *id = bag.payload.data() + head + 4;
+		uint32_t cycleID = ((id[0] * 0x100u + id[1]) << 16) + (id[2] * 0x100u + id[3]);
+		int triggerID = id[4] * 0x100 + id[5];
+		if (m_last_trigID < 0)
+			m_last_trigID = triggerID + 0x10000; // Room for bags before the first one
+		else
+			m_last_trigID += static_cast<int16_t>(triggerID - (m_last_trigID & 0xffff));
+		key = (uint64_t(cycleID) << 32) + (m_last_trigID & 0xffffffff);
+		return 1;
+	}
+}
+
+void FelixInput::Refill(size_t i)
+{
+	Stream &s = *m_streams[i];
+	Bag bag;
+	uint64_t key = 0;
+	while (s.window.size() < m_window && NextBag(s, bag, key))
+		s.window.emplace(key, std::move(bag));
+	if (!s.window.empty())
+		m_heads.emplace(s.window.begin()->first, i);
+}
+
+int FelixInput::Next(vector<unsigned char> &event, long &cherenkov_counter)
+{
+	vector<bool> merged(m_streams.size());
+	while (!m_heads.empty())
+	{
+		// 1. Take the bags with the smallest key from every layer
+		uint64_t key = m_heads.begin()->first;
+		event.assign(s_event_head, s_event_head + sizeof(s_event_head));
+		fill(merged.begin(), merged.end(), false);
+		size_t bags = 0;
+		size_t layers = 0;
+		while (!m_heads.empty() && m_heads.begin()->first == key)
+		{
+			size_t i = m_heads.begin()->second;
+			m_heads.erase(m_heads.begin());
+			Stream &s = *m_streams[i];
+			Bag &bag = s.window.begin()->second;
+			event.insert(event.end(), bag.payload.begin(), bag.payload.end());
+			if (bags == 0)
+				cherenkov_counter = bag.cherenkov_counter;
+			if (!merged[i])
+				layers++;
+			merged[i] = true;
+			bags++;
+			s.window.erase(s.window.begin());
+			Refill(i);
+		}
+
+		// 2. An event that was merged already is not completed afterwards
+		if (m_emitted && key <= m_last_key)
+		{
+			LogLine(kWarning, "late FELIX bag") << "FELIX event bag " << (key >> 32) << " " << (key & 0xffff)
+												 << " arrived after its event was merged (more out of order than the window), dropped";
+			m_counters.late_bags += bags;
+			continue;
+		}
+		m_last_key = key;
+		m_emitted = true;
+		for (int shift = 24; shift >= 0; shift -= 8)
+			event.push_back((cherenkov_counter >> shift) & 0xff);
+		event.insert(event.end(), s_event_foot, s_event_foot + sizeof(s_event_foot));
+		m_counters.events++;
+		if (layers < m_streams.size())
+			m_counters.partial_events++;
+		return 1;
+	}
+	return 0;
+}
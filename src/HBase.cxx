@@ -1,8 +1,9 @@
 #include "HBase.h"
+#include "CompactHit.h"
 
 using namespace std;
 
-HBase::HBase() : fin(0),fout(0),tin(0),tout(0)
+HBase::HBase() : fin(0),fout(0),tin(0),tout(0),_compact(false),_bcid_c(0),_HG_Charge_c(0),_LG_Charge_c(0),_Hit_Time_c(0),_hitFlags(0)
 {
 		list.clear();
 		cout<<"HBase class instance initialized."<<endl;
@@ -38,24 +39,75 @@ void HBase::ReadList(const string &_list)
 		}
 }
 
-void HBase::ReadTree(const TString &fname,const TString &tname)
+int HBase::ReadTree(const TString &fname,const TString &tname)
 {
 		cout<<"Reading tree "<<fname<<endl;
 		fin = TFile::Open(TString(fname),"READ");
-		tin = (TTree*)fin->Get(TString(tname));
+		tin = fin ? (TTree*)fin->Get(TString(tname)) : 0;
+		if(!tin && fin && tname=="Raw_Hit_Ped")
+		{
+				// Only zero-suppressed files have the unsuppressed Raw_Hit_Ped, the others keep every channel in Raw_Hit.
+				// A zero-suppressed Raw_Hit (with Suppressed_No) without it was written with zs-prescale 0, its pedestals are biased
+				tin = (TTree*)fin->Get("Raw_Hit");
+				if(tin && tin->GetBranch("Suppressed_No"))
+				{
+						cout<<"Error: "<<fname<<" is zero-suppressed without Raw_Hit_Ped (zs-prescale 0), decode it with zs-prescale above 0 for pedestals"<<endl;
+						return 0;
+				}
+		}
+		if(!tin)
+		{
+				cout<<"Error: no "<<tname<<" in "<<fname<<endl;
+				return 0;
+		}
 		_cellID=0;_bcid=0;_hitTag=0;_gainTag=0;_cherenkov=0;_HG_Charge=0;_LG_Charge=0;_Hit_Time=0;
+		_compact=(tin->GetBranch("HitFlags")!=0);
 		tin->SetBranchAddress("Run_Num",&_Run_No);
 		tin->SetBranchAddress("Event_Time",&_Event_Time);
 		tin->SetBranchAddress("CycleID",&_cycleID);
 		tin->SetBranchAddress("TriggerID",&_triggerID);
 		tin->SetBranchAddress("CellID",&_cellID);
-		tin->SetBranchAddress("BCID",&_bcid);
-		tin->SetBranchAddress("HitTag",&_hitTag);
-		tin->SetBranchAddress("GainTag",&_gainTag);
-		tin->SetBranchAddress("HG_Charge",&_HG_Charge);
-		tin->SetBranchAddress("LG_Charge",&_LG_Charge);
-		tin->SetBranchAddress("Hit_Time",&_Hit_Time);
 		tin->SetBranchAddress("Cherenkov",&_cherenkov);
+		if(_compact)
+		{
+				cout<<"Compact Raw_Hit tree"<<endl;
+				_bcid=&_bcid_buf;_hitTag=&_hitTag_buf;_gainTag=&_gainTag_buf;
+				_HG_Charge=&_HG_Charge_buf;_LG_Charge=&_LG_Charge_buf;_Hit_Time=&_Hit_Time_buf;
+				tin->SetBranchAddress("BCID",&_bcid_c);
+				tin->SetBranchAddress("HitFlags",&_hitFlags);
+				tin->SetBranchAddress("HG_Charge",&_HG_Charge_c);
+				tin->SetBranchAddress("LG_Charge",&_LG_Charge_c);
+				tin->SetBranchAddress("Hit_Time",&_Hit_Time_c);
+		}
+		else
+		{
+				tin->SetBranchAddress("BCID",&_bcid);
+				tin->SetBranchAddress("HitTag",&_hitTag);
+				tin->SetBranchAddress("GainTag",&_gainTag);
+				tin->SetBranchAddress("HG_Charge",&_HG_Charge);
+				tin->SetBranchAddress("LG_Charge",&_LG_Charge);
+				tin->SetBranchAddress("Hit_Time",&_Hit_Time);
+		}
 		cout<<"Reading tree done "<<fname<<endl;
-		
+		return 1;
+}
+
+Long64_t HBase::GetEntry(Long64_t entry)
+{
+		Long64_t nbytes=tin->GetEntry(entry);
+		if(!_compact)return nbytes;
+		size_t n=_hitFlags->size();
+		_bcid_buf.resize(n);_hitTag_buf.resize(n);_gainTag_buf.resize(n);
+		_HG_Charge_buf.resize(n);_LG_Charge_buf.resize(n);_Hit_Time_buf.resize(n);
+		for(size_t i=0;i<n;i++)
+		{
+				unsigned char flags=_hitFlags->at(i);
+				_bcid_buf[i]=_bcid_c->at(i);
+				_hitTag_buf[i]=(flags&CompactHit::kHitTag)?1:0;
+				_gainTag_buf[i]=(flags&CompactHit::kNoGainTag)?-1:((flags&CompactHit::kGainTag)?1:0);
+				_HG_Charge_buf[i]=CompactHit::Unpack(_HG_Charge_c->at(i));
+				_LG_Charge_buf[i]=CompactHit::Unpack(_LG_Charge_c->at(i));
+				_Hit_Time_buf[i]=CompactHit::Unpack(_Hit_Time_c->at(i));
+		}
+		return nbytes;
 }
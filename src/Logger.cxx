@@ -0,0 +1,157 @@
+#include "Logger.h"
+
+#include <chrono>
+#include <iostream>
+
+using namespace std;
+
+Logger &Logger::Instance()
+{
+	static Logger logger;
+	return logger;
+}
+
+Logger::~Logger()
+{
+	Flush();
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_not_empty.notify_all();
+	if (m_writer.joinable())
+		m_writer.join();
+}
+
+double Logger::Seconds() const
+{
+	static const auto start = chrono::steady_clock::now();
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+bool Logger::Allow(LogLevel level, const char *type)
+{
+	if (level < m_level)
+		return false;
+	if (!type || m_burst <= 0)
+		return true;
+	double now = Seconds();
+	lock_guard<mutex> lock(m_mutex);
+	TypeLimit &limit = m_limits[type];
+	if (limit.last_time < 0)
+		limit.tokens = m_burst;
+	else
+		limit.tokens = min<double>(m_burst, limit.tokens + (now - limit.last_time) * m_rate);
+	limit.last_time = now;
+	if (limit.tokens >= 1)
+	{
+		limit.tokens -= 1;
+		return true;
+	}
+	limit.suppressed++;
+	return false;
+}
+
+void Logger::Write(const string &text)
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		if (m_queue.size() >= s_queue_size)
+		{
+			m_dropped++;
+			return;
+		}
+		if (!m_writer.joinable())
+			m_writer = thread(&Logger::WriterLoop, this);
+		m_queue.push_back(text);
+		m_pushed++;
+	}
+	m_not_empty.notify_one();
+}
+
+void Logger::Flush()
+{
+	// 1. Suppressed-count summary of every message type
+	vector<string> lines;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		for (auto &it : m_limits)
+		{
+			if (it.second.suppressed > 0)
+				lines.push_back(" " + to_string(it.second.suppressed) + " \"" + it.first + "\" messages suppressed");
+			it.second.suppressed = 0;
+		}
+		if (m_dropped > 0)
+			lines.push_back(" " + to_string(m_dropped) + " log messages dropped (queue full)");
+		m_dropped = 0;
+	}
+	for (const string &line : lines)
+		Write(line);
+
+	// 2. Wait for the writer
+	unique_lock<mutex> lock(m_mutex);
+	m_written.wait(lock, [this]
+				   { return m_flushed == m_pushed; });
+}
+
+int Logger::SetLevel(const string &level)
+{
+	static const map<string, LogLevel> levels = {{"debug", kDebug}, {"info", kInfo}, {"warning", kWarning}, {"error", kError}};
+	auto it = levels.find(level);
+	if (it == levels.end())
+	{
+		cout << "unknown log level " << level << endl;
+		return 0;
+	}
+	m_level = it->second;
+	return 1;
+}
+
+void Logger::SetRateLimit(int burst, double rate)
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_burst = burst;
+	m_rate = rate;
+	m_limits.clear();
+}
+
+int Logger::SetFile(const string &file_name)
+{
+	Flush();
+	lock_guard<mutex> lock(m_mutex);
+	if (m_file.is_open())
+		m_file.close();
+	if (file_name == "")
+		return 1;
+	m_file.open(file_name, ios::out | ios::app);
+	if (!m_file)
+	{
+		cout << "cant open " << file_name << endl;
+		return 0;
+	}
+	return 1;
+}
+
+void Logger::WriterLoop()
+{
+	vector<string> lines;
+	unique_lock<mutex> lock(m_mutex);
+	while (true)
+	{
+		m_not_empty.wait(lock, [this]
+						 { return m_stop || !m_queue.empty(); });
+		if (m_queue.empty())
+			break;
+		lines.swap(m_queue);
+		// Write without the lock so that the decoder can keep queueing, one flush per batch
+		lock.unlock();
+		ostream &out = m_file.is_open() ? static_cast<ostream &>(m_file) : cout;
+		for (const string &line : lines)
+			out << line << '\n';
+		out.flush();
+		lock.lock();
+		m_flushed += lines.size();
+		lines.clear();
+		m_written.notify_all();
+	}
+}
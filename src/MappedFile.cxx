@@ -0,0 +1,66 @@
+#include "MappedFile.h"
+
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+int MappedFile::Open(const string &file_name)
+{
+	Close();
+	m_fd = open(file_name.c_str(), O_RDONLY);
+	if (m_fd < 0)
+		return 0;
+	struct stat st;
+	if (fstat(m_fd, &st) != 0)
+	{
+		Close();
+		return 0;
+	}
+	m_size = st.st_size;
+	if (m_size == 0) // Nothing to map, but the file is valid
+		return 1;
+	void *addr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+	if (addr == MAP_FAILED)
+	{
+		cout << "MappedFile: mmap failed for " << file_name << endl;
+		Close();
+		return 0;
+	}
+	m_data = static_cast<unsigned char *>(addr);
+	madvise(m_data, m_size, MADV_SEQUENTIAL);
+	return 1;
+}
+
+void MappedFile::Release(size_t begin, size_t end) const
+{
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+	if (!m_data || end > m_size)
+		return;
+	// Only whole pages inside the range, a page shared with a neighbouring range stays mapped
+	begin = (begin + page_size - 1) / page_size * page_size;
+	end = end / page_size * page_size;
+	if (end <= begin)
+		return;
+	madvise(m_data + begin, end - begin, MADV_DONTNEED);
+}
+
+void MappedFile::Close()
+{
+	if (m_data)
+		munmap(m_data, m_size);
+	if (m_fd >= 0)
+		close(m_fd);
+	m_fd = -1;
+	m_data = nullptr;
+	m_size = 0;
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
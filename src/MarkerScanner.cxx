@@ -0,0 +1,153 @@
+#include "MarkerScanner.h"
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HBUANA_X86 1
+#endif
+
+using namespace std;
+
+namespace
+{
+	// Returns the marker type starting at p, or -1 if p does not start a marker
+	inline int MatchMarker(const unsigned char *p)
+	{
+		if (p[0] != p[2] || p[1] != p[3])
+			return -1;
+		switch ((p[0] << 8) | p[1])
+		{
+		case 0xfbee:
+			return kEventHead;
+		case 0xfedd:
+			return kEventFoot;
+		case 0xfa5a:
+			return kSpirocHead;
+		case 0xfeee:
+			return kSpirocFoot;
+		default:
+			return -1;
+		}
+	}
+
+	// Check the candidate positions in bits; visit(pos, type) returns true to stop the scan
+	template <class Visit>
+	inline bool CheckCandidates(const unsigned char *data, size_t base, uint32_t bits, unsigned type_mask, Visit &visit, size_t &found)
+	{
+		while (bits)
+		{
+			size_t pos = base + __builtin_ctz(bits);
+			bits &= bits - 1;
+			int type = MatchMarker(data + pos);
+			if (type >= 0 && (type_mask >> type & 1) && visit(pos, MarkerType(type)))
+			{
+				found = pos;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	template <class Visit>
+	size_t ScanScalar(const unsigned char *data, size_t begin, size_t size, unsigned type_mask, Visit &visit)
+	{
+		for (size_t i = begin; i + 4 <= size; ++i)
+		{
+			int type = MatchMarker(data + i);
+			if (type >= 0 && (type_mask >> type & 1) && visit(i, MarkerType(type)))
+				return i;
+		}
+		return size;
+	}
+
+#ifdef HBUANA_X86
+	template <class Visit>
+	size_t ScanSSE2(const unsigned char *data, size_t size, unsigned type_mask, Visit &visit)
+	{
+		const __m128i lead_bits = _mm_set1_epi8(0x05); // fa, fb, fe (and ff) | 0x05 == ff
+		const __m128i all_ones = _mm_set1_epi8(char(0xff));
+		size_t i = 0;
+		size_t found = size;
+		for (; i + 19 <= size; i += 16)
+		{
+			__m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+			__m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 1));
+			__m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 2));
+			__m128i v3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 3));
+			__m128i cand = _mm_and_si128(_mm_cmpeq_epi8(v0, v2), _mm_cmpeq_epi8(v1, v3));
+			cand = _mm_and_si128(cand, _mm_cmpeq_epi8(_mm_or_si128(v0, lead_bits), all_ones));
+			uint32_t bits = _mm_movemask_epi8(cand);
+			if (bits && CheckCandidates(data, i, bits, type_mask, visit, found))
+				return found;
+		}
+		return ScanScalar(data, i, size, type_mask, visit);
+	}
+
+	template <class Visit>
+	__attribute__((target("avx2"))) size_t ScanAVX2(const unsigned char *data, size_t size, unsigned type_mask, Visit &visit)
+	{
+		const __m256i lead_bits = _mm256_set1_epi8(0x05);
+		const __m256i all_ones = _mm256_set1_epi8(char(0xff));
+		size_t i = 0;
+		size_t found = size;
+		for (; i + 35 <= size; i += 32)
+		{
+			__m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+			__m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 1));
+			__m256i v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 2));
+			__m256i v3 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 3));
+			__m256i cand = _mm256_and_si256(_mm256_cmpeq_epi8(v0, v2), _mm256_cmpeq_epi8(v1, v3));
+			cand = _mm256_and_si256(cand, _mm256_cmpeq_epi8(_mm256_or_si256(v0, lead_bits), all_ones));
+			uint32_t bits = _mm256_movemask_epi8(cand);
+			if (bits && CheckCandidates(data, i, bits, type_mask, visit, found))
+				return found;
+		}
+		return ScanScalar(data, i, size, type_mask, visit);
+	}
+
+	const bool s_has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+	template <class Visit>
+	size_t ScanBlock(const unsigned char *data, size_t size, unsigned type_mask, Visit &visit)
+	{
+#ifdef HBUANA_X86
+		if (s_has_avx2)
+			return ScanAVX2(data, size, type_mask, visit);
+		return ScanSSE2(data, size, type_mask, visit);
+#else
+		return ScanScalar(data, 0, size, type_mask, visit);
+#endif
+	}
+}
+
+size_t MarkerScanner::Find(const unsigned char *data, size_t size, unsigned type_mask, MarkerType *type)
+{
+	auto visit = [type](size_t, MarkerType found_type)
+	{
+		if (type)
+			*type = found_type;
+		return true;
+	};
+	return ScanBlock(data, size, type_mask, visit);
+}
+
+void MarkerScanner::Scan(const unsigned char *data, size_t size, vector<MarkerPos> &markers, unsigned type_mask)
+{
+	auto visit = [&markers](size_t pos, MarkerType found_type)
+	{
+		markers.push_back({pos, found_type});
+		return false;
+	};
+	ScanBlock(data, size, type_mask, visit);
+}
+
+const char *MarkerScanner::ISA()
+{
+#ifdef HBUANA_X86
+	return s_has_avx2 ? "avx2" : "sse2";
+#else
+	return "scalar";
+#endif
+}
@@ -0,0 +1,138 @@
+#include "NTupleWriter.h"
+#include "DatManager.h"
+
+#include <iostream>
+
+using namespace std;
+
+#ifdef HBUANA_WITH_RNTUPLE
+
+#include "RawHit.h"
+
+#include <RVersion.h>
+#include <ROOT/RNTupleModel.hxx>
+#include <ROOT/RNTupleWriteOptions.hxx>
+#include <ROOT/RNTupleWriter.hxx>
+
+// RNTupleModel and RNTupleWriter left ROOT::Experimental in ROOT 6.36
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6, 36, 0)
+namespace RNT = ROOT;
+#else
+namespace RNT = ROOT::Experimental;
+#endif
+
+struct NTupleWriter::Impl
+{
+	const DatManager *dm = nullptr;
+	unique_ptr<RNT::RNTupleWriter> writer;
+	shared_ptr<int> run;
+	shared_ptr<unsigned int> event_time;
+	shared_ptr<int> cycleID;
+	shared_ptr<int> triggerID;
+	shared_ptr<vector<int>> cherenkov;
+	shared_ptr<vector<RawHit>> hits;
+};
+
+bool NTupleWriter::Available()
+{
+	return true;
+}
+
+int NTupleWriter::Open(const string &file_name, const DatManager &dm, int compression)
+{
+	Close();
+	unique_ptr<Impl> impl(new Impl());
+	auto model = RNT::RNTupleModel::Create();
+	impl->run = model->MakeField<int>("Run_Num");
+	impl->event_time = model->MakeField<unsigned int>("Event_Time");
+	impl->cycleID = model->MakeField<int>("CycleID");
+	impl->triggerID = model->MakeField<int>("TriggerID");
+	impl->cherenkov = model->MakeField<vector<int>>("Cherenkov");
+	impl->hits = model->MakeField<vector<RawHit>>("Hits");
+	RNT::RNTupleWriteOptions options;
+	if (compression >= 0)
+		options.SetCompression(compression);
+	try
+	{
+		impl->writer = RNT::RNTupleWriter::Recreate(std::move(model), "Raw_Hit", file_name, options);
+	}
+	catch (const exception &e)
+	{
+		cout << "cant create " << file_name << " " << e.what() << endl;
+		return 0;
+	}
+	impl->dm = &dm;
+	m_impl = std::move(impl);
+	return 1;
+}
+
+void NTupleWriter::Fill()
+{
+	const DatManager &dm = *m_impl->dm;
+	*m_impl->run = dm._Run_No;
+	*m_impl->event_time = dm._Event_Time;
+	*m_impl->cycleID = dm._cycleID;
+	*m_impl->triggerID = dm._triggerID;
+	*m_impl->cherenkov = dm._cherenkov;
+	vector<RawHit> &hits = *m_impl->hits;
+	hits.resize(dm._cellID.size());
+	for (size_t i = 0; i < hits.size(); ++i)
+	{
+		hits[i].CellID = dm._cellID[i];
+		hits[i].BCID = dm._bcid[i];
+		hits[i].HitTag = dm._hitTag[i];
+		hits[i].GainTag = dm._gainTag[i];
+		hits[i].HG_Charge = dm._HG_Charge[i];
+		hits[i].LG_Charge = dm._LG_Charge[i];
+		hits[i].Hit_Time = dm._Hit_Time[i];
+		hits[i].GainTag_TDC = dm._gainTag_tdc[i];
+	}
+	m_impl->writer->Fill();
+}
+
+void NTupleWriter::Flush()
+{
+	if (m_impl)
+		m_impl->writer->CommitCluster();
+}
+
+#else
+
+struct NTupleWriter::Impl
+{
+};
+
+bool NTupleWriter::Available()
+{
+	return false;
+}
+
+int NTupleWriter::Open(const string &file_name, const DatManager &, int)
+{
+	cout << "cant create " << file_name << ": hbuana was built without RNTuple support" << endl;
+	return 0;
+}
+
+void NTupleWriter::Fill()
+{
+}
+
+void NTupleWriter::Flush()
+{
+}
+
+#endif
+
+void NTupleWriter::Close()
+{
+	m_impl.reset(); // The RNTupleWriter writes the footer when it is destroyed
+}
+
+NTupleWriter::NTupleWriter()
+{
+}
+
+NTupleWriter::~NTupleWriter()
+{
+	Close();
+}
@@ -1,4 +1,5 @@
 #include "PedestalManager.h"
+#include "DatManager.h"
 #include "TStyle.h"
 #include <TH2.h>
 #include <TF1.h>
@@ -7,6 +8,7 @@
 #include <TCanvas.h>
 #include <sstream>
 #include <algorithm>
+#include <atomic>
 #include "TSpectrum.h"
 
 using namespace std;
@@ -98,6 +100,7 @@ int PedestalManager::AnaPedestal(const std::string &_list,const int &sel_hittag)
 	ReadList(_list); // read file list _list to list
 	cout<<"read list done"<<endl;
 	cout<<usemt<<" usemt"<<endl;
+	atomic<bool> failed(false); // A file without a usable tree, no pedestal is written
 	if(usemt){
 		ROOT::EnableImplicitMT();
 		ROOT::EnableThreadSafety();
@@ -106,38 +109,17 @@ int PedestalManager::AnaPedestal(const std::string &_list,const int &sel_hittag)
 		vector<vector<string>> listth;
 		int nfile_pert = list.size()/nthreads +1;
 		if(list.size()%nthreads == 0)nfile_pert--;
-		auto f = [this,sel_hittag](vector<string> list_tmp)
+		auto f = [this,sel_hittag,&failed](vector<string> list_tmp)
 		{
 			for(auto tmp:list_tmp)
 			{
-				string skipchannel = tmp;
-				int dac_chn=-1;// Which channel should not be used here for pedestal analysis
-				if(sel_hittag == 1)
-				{
-					skipchannel = skipchannel.substr(skipchannel.find_last_of('/')+1);
-					skipchannel = skipchannel.substr(skipchannel.find("chn")+3);
-					skipchannel = skipchannel.substr(0,skipchannel.find_last_of('_'));
-						dac_chn = stoi(skipchannel);
-				}
-				this->ReadTree(TString(tmp.c_str()),"Raw_Hit");
+				int dac_chn=DacChannel(tmp,sel_hittag);// Which channel should not be used here for pedestal analysis
+				if(!this->ReadTree(TString(tmp.c_str()),sel_hittag==0?"Raw_Hit_Ped":"Raw_Hit")){failed=true;continue;}
 				int Nentry = tin->GetEntries();
 				for(int ientry=0;ientry<Nentry;ientry++)
 				{
-					tin->GetEntry(ientry);
-					for(int i=0;i<_hitTag->size();i++)
-					{
-						if(_hitTag->at(i)!=sel_hittag)continue;
-						int cellid = _cellID->at(i);
-						int channel = cellid%100;
-						int memo = (cellid%10000)/100;
-						if(memo !=0 )continue;
-						if(dac_chn==channel)continue;
-						int layer = cellid/1e5;
-						mtx.lock();
-						map_cellid_highgain[cellid]->Fill(_HG_Charge->at(i));
-						map_cellid_lowgain[cellid]->Fill(_LG_Charge->at(i));
-						mtx.unlock();
-					}
+					GetEntry(ientry);
+					FillAll(*_cellID,*_hitTag,*_HG_Charge,*_LG_Charge,sel_hittag,dac_chn);
 				}
 			}
 		};
@@ -162,61 +144,170 @@ int PedestalManager::AnaPedestal(const std::string &_list,const int &sel_hittag)
 	}
 	else
 	{
-		for_each(list.begin(),list.end(),[this,sel_hittag](string tmp){
-				string skipchannel = tmp;
-				int dac_chn=-1;// Which channel should not be used here for pedestal analysis
-				if(sel_hittag == 1){
-					skipchannel = skipchannel.substr(skipchannel.find_last_of('/')+1);
-					int n_chn=skipchannel.find("chn");
-					if(n_chn!=-1){
-						skipchannel = skipchannel.substr(n_chn+3);
-						skipchannel = skipchannel.substr(0,skipchannel.find_last_of('_'));
-						dac_chn = stoi(skipchannel);
-					}
-				}
-				this->ReadTree(TString(tmp.c_str()),"Raw_Hit");
+		for_each(list.begin(),list.end(),[this,sel_hittag,&failed](string tmp){
+				int dac_chn=DacChannel(tmp,sel_hittag);// Which channel should not be used here for pedestal analysis
+				if(!this->ReadTree(TString(tmp.c_str()),sel_hittag==0?"Raw_Hit_Ped":"Raw_Hit")){failed=true;return;}
 				int Nentry = tin->GetEntries();
 				int flag[9][40]={0};
-				tin->GetEntry(Nentry-1);
-				if(_Event_Time<=0)tin->GetEntry(Nentry-2);
-				if(_Event_Time<=0)tin->GetEntry(Nentry-3);
-				TH1I *Event_Time = new TH1I("Event_Time","Event_Time",_Event_Time,0,_Event_Time);
+				vector<unsigned int> times;
+				TTree *t_time = sel_hittag==0 ? (TTree*)fin->Get("Raw_Hit_Time") : 0;
+				if(t_time){
+				// Zero-suppressed file: Raw_Hit_Ped holds only a sample, Raw_Hit_Time the Event_Time of every event
+				unsigned int event_time=0;
+				t_time->SetBranchAddress("Event_Time",&event_time);
+				times.resize(t_time->GetEntries());
+				for(int i=0;i<times.size();i++){
+				t_time->GetEntry(i);
+				times[i]=event_time;
+				}
+				}
+				else{
+				times.resize(Nentry);
 				for(int i=0;i<Nentry;i++){
-				tin->GetEntry(i);
-				Event_Time->Fill(_Event_Time);
+				GetEntry(i);
+				times[i]=_Event_Time;
 				}
+				}
+				TH1I *Event_Time = EventTimeHist(times);
 				for(int ientry=0;ientry<Nentry;ientry++){
-					tin->GetEntry(ientry);
-					if(Event_Time->GetBinContent(_Event_Time)<10){
-						for(int j=0;j<9;j++)
-							for(int p=0;p<40;p++)
-								flag[j][p]=0;
-						continue;
-					}
-					for(int i=0;i<_hitTag->size();i++){
-						if(_hitTag->at(i)!=sel_hittag)continue;
-						int cellid = _cellID->at(i);
-						int channel = cellid%100;
-						int memo = (cellid%10000)/100;
-						if(memo !=0 )continue;
-						if(dac_chn==channel)continue;
-						int layer = cellid/1e5;
-						int chip = (cellid%100000)/10000;
-						// if(times->at(i)<time_min)time_min=times->at(i);
-						// if(times->at(i)>time_max)time_max=times->at(i);
-						// if(lowgains->at(i)<lowgain_min)lowgain_min=lowgains->at(i);
-						// if(lowgains->at(i)>lowgain_max)lowgain_max=lowgains->at(i);
-						// if(Event_Time->GetBinContent(_Event_Time-1)<10||_Event_Time==0)
-						flag[chip][layer]+=1;
-						if(flag[chip][layer]>36){
-							if(_HG_Charge->at(i)>100)map_cellid_highgain[cellid]->Fill(_HG_Charge->at(i));
-							if(_LG_Charge->at(i)>100)map_cellid_lowgain[cellid]->Fill(_LG_Charge->at(i));
-						}
-					}
+					GetEntry(ientry);
+					FillCut(*_cellID,*_hitTag,*_HG_Charge,*_LG_Charge,sel_hittag,dac_chn,Event_Time->GetBinContent(_Event_Time),flag);
 				}
+				delete Event_Time;
 		}
 		);
 	}
+	if(failed)
+	{
+		cout<<"Error: pedestal not written, see the files above"<<endl;
+		return 0;
+	}
+	return WritePedestal();
+}
+
+int PedestalManager::AnaPedestalRaw(const std::string &_list,const int &sel_hittag,DatManager &dm,const std::string &output_dir,const bool &b_auto_gain,const bool &b_cherenkov)
+{
+	cout<<"Starting Ana from raw data"<<endl;
+	ReadList(_list); // read .dat file list _list to list
+	cout<<"read list done"<<endl;
+	for(auto tmp:list)
+	{
+		int dac_chn=DacChannel(tmp,sel_hittag);
+		if(usemt)
+		{
+			// Same selection as AnaPedestal with usemt, one pass
+			dm.SetEventSink([this,sel_hittag,dac_chn](const DatManager &d){
+					FillAll(d._cellID,d._hitTag,d._HG_Charge,d._LG_Charge,sel_hittag,dac_chn);
+					});
+			dm.Decode(tmp,output_dir,b_auto_gain,b_cherenkov);
+			continue;
+		}
+		// The Event_Time cut needs the event counts of the whole file: the hits FillCut would look at are kept
+		// during the one decode (charges are 12-bit ADC values or -1), and FillCut runs over them afterwards
+		vector<unsigned int> times;
+		vector<size_t> first_hit;
+		vector<int> hit_cellID;
+		vector<short> hit_HG,hit_LG;
+		dm.SetEventSink([&](const DatManager &d){
+				times.push_back(d._Event_Time);
+				first_hit.push_back(hit_cellID.size());
+				for(int i=0;i<d._hitTag.size();i++){
+				int cellid=d._cellID[i];
+				if(d._hitTag[i]!=sel_hittag || (cellid%10000)/100!=0 || cellid%100==dac_chn)continue;
+				hit_cellID.push_back(cellid);
+				hit_HG.push_back(d._HG_Charge[i]);
+				hit_LG.push_back(d._LG_Charge[i]);
+				}
+				});
+		dm.Decode(tmp,output_dir,b_auto_gain,b_cherenkov);
+		first_hit.push_back(hit_cellID.size());
+		TH1I *Event_Time = EventTimeHist(times);
+		int flag[9][40]={0};
+		vector<int> cellID,hitTag;
+		vector<double> HG_Charge,LG_Charge;
+		for(int ientry=0;ientry<times.size();ientry++){
+			size_t begin=first_hit[ientry],end=first_hit[ientry+1];
+			cellID.assign(hit_cellID.begin()+begin,hit_cellID.begin()+end);
+			hitTag.assign(end-begin,sel_hittag);
+			HG_Charge.assign(hit_HG.begin()+begin,hit_HG.begin()+end);
+			LG_Charge.assign(hit_LG.begin()+begin,hit_LG.begin()+end);
+			FillCut(cellID,hitTag,HG_Charge,LG_Charge,sel_hittag,dac_chn,Event_Time->GetBinContent(times[ientry]),flag);
+		}
+		delete Event_Time;
+	}
+	dm.SetEventSink(nullptr);
+	return WritePedestal();
+}
+
+int PedestalManager::DacChannel(const string &file,const int &sel_hittag)
+{
+	// DAC files are named ..._chn<channel>_..., the injected channel is skipped
+	if(sel_hittag != 1)return -1;
+	string skipchannel = file.substr(file.find_last_of('/')+1);
+	int n_chn=skipchannel.find("chn");
+	if(n_chn==-1)return -1;
+	skipchannel = skipchannel.substr(n_chn+3);
+	skipchannel = skipchannel.substr(0,skipchannel.find_last_of('_'));
+	return stoi(skipchannel);
+}
+
+TH1I *PedestalManager::EventTimeHist(const vector<unsigned int> &times)
+{
+	// Range up to the last non-zero Event_Time among the last three events
+	int Nentry = times.size();
+	unsigned int last = Nentry>0 ? times[Nentry-1] : 0;
+	if(last<=0 && Nentry>1)last = times[Nentry-2];
+	if(last<=0 && Nentry>2)last = times[Nentry-3];
+	TH1I *Event_Time = new TH1I("Event_Time","Event_Time",last,0,last);
+	Event_Time->SetDirectory(0);
+	for(int i=0;i<Nentry;i++)Event_Time->Fill(times[i]);
+	return Event_Time;
+}
+
+void PedestalManager::FillAll(const vector<int> &cellID,const vector<int> &hitTag,const vector<double> &HG_Charge,const vector<double> &LG_Charge,const int &sel_hittag,const int &dac_chn)
+{
+	for(int i=0;i<hitTag.size();i++)
+	{
+		if(hitTag.at(i)!=sel_hittag)continue;
+		int cellid = cellID.at(i);
+		int channel = cellid%100;
+		int memo = (cellid%10000)/100;
+		if(memo !=0 )continue;
+		if(dac_chn==channel)continue;
+		mtx.lock();
+		map_cellid_highgain[cellid]->Fill(HG_Charge.at(i));
+		map_cellid_lowgain[cellid]->Fill(LG_Charge.at(i));
+		mtx.unlock();
+	}
+}
+
+void PedestalManager::FillCut(const vector<int> &cellID,const vector<int> &hitTag,const vector<double> &HG_Charge,const vector<double> &LG_Charge,const int &sel_hittag,const int &dac_chn,const double &time_count,int flag[9][40])
+{
+	if(time_count<10){
+		for(int j=0;j<9;j++)
+			for(int p=0;p<40;p++)
+				flag[j][p]=0;
+		return;
+	}
+	for(int i=0;i<hitTag.size();i++){
+		if(hitTag.at(i)!=sel_hittag)continue;
+		int cellid = cellID.at(i);
+		int channel = cellid%100;
+		int memo = (cellid%10000)/100;
+		if(memo !=0 )continue;
+		if(dac_chn==channel)continue;
+		int layer = cellid/1e5;
+		int chip = (cellid%100000)/10000;
+		flag[chip][layer]+=1;
+		if(flag[chip][layer]>36){
+			if(HG_Charge.at(i)>100)map_cellid_highgain[cellid]->Fill(HG_Charge.at(i));
+			if(LG_Charge.at(i)>100)map_cellid_lowgain[cellid]->Fill(LG_Charge.at(i));
+		}
+	}
+}
+
+int PedestalManager::WritePedestal()
+{
 	// Analysis done
 	//
 	// Fill the output tree
@@ -0,0 +1,205 @@
+#include "RingInput.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+RingInput::~RingInput()
+{
+	Close();
+}
+
+bool RingInput::IsStream(const string &name)
+{
+	if (name == "-")
+		return true;
+	struct stat st;
+	if (stat(name.c_str(), &st) != 0)
+		return false;
+	return S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || S_ISCHR(st.st_mode);
+}
+
+int RingInput::Open(const string &name, size_t capacity)
+{
+	Close();
+	struct stat st;
+	if (name == "-")
+		m_fd = STDIN_FILENO;
+	else if (stat(name.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+	{
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (name.size() >= sizeof(addr.sun_path))
+		{
+			LogLine(kError) << "socket path too long: " << name;
+			return 0;
+		}
+		strcpy(addr.sun_path, name.c_str());
+		m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (m_fd >= 0 && connect(m_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+		{
+			LogLine(kError) << "cant connect to " << name << ": " << strerror(errno);
+			close(m_fd);
+			m_fd = -1;
+		}
+	}
+	else
+		m_fd = open(name.c_str(), O_RDONLY);
+	if (m_fd < 0)
+		return 0;
+	m_own_fd = m_fd != STDIN_FILENO;
+	m_capacity = max<size_t>(capacity, 1 << 16);
+	m_data.assign(m_capacity, 0);
+	m_begin = 0;
+	m_written = 0;
+	m_finished = false;
+	m_stop = false;
+	m_reader = thread(&RingInput::ReadLoop, this, name);
+	return 1;
+}
+
+void RingInput::Close()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_not_full.notify_all();
+	if (m_reader.joinable())
+		m_reader.join();
+	if (m_own_fd && m_fd >= 0)
+		close(m_fd);
+	m_fd = -1;
+	m_own_fd = false;
+	m_data = vector<unsigned char>();
+}
+
+void RingInput::ReadLoop(const string &name)
+{
+	while (true)
+	{
+		// 1. Free space behind m_written, up to the end of the ring
+		uint64_t written = 0;
+		size_t space = 0;
+		{
+			unique_lock<mutex> lock(m_mutex);
+			m_not_full.wait(lock, [this]
+							{ return m_stop || m_written - m_begin < m_capacity; });
+			if (m_stop)
+				break;
+			written = m_written;
+			space = m_capacity - (m_written - m_begin);
+		}
+		size_t i = written % m_capacity;
+		size_t n = min(space, m_capacity - i);
+
+		// 2. Read without the lock, the consumer only touches [m_begin, m_written)
+		pollfd pfd = {m_fd, POLLIN, 0};
+		int ready = poll(&pfd, 1, s_poll_ms);
+		if (ready == 0 || (ready < 0 && errno == EINTR))
+			continue;
+		ssize_t got = ready > 0 ? read(m_fd, m_data.data() + i, n) : -1;
+		if (got < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (got < 0)
+			LogLine(kError) << "cant read " << name << ": " << strerror(errno);
+		if (got <= 0)
+			break;
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_written += got;
+		}
+		m_not_empty.notify_all();
+	}
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_finished = true;
+	}
+	m_not_empty.notify_all();
+}
+
+uint64_t RingInput::Wait(uint64_t want)
+{
+	unique_lock<mutex> lock(m_mutex);
+	want = min(want, m_begin + m_capacity);
+	m_not_empty.wait(lock, [this, want]
+					 { return m_finished || m_written >= want; });
+	return m_written;
+}
+
+void RingInput::Release(uint64_t pos)
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_begin = max(m_begin, min(pos, m_written));
+	}
+	m_not_full.notify_one();
+}
+
+uint64_t RingInput::Begin()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_begin;
+}
+
+uint64_t RingInput::Written()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_written;
+}
+
+bool RingInput::Finished()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_finished;
+}
+
+uint64_t RingInput::Find(uint64_t from, uint64_t to, unsigned type_mask, MarkerType *type) const
+{
+	size_t i_from = from % m_capacity;
+	if (i_from + (to - from) <= m_capacity)
+		return from + MarkerScanner::Find(m_data.data() + i_from, to - from, type_mask, type);
+
+	// 1. Part before the wrap point
+	uint64_t wrap = from + (m_capacity - i_from);
+	size_t found = MarkerScanner::Find(m_data.data() + i_from, wrap - from, type_mask, type);
+	if (found < wrap - from)
+		return from + found;
+
+	// 2. Markers across the wrap point, at most 3 bytes on either side
+	unsigned char seam[6];
+	uint64_t seam_from = max(from, wrap - 3);
+	uint64_t seam_to = min(to, wrap + 3);
+	for (uint64_t pos = seam_from; pos < seam_to; ++pos)
+		seam[pos - seam_from] = At(pos);
+	found = MarkerScanner::Find(seam, seam_to - seam_from, type_mask, type);
+	if (found < seam_to - seam_from)
+		return seam_from + found;
+
+	// 3. Part after the wrap point
+	return wrap + MarkerScanner::Find(m_data.data(), to - wrap, type_mask, type);
+}
+
+const unsigned char *RingInput::Data(uint64_t pos, size_t size, vector<unsigned char> &scratch) const
+{
+	size_t i = pos % m_capacity;
+	if (i + size <= m_capacity)
+		return m_data.data() + i;
+	// An event bag split by the wrap point is joined in scratch
+	size_t first = m_capacity - i;
+	scratch.resize(size);
+	memcpy(scratch.data(), m_data.data() + i, first);
+	memcpy(scratch.data() + first, m_data.data(), size - first);
+	return scratch.data();
+}
@@ -1,8 +1,19 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <sys/stat.h>
+#include "TROOT.h"
 #include "config.h"
 #include "DatManager.h"
+#include "Logger.h"
 #include "DacManager.h"
 #include "PedestalManager.h"
 
@@ -26,19 +37,56 @@ int Config::Run()
 			cout << "auto gain mode: ON" << endl;
 		if (conf["DAT-ROOT"]["cherenkov"].as<bool>())
 			cout << "cherenkov detector: ON" << endl;
+		if (conf["DAT-ROOT"]["mmap"].as<bool>(false))
+			cout << "mmap input: ON" << endl;
+		if (conf["DAT-ROOT"]["threads"].as<int>(1) > 1)
+			cout << "decoding threads: " << conf["DAT-ROOT"]["threads"].as<int>(1) << endl;
+		if (conf["DAT-ROOT"]["index"].as<bool>(false))
+			cout << "event index: ON" << endl;
+		if (conf["DAT-ROOT"]["chunks"].as<int>(1) > 1)
+			cout << "chunks per file: " << conf["DAT-ROOT"]["chunks"].as<int>(1) << endl;
+		if (conf["DAT-ROOT"]["pipeline"].as<int>(0) > 0)
+			cout << "pipeline unpacking threads: " << conf["DAT-ROOT"]["pipeline"].as<int>(0) << endl;
+		if (conf["DAT-ROOT"]["follow"].as<bool>(false))
+			cout << "follow mode: ON" << endl;
+		if (conf["DAT-ROOT"]["stats"].as<bool>(false))
+			cout << "decode statistics: ON" << endl;
+		if (conf["DAT-ROOT"]["compact"].as<bool>(false))
+			cout << "compact output: ON" << endl;
+		Logger &logger = Logger::Instance();
+		logger.SetLevel(conf["DAT-ROOT"]["log-level"].as<string>("info"));
+		logger.SetRateLimit(conf["DAT-ROOT"]["log-burst"].as<int>(20), conf["DAT-ROOT"]["log-rate"].as<double>(1));
+		if (conf["DAT-ROOT"]["log-file"].as<string>("") != "")
+		{
+			cout << "log file: " << conf["DAT-ROOT"]["log-file"].as<string>("") << endl;
+			logger.SetFile(conf["DAT-ROOT"]["log-file"].as<string>(""));
+		}
+		if (conf["DAT-ROOT"]["implicit-mt"].as<int>(0) > 0)
+		{
+			cout << "implicit MT compression threads: " << conf["DAT-ROOT"]["implicit-mt"].as<int>(0) << endl;
+			ROOT::EnableImplicitMT(conf["DAT-ROOT"]["implicit-mt"].as<int>(0));
+		}
+		if (conf["DAT-ROOT"]["rntuple"].as<bool>(false))
+		{
+			if (NTupleWriter::Available())
+				cout << "RNTuple output: ON" << endl;
+			else
+				cout << "WARNING: hbuana was built without RNTuple, writing TTree output." << endl;
+		}
 		if (conf["DAT-ROOT"]["file-list"].as<std::string>() == "" || conf["DAT-ROOT"]["output-dir"].as<std::string>() == "")
 		{
 			cout << "ERROR: Please specify file list and output-dir for dat files." << endl;
 		}
 		else
 		{
-			DatManager dm;
+			vector<string> dat_files;
 			ifstream dat_list(conf["DAT-ROOT"]["file-list"].as<std::string>());
 			string dat_temp;
 			while (dat_list >> dat_temp) // One .dat file
 			{
-				dm.Decode(dat_temp, conf["DAT-ROOT"]["output-dir"].as<std::string>(), conf["DAT-ROOT"]["auto-gain"].as<bool>(), conf["DAT-ROOT"]["cherenkov"].as<bool>());
+				dat_files.push_back(dat_temp);
 			}
+			DecodeDatList(dat_files, conf["DAT-ROOT"]["threads"].as<int>(1));
 		}
 	}
 	if (conf["Pedestal"]["on-off"].as<bool>())
@@ -50,14 +98,32 @@ int Config::Run()
 			cout << "Pedestal mode for cosmic events: ON" << endl;
 			_instance->Init(conf["Pedestal"]["Cosmic"]["output-file"].as<string>().c_str());
 			_instance->Setmt(conf["Pedestal"]["Cosmic"]["usemt"].as<bool>());
-			_instance->AnaPedestal(conf["Pedestal"]["Cosmic"]["file-list"].as<std::string>(), 0);
+			if (conf["Pedestal"]["Cosmic"]["raw"].as<bool>(false))
+			{
+				cout << "Pedestal from .dat files: ON" << endl;
+				DatManager dm;
+				SetupDatManager(dm);
+				_instance->AnaPedestalRaw(conf["Pedestal"]["Cosmic"]["file-list"].as<std::string>(), 0, dm, conf["DAT-ROOT"]["output-dir"].as<std::string>(),
+										 conf["DAT-ROOT"]["auto-gain"].as<bool>(), conf["DAT-ROOT"]["cherenkov"].as<bool>());
+			}
+			else
+				_instance->AnaPedestal(conf["Pedestal"]["Cosmic"]["file-list"].as<std::string>(), 0);
 			PedestalManager::DeleteInstance();
 		}
 		if (conf["Pedestal"]["DAC"]["on-off"].as<bool>())
 		{
 			cout << "Pedestal mode for DAC events: ON" << endl;
 			_instance->Init(conf["Pedestal"]["DAC"]["output-file"].as<string>().c_str());
-			_instance->AnaPedestal(conf["Pedestal"]["DAC"]["file-list"].as<std::string>(), 1);
+			if (conf["Pedestal"]["DAC"]["raw"].as<bool>(false))
+			{
+				cout << "Pedestal from .dat files: ON" << endl;
+				DatManager dm;
+				SetupDatManager(dm);
+				_instance->AnaPedestalRaw(conf["Pedestal"]["DAC"]["file-list"].as<std::string>(), 1, dm, conf["DAT-ROOT"]["output-dir"].as<std::string>(),
+										 conf["DAT-ROOT"]["auto-gain"].as<bool>(), conf["DAT-ROOT"]["cherenkov"].as<bool>());
+			}
+			else
+				_instance->AnaPedestal(conf["Pedestal"]["DAC"]["file-list"].as<std::string>(), 1);
 			PedestalManager::DeleteInstance();
 		}
 	}
@@ -81,6 +147,130 @@ int Config::Run()
 	return 1;
 }
 
+// Apply the DAT-ROOT options to one decoder
+void Config::SetupDatManager(DatManager &dm)
+{
+	dm.SetMmap(conf["DAT-ROOT"]["mmap"].as<bool>(false));
+	dm.SetIndex(conf["DAT-ROOT"]["index"].as<bool>(false));
+	dm.SetDecompressThreads(conf["DAT-ROOT"]["decompress-threads"].as<int>(0));
+	dm.SetChunks(conf["DAT-ROOT"]["chunks"].as<int>(1));
+	dm.SetPipeline(conf["DAT-ROOT"]["pipeline"].as<int>(0));
+	dm.SetFollow(conf["DAT-ROOT"]["follow"].as<bool>(false));
+	dm.SetFollowTimeout(conf["DAT-ROOT"]["follow-timeout"].as<int>(60));
+	dm.SetAutoSaveInterval(conf["DAT-ROOT"]["autosave"].as<int>(10));
+	dm.SetCheckpointInterval(conf["DAT-ROOT"]["checkpoint"].as<double>(0));
+	dm.SetRingSize(conf["DAT-ROOT"]["ring-size"].as<int>(16));
+	dm.SetFelix(conf["DAT-ROOT"]["felix"].as<bool>(false));
+	dm.SetFelixWindow(conf["DAT-ROOT"]["felix-window"].as<int>(64));
+	dm.SetEventBuilder(conf["DAT-ROOT"]["event-builder"].as<int>(0));
+	dm.SetEventBuilderLayers(conf["DAT-ROOT"]["event-builder-layers"].as<vector<int>>(vector<int>()));
+	// Selection ranges are [min, max] sequences, -1 as max for no limit
+	auto range = [this](const char *key)
+	{
+		vector<long long> r = conf["DAT-ROOT"][key].as<vector<long long>>(vector<long long>{0, -1});
+		r.resize(2, -1);
+		return r;
+	};
+	vector<long long> r = range("event-range");
+	dm.SetEventRange(r[0], r[1]);
+	r = range("cycle-range");
+	dm.SetCycleRange(r[0], r[1]);
+	r = range("time-range");
+	dm.SetTimeRange(r[0], r[1]);
+	r = range("byte-range");
+	dm.SetByteRange(r[0], r[1]);
+	dm.SetRNTuple(conf["DAT-ROOT"]["rntuple"].as<bool>(false));
+	dm.SetCompact(conf["DAT-ROOT"]["compact"].as<bool>(false));
+	dm.SetStats(conf["DAT-ROOT"]["stats"].as<bool>(false));
+	dm.SetZeroSuppress(conf["DAT-ROOT"]["zero-suppress"].as<bool>(false));
+	dm.SetZSThreshold(conf["DAT-ROOT"]["zs-threshold"].as<double>(-1));
+	dm.SetZSThresholdFile(conf["DAT-ROOT"]["zs-threshold-file"].as<string>(""));
+	dm.SetZSPrescale(conf["DAT-ROOT"]["zs-prescale"].as<int>(100));
+	dm.SetCompression(conf["DAT-ROOT"]["compression"].as<string>(""), conf["DAT-ROOT"]["compression-level"].as<int>(5));
+	dm.SetBasketSize(conf["DAT-ROOT"]["basket-size"].as<int>(0));
+	dm.SetAutoFlush(conf["DAT-ROOT"]["autoflush"].as<long long>(0));
+	dm.SetAutoSave(conf["DAT-ROOT"]["tree-autosave"].as<long long>(0));
+}
+
+// Report the files DecodeDatList could not decode, returns 0 if there are any
+static int ReportFailed(int failed, size_t n_files)
+{
+	if (failed == 0)
+		return 1;
+	cout << "ERROR: " << failed << " of " << n_files << " .dat files could not be decoded, see their messages above." << endl;
+	return 0;
+}
+
+// Decode all .dat files, either one after another or on n_threads workers
+int Config::DecodeDatList(const vector<string> &dat_files, int n_threads)
+{
+	const string output_dir = conf["DAT-ROOT"]["output-dir"].as<std::string>();
+	const bool b_auto_gain = conf["DAT-ROOT"]["auto-gain"].as<bool>();
+	const bool b_cherenkov = conf["DAT-ROOT"]["cherenkov"].as<bool>();
+	if (n_threads <= 1 || dat_files.size() <= 1)
+	{
+		DatManager dm;
+		SetupDatManager(dm);
+		int failed = 0;
+		for (const string &dat_file : dat_files)
+		{
+			if (!dm.Decode(dat_file, output_dir, b_auto_gain, b_cherenkov))
+				failed++;
+		}
+		return ReportFailed(failed, dat_files.size());
+	}
+
+	// Shared work queue, largest files first so that the long ones do not start last
+	ROOT::EnableThreadSafety();
+	vector<size_t> order(dat_files.size());
+	vector<long long> file_size(dat_files.size(), 0);
+	iota(order.begin(), order.end(), 0);
+	for (size_t i = 0; i < dat_files.size(); ++i)
+	{
+		struct stat st;
+		if (stat(dat_files[i].c_str(), &st) == 0)
+			file_size[i] = st.st_size;
+	}
+	stable_sort(order.begin(), order.end(), [&file_size](size_t a, size_t b)
+				{ return file_size[a] > file_size[b]; });
+
+	// Summaries are printed in file list order as soon as all earlier files are done
+	atomic<size_t> next(0);
+	mutex mtx;
+	vector<string> summary(dat_files.size());
+	vector<bool> done(dat_files.size(), false);
+	size_t printed = 0;
+	int failed = 0;
+	n_threads = min<int>(n_threads, dat_files.size());
+	vector<unique_ptr<DatManager>> dms;
+	for (int i = 0; i < n_threads; ++i)
+	{
+		dms.emplace_back(new DatManager);
+		SetupDatManager(*dms.back());
+		dms.back()->SetPrintSummary(false);
+	}
+	auto worker = [&](DatManager &dm)
+	{
+		for (size_t k = next++; k < order.size(); k = next++)
+		{
+			size_t i = order[k];
+			int decoded = dm.Decode(dat_files[i], output_dir, b_auto_gain, b_cherenkov);
+			lock_guard<mutex> lock(mtx);
+			failed += !decoded;
+			summary[i] = dm.GetSummary();
+			done[i] = true;
+			for (; printed < done.size() && done[printed]; ++printed)
+				Logger::Instance().Write(summary[printed].substr(0, summary[printed].size() - 1));
+		}
+	};
+	vector<thread> workers;
+	for (int i = 0; i < n_threads; ++i)
+		workers.emplace_back(worker, ref(*dms[i]));
+	for (thread &t : workers)
+		t.join();
+	return ReportFailed(failed, dat_files.size());
+}
+
 // Copy a YAML file from template
 void Config::Print()
 {
@@ -0,0 +1,180 @@
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "DatGenerator.h"
+#include "DatManager.h"
+#include "MappedFile.h"
+#include "MarkerScanner.h"
+
+using namespace std;
+
+// Accumulated wall time of one decode stage
+struct StageTimer
+{
+	string name;
+	double seconds = 0;
+	chrono::steady_clock::time_point t0;
+	void Start() { t0 = chrono::steady_clock::now(); }
+	void Stop() { seconds += chrono::duration<double>(chrono::steady_clock::now() - t0).count(); }
+};
+
+static void Report(const StageTimer &timer, size_t bytes, long events)
+{
+	printf("%-16s %9.3f s %10.1f MB/s %12.0f events/s\n", timer.name.c_str(), timer.seconds,
+		   timer.seconds > 0 ? bytes / timer.seconds / 1e6 : 0., timer.seconds > 0 ? events / timer.seconds : 0.);
+}
+
+// Time the decode stages one by one on a generated (or given) .dat file, e.g.
+// datbench -n 200000 -o /tmp          generate AHCAL_Run0_bench.dat in /tmp and time it
+// datbench -i AHCAL_Run123.dat -o /tmp time an existing file
+int main(int argc, char *argv[])
+{
+	DatGenerator generator;
+	string input_file = "";
+	string output_dir = ".";
+	long n_events = 100000;
+	bool b_auto_gain = false;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		string option = argv[i];
+		string value = argv[i + 1];
+		if (option == "-i")
+			input_file = value;
+		else if (option == "-o")
+			output_dir = value;
+		else if (option == "-n")
+			n_events = stol(value);
+		else if (option == "-m")
+			generator.SetMemoCells(stoi(value));
+		else if (option == "-p")
+			generator.SetChipOccupancy(stod(value));
+		else if (option == "-e")
+			generator.SetErrorRate(stod(value));
+		else if (option == "-g")
+			b_auto_gain = stoi(value);
+		else
+			cout << "unknown option " << option << endl;
+	}
+
+	// 1. Input file
+	if (input_file == "")
+	{
+		input_file = output_dir + "/AHCAL_Run0_bench.dat";
+		auto t0 = chrono::steady_clock::now();
+		if (!generator.Generate(input_file, n_events))
+			return 1;
+		cout << "Generated " << n_events << " events in " << chrono::duration<double>(chrono::steady_clock::now() - t0).count() << " s: " << input_file << endl;
+	}
+	MappedFile f_map;
+	if (!f_map.Open(input_file))
+	{
+		cout << "cant open " << input_file << endl;
+		return 1;
+	}
+	size_t bytes = f_map.Size();
+
+	StageTimer t_event{"CatchEventBag"}, t_scan{"MarkerScanner"}, t_spiroc{"CatchSPIROCBag"}, t_fill_chip{"FillChipBuffer"}, t_decode{"DecodeAEvent"}, t_fill{"Fill"}, t_total{"Decode (mmap)"};
+	DatManager dm;
+
+	// 2. Event bags
+	vector<EventBagView> bags;
+	long cherenkov_counter = 0;
+	size_t pos = 0;
+	EventBagView bag;
+	t_event.Start();
+	while (dm.CatchEventBag(f_map, pos, bag, cherenkov_counter))
+		bags.push_back(bag);
+	t_event.Stop();
+
+	// 3. Marker search alone: one pass over every event bag for its SPIROC headers and footers
+	vector<MarkerPos> markers;
+	size_t spiroc_heads = 0;
+	t_scan.Start();
+	for (const EventBagView &b : bags)
+	{
+		markers.clear();
+		MarkerScanner::Scan(f_map.Data() + b.offset, b.length, markers, MarkerScanner::s_spiroc_markers);
+		for (const MarkerPos &marker : markers)
+			spiroc_heads += marker.type == kSpirocHead;
+	}
+	t_scan.Stop();
+
+	// 4. SPIROC bags, stored flat with the first index of every event bag
+	vector<SPIROCBag> spirocs;
+	vector<size_t> first_spiroc;
+	t_spiroc.Start();
+	for (const EventBagView &b : bags)
+	{
+		first_spiroc.push_back(spirocs.size());
+		const unsigned char *event = f_map.Data() + b.offset;
+		size_t event_pos = 0;
+		SPIROCBag spiroc;
+		while (b.length - event_pos > 74)
+		{
+			if (dm.CatchSPIROCBag(event, b.length, event_pos, spiroc))
+				spirocs.push_back(spiroc);
+		}
+	}
+	first_spiroc.push_back(spirocs.size());
+	t_spiroc.Stop();
+
+	// 5. Chip buffers, channel decoding and TTree filling, timed per event
+	string bench_root = output_dir + "/datbench.root";
+	TFile *fout = TFile::Open(bench_root.c_str(), "RECREATE");
+	TTree *tree = new TTree("Raw_Hit", "data from binary file");
+	dm.SetTreeBranch(tree);
+	long events = 0;
+	for (size_t i = 0; i + 1 < first_spiroc.size(); ++i)
+	{
+		t_fill_chip.Start();
+		for (size_t k = first_spiroc[i]; k < first_spiroc[i + 1]; ++k)
+		{
+			if (spirocs[k].word_No + 4 >= 74)
+				dm.FillChipBuffer(spirocs[k]);
+		}
+		t_fill_chip.Stop();
+		if (dm._chip_arena.Empty())
+			continue;
+		t_decode.Start();
+		for (uint64_t layers = dm._chip_arena.LayerMask(); layers; layers &= layers - 1)
+		{
+			int i_layer = __builtin_ctzll(layers);
+			for (unsigned chips = dm._chip_arena.ChipMask(i_layer); chips; chips &= chips - 1)
+			{
+				int i_chip = __builtin_ctz(chips);
+				int Memo_No = dm._chip_arena.MemoNo(i_layer, i_chip);
+				// All memory cells, like DecodeEventBag
+				for (int i_memo = 0; i_memo < Memo_No; ++i_memo)
+					dm.DecodeAEvent(dm._chip_arena.Get(i_layer, i_chip, i_memo), i_layer, i_chip, i_memo, b_auto_gain);
+			}
+		}
+		dm._chip_arena.Clear();
+		t_decode.Stop();
+		t_fill.Start();
+		tree->Fill();
+		t_fill.Stop();
+		dm.BranchClear();
+		events++;
+	}
+	tree->Write();
+	fout->Close();
+	remove(bench_root.c_str());
+	f_map.Close();
+
+	// 6. The whole decoder for comparison
+	DatManager dm_total;
+	dm_total.SetMmap(true);
+	dm_total.SetPrintSummary(false);
+	t_total.Start();
+	dm_total.Decode(input_file, output_dir, b_auto_gain, 0);
+	t_total.Stop();
+
+	cout << endl
+		 << "Input " << input_file << ": " << bytes / 1e6 << " MB, " << bags.size() << " event bags, " << spirocs.size() << " SPIROC bags, " << events << " events" << endl
+		 << "Marker search: " << MarkerScanner::ISA() << ", " << spiroc_heads << " SPIROC headers" << endl;
+	for (const StageTimer *timer : {&t_event, &t_scan, &t_spiroc, &t_fill_chip, &t_decode, &t_fill, &t_total})
+		Report(*timer, bytes, events);
+	return 0;
+}
@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "DatGenerator.h"
+#include "DatManager.h"
+
+using namespace std;
+
+// One entry of Raw_Hit, read back from an output file
+struct RawHitEntry
+{
+	int Run_Num = 0;
+	unsigned int Event_Time = 0;
+	int CycleID = 0;
+	int TriggerID = 0;
+	vector<int> *CellID = nullptr, *BCID = nullptr, *HitTag = nullptr, *GainTag = nullptr, *GainTag_TDC = nullptr, *Cherenkov = nullptr;
+	vector<double> *HG_Charge = nullptr, *LG_Charge = nullptr, *Hit_Time = nullptr;
+
+	void SetAddress(TTree *tree)
+	{
+		tree->SetBranchAddress("Run_Num", &Run_Num);
+		tree->SetBranchAddress("Event_Time", &Event_Time);
+		tree->SetBranchAddress("CycleID", &CycleID);
+		tree->SetBranchAddress("TriggerID", &TriggerID);
+		tree->SetBranchAddress("CellID", &CellID);
+		tree->SetBranchAddress("BCID", &BCID);
+		tree->SetBranchAddress("HitTag", &HitTag);
+		tree->SetBranchAddress("GainTag", &GainTag);
+		tree->SetBranchAddress("HG_Charge", &HG_Charge);
+		tree->SetBranchAddress("LG_Charge", &LG_Charge);
+		tree->SetBranchAddress("Hit_Time", &Hit_Time);
+		tree->SetBranchAddress("GainTag_TDC", &GainTag_TDC);
+		tree->SetBranchAddress("Cherenkov", &Cherenkov);
+	}
+	bool operator==(const RawHitEntry &other) const
+	{
+		return Run_Num == other.Run_Num && Event_Time == other.Event_Time && CycleID == other.CycleID && TriggerID == other.TriggerID &&
+			   *CellID == *other.CellID && *BCID == *other.BCID && *HitTag == *other.HitTag && *GainTag == *other.GainTag &&
+			   *HG_Charge == *other.HG_Charge && *LG_Charge == *other.LG_Charge && *Hit_Time == *other.Hit_Time &&
+			   *GainTag_TDC == *other.GainTag_TDC && *Cherenkov == *other.Cherenkov;
+	}
+};
+
+// Compare the Raw_Hit trees of two output files entry by entry, returns 1 when they are identical
+static int CompareRawHit(const string &ref_file, const string &file)
+{
+	TFile *f_ref = TFile::Open(ref_file.c_str(), "READ");
+	TFile *f_out = TFile::Open(file.c_str(), "READ");
+	TTree *t_ref = nullptr;
+	TTree *t_out = nullptr;
+	if (f_ref && !f_ref->IsZombie())
+		f_ref->GetObject("Raw_Hit", t_ref);
+	if (f_out && !f_out->IsZombie())
+		f_out->GetObject("Raw_Hit", t_out);
+	int same = 0;
+	if (!t_ref || !t_out)
+		cout << "  no Raw_Hit in " << (t_ref ? file : ref_file) << endl;
+	else if (t_ref->GetEntries() != t_out->GetEntries())
+		cout << "  " << t_out->GetEntries() << " entries instead of " << t_ref->GetEntries() << endl;
+	else
+	{
+		RawHitEntry e_ref, e_out;
+		e_ref.SetAddress(t_ref);
+		e_out.SetAddress(t_out);
+		same = 1;
+		for (Long64_t i = 0; i < t_ref->GetEntries() && same; ++i)
+		{
+			t_ref->GetEntry(i);
+			t_out->GetEntry(i);
+			if (!(e_ref == e_out))
+			{
+				cout << "  entry " << i << " differs: TriggerID " << e_out.TriggerID << " instead of " << e_ref.TriggerID << endl;
+				same = 0;
+			}
+		}
+	}
+	for (TFile *f : {f_ref, f_out})
+	{
+		if (f)
+			f->Close();
+		delete f;
+	}
+	return same;
+}
+
+// Whether an output file holds a Decode_Checkpoint
+static bool HasCheckpoint(const string &file)
+{
+	TFile *f = TFile::Open(file.c_str(), "READ");
+	TNamed *checkpoint = nullptr;
+	if (f && !f->IsZombie())
+		f->GetObject("Decode_Checkpoint", checkpoint);
+	bool found = checkpoint != nullptr;
+	delete checkpoint;
+	if (f)
+		f->Close();
+	delete f;
+	return found;
+}
+
+// Decode a generated .dat file with the serial decode, in chunks, with the pipeline and resumed from a checkpoint,
+// and check that all of them write the same Raw_Hit. Generated FELIX layer files, half of them starting after a
+// triggerID wrap, have to give the Raw_Hit of the .dat file with the same events, e.g.
+// datcheck -n 50000 -o /tmp              generate AHCAL_Run0_check.dat in /tmp and check it
+// datcheck -i AHCAL_Run123.dat -o /tmp    check an existing file
+int main(int argc, char *argv[])
+{
+	DatGenerator generator;
+	const int first_trigger = 60000;
+	generator.SetFirstTrigger(first_trigger); // Trigger rollovers, also inside the chunks and between them
+	generator.SetLayers(4);
+	generator.SetErrorRate(0.001);
+	string input_file = "";
+	string output_dir = ".";
+	long n_events = 50000;
+	const int kill_at = 3; // The first checkpoint decode is killed right after this checkpoint
+	int child_kill_at = 0; // -k, given to that first decode: run only it and kill it after this checkpoint
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		string option = argv[i];
+		string value = argv[i + 1];
+		if (option == "-i")
+			input_file = value;
+		else if (option == "-o")
+			output_dir = value;
+		else if (option == "-n")
+			n_events = stol(value);
+		else if (option == "-l")
+			generator.SetLayers(stoi(value));
+		else if (option == "-m")
+			generator.SetMemoCells(stoi(value));
+		else if (option == "-e")
+			generator.SetErrorRate(stod(value));
+		else if (option == "-k")
+			child_kill_at = stoi(value);
+		else
+			cout << "unknown option " << option << endl;
+	}
+
+	// 1. Input file
+	bool b_generated = input_file == "";
+	if (b_generated)
+	{
+		input_file = output_dir + "/AHCAL_Run0_check.dat";
+		if (!generator.Generate(input_file, n_events))
+			return 1;
+		cout << "Generated " << n_events << " events, " << generator.GetErrorNo() << " corrupted: " << input_file << endl;
+	}
+	string name = input_file.substr(input_file.find_last_of('/') + 1);
+	name = name.substr(0, name.find_last_of('.')) + ".root";
+
+	// 2. Decode modes, all of them read the mapped file
+	struct Mode
+	{
+		string name;
+		function<void(DatManager &)> setup;
+	};
+	vector<Mode> modes = {
+		{"serial", [](DatManager &) {}},
+		{"chunks", [](DatManager &dm)
+		 { dm.SetChunks(4); }},
+		{"chunks_index", [](DatManager &dm)
+		 { dm.SetChunks(4); dm.SetIndex(true); }},
+		{"pipeline", [](DatManager &dm)
+		 { dm.SetPipeline(2); }},
+		{"checkpoint", [](DatManager &dm)
+		 { dm.SetCheckpointInterval(0.01); }},
+	};
+	int failed = 0;
+	for (const Mode &mode : modes)
+	{
+		if (child_kill_at > 0 && mode.name != "checkpoint")
+			continue;
+		string dir = output_dir + "/datcheck_" + mode.name;
+		mkdir(dir.c_str(), 0755);
+		string out_file = dir + "/" + name;
+		remove(out_file.c_str());
+		string summary;
+		auto decode = [&](const function<void(DatManager &)> &extra)
+		{
+			DatManager dm;
+			dm.SetMmap(true);
+			dm.SetPrintSummary(false);
+			mode.setup(dm);
+			extra(dm);
+			int ok = dm.Decode(input_file, dir, false, false);
+			summary = dm.GetSummary();
+			return ok;
+		};
+		if (child_kill_at > 0)
+		{
+			int checkpoints = 0;
+			decode([&checkpoints, child_kill_at](DatManager &dm)
+				   { dm.SetCheckpointHook([&checkpoints, child_kill_at](size_t)
+										  { if (++checkpoints == child_kill_at) raise(SIGKILL); }); });
+			return 1; // Ended before that checkpoint
+		}
+		if (mode.name == "checkpoint")
+		{
+			// The first decode runs in a new datcheck that kills itself right after its kill_at-th checkpoint, the second
+			// one has to continue from there. Not in the forked copy of this process, it has no logger thread
+			pid_t child = fork();
+			if (child == 0)
+			{
+				execl("/proc/self/exe", argv[0], "-i", input_file.c_str(), "-o", output_dir.c_str(), "-k", to_string(kill_at).c_str(), (char *)nullptr);
+				_exit(127);
+			}
+			int status = 0;
+			waitpid(child, &status, 0);
+			if (!WIFSIGNALED(status) || !HasCheckpoint(out_file))
+			{
+				cout << mode.name << ": the first decode ended before checkpoint " << kill_at << ", generate more events (-n)" << endl;
+				failed++;
+				continue;
+			}
+		}
+		if (!decode([](DatManager &) {}))
+		{
+			cout << mode.name << ": decode failed" << endl;
+			failed++;
+			continue;
+		}
+		if (mode.name == "checkpoint")
+		{
+			size_t resumed = summary.find("Resumed from the checkpoint");
+			if (resumed == string::npos)
+			{
+				cout << mode.name << ": the second decode did not resume from the checkpoint" << endl;
+				failed++;
+				continue;
+			}
+			cout << mode.name << ": " << summary.substr(resumed, summary.find('\n', resumed) - resumed) << endl;
+		}
+		if (mode.name == "serial")
+			continue;
+		int same = CompareRawHit(output_dir + "/datcheck_serial/" + name, out_file);
+		cout << mode.name << ": " << (same ? "same Raw_Hit as the serial decode" : "Raw_Hit differs from the serial decode") << endl;
+		failed += !same;
+	}
+
+	// 3. FELIX layer files of generated events, the odd layers start at triggerID 4 after the first wrap
+	if (b_generated)
+	{
+		string list_file = output_dir + "/AHCAL_Run0_felix.list";
+		long n_felix = min(n_events, 10000L);
+		if (!generator.GenerateFelix(list_file, n_felix, 0x10000 - first_trigger + 4))
+			return 1;
+		string felix_name = "AHCAL_Run0_felix.root";
+		bool decoded = true;
+		for (bool felix : {false, true})
+		{
+			string dir = output_dir + (felix ? "/datcheck_felix" : "/datcheck_felix_dat");
+			mkdir(dir.c_str(), 0755);
+			remove((dir + "/" + felix_name).c_str());
+			DatManager dm;
+			dm.SetPrintSummary(false);
+			dm.SetMmap(!felix); // Like the modes above
+			dm.SetFelix(felix);
+			decoded = decoded && dm.Decode(felix ? list_file : output_dir + "/AHCAL_Run0_felix.dat", dir, false, false);
+		}
+		int same = decoded && CompareRawHit(output_dir + "/datcheck_felix_dat/" + felix_name, output_dir + "/datcheck_felix/" + felix_name);
+		cout << "felix: " << (!decoded ? "decode failed" : same ? "same Raw_Hit as the .dat file of its events" : "Raw_Hit differs from the .dat file of its events") << endl;
+		failed += !same;
+	}
+	return failed > 0;
+}
@@ -0,0 +1,52 @@
+#include <iostream>
+#include <string>
+#include "DatGenerator.h"
+
+using namespace std;
+
+// Write a synthetic .dat file, e.g. datgen -o AHCAL_Run1_sim.dat -n 100000 -m 2 -e 0.01
+int main(int argc, char *argv[])
+{
+	DatGenerator generator;
+	string output_file = "";
+	long n_events = 10000;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		string option = argv[i];
+		string value = argv[i + 1];
+		if (option == "-o")
+			output_file = value;
+		else if (option == "-n")
+			n_events = stol(value);
+		else if (option == "-l")
+			generator.SetLayers(stoi(value));
+		else if (option == "-c")
+			generator.SetChips(stoi(value));
+		else if (option == "-m")
+			generator.SetMemoCells(stoi(value));
+		else if (option == "-p")
+			generator.SetChipOccupancy(stod(value));
+		else if (option == "-h")
+			generator.SetHitOccupancy(stod(value));
+		else if (option == "-k")
+			generator.SetCherenkovRate(stod(value));
+		else if (option == "-e")
+			generator.SetErrorRate(stod(value));
+		else if (option == "-t")
+			generator.SetFirstTrigger(stoi(value));
+		else if (option == "-s")
+			generator.SetSeed(stoul(value));
+		else
+			cout << "unknown option " << option << endl;
+	}
+	if (output_file == "")
+	{
+		cout << "Usage: datgen -o output.dat [-n events] [-l layers] [-c chips per layer] [-m memory cells per chip]" << endl;
+		cout << "              [-p chip occupancy] [-h hit occupancy] [-k cherenkov rate] [-e error rate] [-t first trigger] [-s seed]" << endl;
+		return 1;
+	}
+	if (!generator.Generate(output_file, n_events))
+		return 1;
+	cout << "Wrote " << n_events << " events (" << generator.GetErrorNo() << " corrupted) to " << output_file << endl;
+	return 0;
+}